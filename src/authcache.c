@@ -0,0 +1,186 @@
+#include <string.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include <debug.h>
+#include <mutex.h>
+#include <utils.h>
+
+#include "authcache.h"
+
+/*
+ * Cache of subscribe_url decisions. Subscribe messages that agree on the
+ * configured fields share an entry, a decision is reused for ttl seconds
+ * and lookups arriving while the first request is in flight wait for its
+ * answer instead of sending their own. Only decisions are cached, 2xx
+ * allowing and 401/403 denying, and the fields have to be configured, so
+ * that per viewer fields like tokens are never left out of the key by
+ * default. Lookups in flight and their waiters count against the size too.
+ */
+
+typedef struct janus_pubsub_authcache_entry {
+    gchar *key;
+    gboolean pending;                   /* Request in flight, waiters are queued */
+    GList *waiters;
+    long status;                        /* HTTP status of the cached decision */
+    gint64 expires;
+    GList *link;                        /* Position in the expiry queue once decided */
+} janus_pubsub_authcache_entry;
+
+static guint cache_ttl;
+static guint cache_max_size;
+static gchar **cache_fields;
+static GHashTable *entries;
+static GQueue *expiry;                  /* Decided entries, oldest first */
+static guint waiting;                   /* Pending entries and their waiters */
+static janus_mutex cache_mutex;
+
+
+static void janus_pubsub_authcache_entry_free(janus_pubsub_authcache_entry *entry) {
+    g_free(entry->key);
+    g_list_free(entry->waiters);
+    g_free(entry);
+}
+
+
+static void janus_pubsub_authcache_evict(janus_pubsub_authcache_entry *entry) {
+    g_queue_delete_link(expiry, entry->link);
+    g_hash_table_remove(entries, entry->key);
+}
+
+
+void janus_pubsub_authcache_init(guint ttl, guint max_size, const char *fields) {
+    cache_ttl = ttl;
+    cache_max_size = max_size > 0 ? max_size : 1;
+    janus_mutex_init(&cache_mutex);
+    if (cache_ttl == 0) {
+        return;
+    }
+    cache_fields = g_strsplit(fields ? fields : "", ",", -1);
+    gboolean keyed = FALSE;
+    int i;
+    for (i = 0; cache_fields[i] != NULL; i++) {
+        keyed |= *g_strstrip(cache_fields[i]) != '\0';
+    }
+    if (!keyed) {
+        JANUS_LOG(LOG_WARN, "PubSub subscribe cache needs auth_cache_fields, not caching\n");
+        g_strfreev(cache_fields);
+        cache_fields = NULL;
+        return;
+    }
+    entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+        (GDestroyNotify)janus_pubsub_authcache_entry_free);
+    expiry = g_queue_new();
+    JANUS_LOG(LOG_INFO, "PubSub subscribe cache: %us TTL, %u entries, keyed on %s\n",
+        cache_ttl, cache_max_size, fields);
+}
+
+
+void janus_pubsub_authcache_destroy(void) {
+    if (entries == NULL) {
+        return;
+    }
+    janus_mutex_lock(&cache_mutex);
+    g_queue_free(expiry);
+    expiry = NULL;
+    g_hash_table_destroy(entries);
+    entries = NULL;
+    g_strfreev(cache_fields);
+    cache_fields = NULL;
+    janus_mutex_unlock(&cache_mutex);
+}
+
+
+gboolean janus_pubsub_authcache_enabled(void) {
+    return entries != NULL;
+}
+
+
+/* Join the configured fields of the message, missing fields count as null */
+gchar *janus_pubsub_authcache_key(json_t *message) {
+    GString *key = g_string_new(NULL);
+    int i;
+    for (i = 0; cache_fields[i] != NULL; i++) {
+        json_t *value = json_object_get(message, cache_fields[i]);
+        char *text = value ? json_dumps(value, JSON_ENCODE_ANY | JSON_COMPACT) : NULL;
+        g_string_append(key, text ? text : "null");
+        g_string_append_c(key, '\x1f');
+        free(text);
+    }
+    return g_string_free(key, FALSE);
+}
+
+
+/*
+ * Returns HIT with the cached status, PENDING after queueing the waiter
+ * behind the request in flight, or MISS after marking the key pending;
+ * the caller then sends the request and calls complete with the result.
+ * FULL once cache_max_size lookups are waiting, the caller is on its own
+ */
+janus_pubsub_authcache_state janus_pubsub_authcache_lookup(const gchar *key, void *waiter, long *status) {
+    janus_mutex_lock(&cache_mutex);
+    janus_pubsub_authcache_entry *entry = g_hash_table_lookup(entries, key);
+    if (entry != NULL && !entry->pending) {
+        if (entry->expires > janus_get_monotonic_time()) {
+            *status = entry->status;
+            janus_mutex_unlock(&cache_mutex);
+            return JANUS_PUBSUB_AUTHCACHE_HIT;
+        }
+        janus_pubsub_authcache_evict(entry);
+        entry = NULL;
+    }
+    if (waiting >= cache_max_size) {
+        janus_mutex_unlock(&cache_mutex);
+        return JANUS_PUBSUB_AUTHCACHE_FULL;
+    }
+    waiting++;
+    if (entry != NULL) {
+        entry->waiters = g_list_append(entry->waiters, waiter);
+        janus_mutex_unlock(&cache_mutex);
+        return JANUS_PUBSUB_AUTHCACHE_PENDING;
+    }
+    entry = g_malloc0(sizeof(janus_pubsub_authcache_entry));
+    entry->key = g_strdup(key);
+    entry->pending = TRUE;
+    g_hash_table_insert(entries, entry->key, entry);
+    janus_mutex_unlock(&cache_mutex);
+    return JANUS_PUBSUB_AUTHCACHE_MISS;
+}
+
+
+/*
+ * Record the answer for a key looked up with MISS and hand back the
+ * waiters that were queued behind it. Answers that are not cacheable
+ * (the request failed or was not a decision) are only passed on to the waiters
+ */
+GList *janus_pubsub_authcache_complete(const gchar *key, gboolean cacheable, long status) {
+    janus_mutex_lock(&cache_mutex);
+    janus_pubsub_authcache_entry *entry = g_hash_table_lookup(entries, key);
+    if (entry == NULL || !entry->pending) {
+        janus_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+    GList *waiters = entry->waiters;
+    entry->waiters = NULL;
+    waiting -= 1 + g_list_length(waiters);
+    if (!cacheable) {
+        g_hash_table_remove(entries, key);
+        janus_mutex_unlock(&cache_mutex);
+        return waiters;
+    }
+    gint64 now = janus_get_monotonic_time();
+    /* Make room, expired entries first and then the oldest decisions */
+    janus_pubsub_authcache_entry *oldest = NULL;
+    while ((oldest = g_queue_peek_head(expiry)) != NULL &&
+            (oldest->expires <= now || g_queue_get_length(expiry) >= cache_max_size)) {
+        janus_pubsub_authcache_evict(oldest);
+    }
+    entry->pending = FALSE;
+    entry->status = status;
+    entry->expires = now + (gint64)cache_ttl * G_USEC_PER_SEC;
+    g_queue_push_tail(expiry, entry);
+    entry->link = g_queue_peek_tail_link(expiry);
+    janus_mutex_unlock(&cache_mutex);
+    return waiters;
+}
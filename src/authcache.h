@@ -0,0 +1,24 @@
+#ifndef AUTHCACHE_H
+#define AUTHCACHE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+#define PUBSUB_DEFAULT_AUTH_CACHE_TTL 0         /* Seconds, 0 disables the cache */
+#define PUBSUB_DEFAULT_AUTH_CACHE_SIZE 10000
+
+typedef enum janus_pubsub_authcache_state {
+    JANUS_PUBSUB_AUTHCACHE_MISS = 0,    /* Caller sends the request and completes the key */
+    JANUS_PUBSUB_AUTHCACHE_HIT,         /* A cached decision was returned */
+    JANUS_PUBSUB_AUTHCACHE_PENDING,     /* Same request in flight, the waiter was queued */
+    JANUS_PUBSUB_AUTHCACHE_FULL,        /* Too many lookups waiting, caller sends the request uncached */
+} janus_pubsub_authcache_state;
+
+void janus_pubsub_authcache_init(guint ttl, guint max_size, const char *fields);
+void janus_pubsub_authcache_destroy(void);
+gboolean janus_pubsub_authcache_enabled(void);
+gchar *janus_pubsub_authcache_key(json_t *message);
+janus_pubsub_authcache_state janus_pubsub_authcache_lookup(const gchar *key, void *waiter, long *status);
+GList *janus_pubsub_authcache_complete(const gchar *key, gboolean cacheable, long status);
+
+#endif /* AUTHCACHE_H */
@@ -0,0 +1,225 @@
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <debug.h>
+
+#include "batch.h"
+#include "stream.h"
+#include "subscriber.h"
+
+static gboolean batch_enabled = FALSE;
+static guint batch_size = PUBSUB_DEFAULT_BATCH_SIZE;
+static guint batch_packets = PUBSUB_DEFAULT_BATCH_PACKETS;
+
+static void janus_pubsub_batch_free(gpointer data);
+static void janus_pubsub_batch_send(janus_pubsub_batch *batch);
+static GPrivate thread_batch = G_PRIVATE_INIT(janus_pubsub_batch_free);
+
+
+void janus_pubsub_batch_init(gboolean enabled, guint size, guint packets) {
+    batch_enabled = enabled;
+    batch_size = size > 0 ? size : PUBSUB_DEFAULT_BATCH_SIZE;
+    batch_packets = packets > 0 ? packets : PUBSUB_DEFAULT_BATCH_PACKETS;
+    if (batch_enabled) {
+        JANUS_LOG(LOG_INFO, "PubSub forwarder batching: %u datagrams, %u packets per flush\n",
+            batch_size, batch_packets);
+    }
+}
+
+
+gboolean janus_pubsub_batch_enabled(void) {
+    return batch_enabled;
+}
+
+
+static void janus_pubsub_batch_free(gpointer data) {
+    janus_pubsub_batch *batch = (janus_pubsub_batch *)data;
+    if (batch == NULL) {
+        return;
+    }
+    janus_pubsub_batch_flush(batch);
+    g_free(batch->msgs);
+    g_free(batch->iovs);
+    g_free(batch->addrs);
+    g_free(batch->forwarders);
+    g_free(batch->subscribers);
+    g_free(batch->storage);
+    g_free(batch);
+}
+
+
+/* Batch of the calling thread, created on first use */
+janus_pubsub_batch *janus_pubsub_batch_get(void) {
+    janus_pubsub_batch *batch = g_private_get(&thread_batch);
+    if (batch != NULL) {
+        return batch;
+    }
+    batch = g_malloc0(sizeof(janus_pubsub_batch));
+    batch->fd = -1;
+    batch->size = batch_size;
+    batch->msgs = g_malloc0(batch_size * sizeof(*batch->msgs));
+    batch->iovs = g_malloc0(batch_size * sizeof(struct iovec));
+    batch->addrs = g_malloc0(batch_size * sizeof(struct sockaddr_in));
+    batch->forwarders = g_malloc0(batch_size * sizeof(janus_pubsub_forwarder *));
+    batch->subscribers = g_malloc0(batch_size * sizeof(janus_pubsub_subscriber *));
+    if (batch_packets > 1) {
+        batch->storage = g_malloc(batch_packets * JANUS_PUBSUB_BATCH_MTU);
+    }
+    g_private_set(&thread_batch, batch);
+    return batch;
+}
+
+
+/* Start queueing a new packet, the datagrams added next carry this payload */
+static void janus_pubsub_batch_packet(janus_pubsub_batch *batch, char *buf, int len) {
+    batch->open = TRUE;
+    batch->must_flush = FALSE;
+    if (batch->storage == NULL) {
+        batch->current = buf;
+        batch->current_len = len;
+        return;
+    }
+    if (len > JANUS_PUBSUB_BATCH_MTU) {
+        /* Too big to hold on to, send everything with this packet */
+        batch->current = buf;
+        batch->current_len = len;
+        batch->must_flush = TRUE;
+        return;
+    }
+    if (batch->stored == batch_packets) {
+        janus_pubsub_batch_flush(batch);
+    }
+    batch->current = batch->storage + batch->stored * JANUS_PUBSUB_BATCH_MTU;
+    batch->current_len = len;
+    memcpy(batch->current, buf, len);
+    batch->stored++;
+}
+
+
+/* Queue one datagram of the packet being relayed */
+void janus_pubsub_batch_add(janus_pubsub_batch *batch, janus_pubsub_stream *stream, int fd,
+        janus_pubsub_subscriber *subscriber, janus_pubsub_forwarder *forward, char *buf, int len) {
+    if (!batch->open) {
+        janus_pubsub_batch_packet(batch, buf, len);
+    }
+    if (batch->count > 0 && (batch->fd != fd || batch->count == batch->size)) {
+        /* Payload copies stay in place, the current packet still needs them */
+        janus_pubsub_batch_send(batch);
+    }
+    if (batch->count == 0) {
+        janus_pubsub_stream_ref(stream);
+        batch->stream = stream;
+    }
+    guint i = batch->count++;
+    batch->fd = fd;
+    batch->addrs[i] = forward->serv_addr;
+    batch->forwarders[i] = forward;
+    janus_pubsub_subscriber_ref(subscriber);
+    batch->subscribers[i] = subscriber;
+    batch->iovs[i].iov_base = batch->current;
+    batch->iovs[i].iov_len = batch->current_len;
+}
+
+
+/* The relay loop is done with a packet, flush if enough are queued */
+void janus_pubsub_batch_packet_done(janus_pubsub_batch *batch) {
+    if (!batch->open) {
+        return;
+    }
+    batch->open = FALSE;
+    batch->packets++;
+    if (batch->must_flush || batch->packets >= batch_packets) {
+        janus_pubsub_batch_flush(batch);
+    }
+}
+
+
+static void janus_pubsub_batch_error(janus_pubsub_batch *batch, guint i, int error) {
+    janus_pubsub_forwarder *forward = batch->forwarders[i];
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &batch->addrs[i].sin_addr, host, sizeof(host));
+    janus_pubsub_metrics_error(forward->metrics);
+    JANUS_LOG(LOG_WARN, "Error forwarding %s packet to %s:%d... %s (len=%zu)\n",
+        forward->is_data ? "data" : forward->is_video ? "video" : "audio", host, ntohs(batch->addrs[i].sin_port),
+        strerror(error), batch->iovs[i].iov_len);
+}
+
+
+static void janus_pubsub_batch_send(janus_pubsub_batch *batch) {
+    guint i = 0;
+#ifdef LINUX
+    for (i = 0; i < batch->count; i++) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &batch->addrs[i];
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+        hdr->msg_iov = &batch->iovs[i];
+        hdr->msg_iovlen = 1;
+    }
+    i = 0;
+    while (i < batch->count) {
+        int j, sent = sendmmsg(batch->fd, &batch->msgs[i], batch->count - i, 0);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Report the destination that failed and go on with the rest */
+            janus_pubsub_batch_error(batch, i, errno);
+            i++;
+            continue;
+        }
+        for (j = 0; j < sent; j++) {
+            janus_pubsub_metrics_out(batch->forwarders[i + j]->metrics, batch->iovs[i + j].iov_len);
+        }
+        i += sent;
+        if (i < batch->count && sent == 0) {
+            janus_pubsub_batch_error(batch, i, EAGAIN);
+            i++;
+        }
+    }
+#else
+    for (i = 0; i < batch->count; i++) {
+        if (sendto(batch->fd, batch->iovs[i].iov_base, batch->iovs[i].iov_len, 0,
+                (struct sockaddr *)&batch->addrs[i], sizeof(struct sockaddr_in)) < 0) {
+            janus_pubsub_batch_error(batch, i, errno);
+        } else {
+            janus_pubsub_metrics_out(batch->forwarders[i]->metrics, batch->iovs[i].iov_len);
+        }
+    }
+#endif
+    /* The socket and forwarders are not looked at anymore, their owners can go */
+    for (i = 0; i < batch->count; i++) {
+        janus_pubsub_subscriber_unref(batch->subscribers[i]);
+        batch->subscribers[i] = NULL;
+    }
+    batch->count = 0;
+    janus_pubsub_stream_unref(batch->stream);
+    batch->stream = NULL;
+}
+
+
+void janus_pubsub_batch_flush(janus_pubsub_batch *batch) {
+    if (batch->count > 0) {
+        janus_pubsub_batch_send(batch);
+    }
+    batch->packets = 0;
+    batch->stored = 0;
+}
+
+
+/* Flush the calling thread's batch, at the end of a burst of packets */
+void janus_pubsub_batch_flush_current(void) {
+    janus_pubsub_batch *batch = g_private_get(&thread_batch);
+    if (batch != NULL) {
+        janus_pubsub_batch_flush(batch);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#include "forward.h"
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_BATCH_SIZE 64          /* Datagrams per sendmmsg call */
+#define PUBSUB_DEFAULT_BATCH_PACKETS 1        /* RTP packets collected before a flush */
+
+#define JANUS_PUBSUB_BATCH_MTU 1500
+
+struct jansus_pubsub_stream;
+struct janus_pubsub_subscriber;
+
+/*
+ * Per thread batch of outgoing forwarder datagrams. The relay loop queues
+ * one datagram per forwarder and the batch is sent with a single
+ * sendmmsg call, either once per packet or once every few packets.
+ * A flush can come after the relay loop let go of the stream, so the
+ * batch references the stream owning the socket and each queued datagram
+ * the subscriber owning its forwarder, until they are sent.
+ */
+typedef struct janus_pubsub_batch {
+    int fd;                             /* All queued datagrams go out on this socket */
+    struct jansus_pubsub_stream *stream;  /* Referenced while datagrams are queued, owns fd */
+    guint size;                         /* Capacity in datagrams */
+    guint count;                        /* Queued datagrams */
+    guint packets;                      /* Packets queued since the last flush */
+    gboolean open;                      /* A packet is being queued */
+    char *current;                      /* Payload of the packet being queued */
+    int current_len;
+#ifdef LINUX
+    struct mmsghdr *msgs;
+#else
+    struct msghdr *msgs;
+#endif
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+    janus_pubsub_forwarder **forwarders;
+    struct janus_pubsub_subscriber **subscribers;  /* Referenced, owning the forwarder of the same slot */
+    char *storage;                      /* Payload copies, when holding several packets */
+    guint stored;
+    gboolean must_flush;                /* The current packet could not be copied */
+} janus_pubsub_batch;
+
+void janus_pubsub_batch_init(gboolean enabled, guint size, guint packets);
+gboolean janus_pubsub_batch_enabled(void);
+janus_pubsub_batch *janus_pubsub_batch_get(void);
+void janus_pubsub_batch_add(janus_pubsub_batch *batch, struct jansus_pubsub_stream *stream, int fd,
+        struct janus_pubsub_subscriber *subscriber, janus_pubsub_forwarder *forward, char *buf, int len);
+void janus_pubsub_batch_packet_done(janus_pubsub_batch *batch);
+void janus_pubsub_batch_flush(janus_pubsub_batch *batch);
+void janus_pubsub_batch_flush_current(void);
+
+#endif /* BATCH_H */
@@ -0,0 +1,447 @@
+/*
+ * Relay microbenchmark. Loads the plugin against a stub gateway whose
+ * relay callbacks only count, then drives synthetic RTP through
+ * janus_pubsub_relay_rtp and subscriber RTCP through
+ * janus_pubsub_incoming_rtcp. Every ingress thread publishes its own
+ * stream, as a WebRTC publisher would. Results are printed as one JSON
+ * object per run.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include <plugins/plugin.h>
+#include <mutex.h>
+#include <rtcp.h>
+#include <rtp.h>
+#include <utils.h>
+
+#include "janus_pubsub.h"
+#include "session.h"
+#include "subscriber.h"
+#include "stream.h"
+#include "forward.h"
+#include "batch.h"
+#include "metrics.h"
+
+janus_plugin *create(void);
+void janus_pubsub_relay_rtp(void *stream_p, int video, char *buf, int len);
+void janus_pubsub_relay_data(void *stream_p, char *buf, int len);
+
+/*
+ * Allocation counting. Calls are counted across all threads, the plugin's
+ * workers included, while a run is being timed. Linux only, where glibc
+ * lets the executable's malloc wrap its own
+ */
+static volatile gint counting;
+static volatile gint allocations;
+
+#ifdef LINUX
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    if (counting) {
+        g_atomic_int_inc(&allocations);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) {
+        g_atomic_int_inc(&allocations);
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) {
+        g_atomic_int_inc(&allocations);
+    }
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+
+/* Stub gateway, relayed packets are only counted, per thread */
+static janus_pubsub_metrics *relayed_rtp;
+static janus_pubsub_metrics *relayed_rtcp;
+static janus_pubsub_metrics *relayed_data;
+
+static int bench_push_event(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction,
+        json_t *message, json_t *jsep) {
+    return 0;
+}
+
+static void bench_relay_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
+    janus_pubsub_metrics_out(relayed_rtp, len);
+}
+
+static void bench_relay_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
+    janus_pubsub_metrics_out(relayed_rtcp, len);
+}
+
+static void bench_relay_data(janus_plugin_session *handle, char *buf, int len) {
+    janus_pubsub_metrics_out(relayed_data, len);
+}
+
+static void bench_close_pc(janus_plugin_session *handle) {
+}
+
+static void bench_end_session(janus_plugin_session *handle) {
+}
+
+static gboolean bench_events_is_enabled(void) {
+    return FALSE;
+}
+
+static void bench_notify_event(janus_plugin *plugin, janus_plugin_session *handle, json_t *event) {
+}
+
+static janus_callbacks bench_gateway = {
+    .push_event = bench_push_event,
+    .relay_rtp = bench_relay_rtp,
+    .relay_rtcp = bench_relay_rtcp,
+    .relay_data = bench_relay_data,
+    .close_pc = bench_close_pc,
+    .end_session = bench_end_session,
+    .events_is_enabled = bench_events_is_enabled,
+    .notify_event = bench_notify_event,
+};
+
+
+typedef struct bench_options {
+    guint subscribers;                  /* WebRTC subscribers per stream */
+    guint forwarders;                   /* RTP forwarders per stream */
+    guint packet_size;
+    guint threads;                      /* Ingress threads, one stream each */
+    guint packets;                      /* RTP packets per thread */
+    guint rtcp;                         /* Subscriber RTCP packets per thread */
+    const char *config_path;
+} bench_options;
+
+typedef struct bench_thread {
+    guint index;
+    GThread *thread;
+    janus_pubsub_stream *stream;
+    janus_plugin_session **handles;     /* Subscriber handles, for the RTCP run */
+    guint handles_count;
+    gint64 rtp_ns;
+    gint64 rtcp_ns;
+} bench_thread;
+
+static bench_options options = {
+    .subscribers = 100,
+    .forwarders = 0,
+    .packet_size = 1200,
+    .threads = 1,
+    .packets = 100000,
+    .rtcp = 10000,
+    .config_path = "/nonexistent",
+};
+static volatile gint phase;
+static volatile gint ready;
+
+
+static gint64 bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static janus_plugin_session *bench_session(void) {
+    janus_plugin_session *handle = g_malloc0(sizeof(janus_plugin_session));
+    int error = 0;
+    janus_pubsub_create_session(handle, &error);
+    if (error != 0) {
+        fprintf(stderr, "Could not create a session (%d)\n", error);
+        exit(1);
+    }
+    return handle;
+}
+
+
+/* Same setup as a subscribe request, without the HTTP callback and SDP */
+static janus_pubsub_subscriber *bench_subscriber(janus_pubsub_stream *stream, int kind,
+        janus_pubsub_session *session) {
+    janus_pubsub_subscriber *subscriber = janus_pubsub_subscriber_new(janus_random_uint64(), kind);
+    janus_pubsub_layer_init(&subscriber->layer, PUBSUB_DEFAULT_SIMULCAST_SUBSTREAM);
+    subscriber->egress = janus_pubsub_egress_new(stream, subscriber);
+    if (session != NULL) {
+        janus_pubsub_session_ref(session);
+        subscriber->subscriber_session = session;
+        session->kind = JANUS_SESSION_SUBSCRIBE;
+        session->sub_id = subscriber->subscriber_id;
+        janus_pubsub_stream_ref(stream);
+        session->stream = stream;
+    }
+    g_hash_table_insert(stream->subscribers, &subscriber->subscriber_id, subscriber);
+    return subscriber;
+}
+
+
+static void bench_setup(bench_thread *thread, struct sockaddr_in *sink) {
+    janus_plugin_session *publisher = bench_session();
+    janus_pubsub_session *session = (janus_pubsub_session *)publisher->plugin_handle;
+    janus_pubsub_stream *stream = NULL;
+    janus_pubsub_create_stream(&stream);
+    stream->kind = JANUS_PUBTYP_SESSION;
+    stream->name = g_strdup_printf("bench %u", thread->index);
+    stream->relay_rtp = janus_pubsub_relay_rtp;
+    stream->relay_data = janus_pubsub_relay_data;
+    stream->feedback = janus_pubsub_feedback_new(PUBSUB_DEFAULT_KEYFRAME_INTERVAL);
+    stream->owner = session;
+    stream->publisher = session;
+    session->kind = JANUS_SESSION_PUBLISH;
+    session->has_video = TRUE;
+    janus_pubsub_stream_ref(stream);
+    session->stream = stream;
+    if (options.forwarders > 0) {
+        stream->fwd_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    }
+    janus_mutex_lock(&pubsub_streams_mutex);
+    janus_pubsub_add_stream(stream);
+    janus_mutex_unlock(&pubsub_streams_mutex);
+
+    thread->handles = g_malloc0(MAX(options.subscribers, 1) * sizeof(janus_plugin_session *));
+    janus_mutex_lock(&stream->subscribers_mutex);
+    guint i;
+    for (i = 0; i < options.subscribers; i++) {
+        janus_plugin_session *handle = bench_session();
+        bench_subscriber(stream, JANUS_SUBTYP_SESSION, (janus_pubsub_session *)handle->plugin_handle);
+        thread->handles[thread->handles_count++] = handle;
+    }
+    for (i = 0; i < options.forwarders; i++) {
+        janus_pubsub_subscriber *subscriber = bench_subscriber(stream, JANUS_SUBTYP_FORWARD, NULL);
+        janus_pubsub_forwarder *forward = g_malloc0(sizeof(janus_pubsub_forwarder));
+        forward->is_video = TRUE;
+        forward->serv_addr = *sink;
+        forward->metrics = janus_pubsub_metrics_new(FALSE);
+        g_hash_table_insert(subscriber->rtp_forwarders, GUINT_TO_POINTER(i + 1), forward);
+    }
+    janus_pubsub_stream_update_snapshot(stream);
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    thread->stream = stream;
+}
+
+
+/* Wait for every thread to be ready for the phase, so they start together */
+static void bench_wait_phase(gint which) {
+    g_atomic_int_inc(&ready);
+    while (g_atomic_int_get(&phase) < which) {
+        g_usleep(100);
+    }
+}
+
+
+static void *bench_thread_run(void *data) {
+    bench_thread *thread = (bench_thread *)data;
+    char *packet = g_malloc0(MAX(options.packet_size, 12));
+    rtp_header *rtp = (rtp_header *)packet;
+    rtp->version = 2;
+    rtp->type = 96;
+    rtp->ssrc = htonl(0x1000 + thread->index);
+    guint i;
+
+    bench_wait_phase(1);
+    gint64 start = bench_now_ns();
+    for (i = 0; i < options.packets; i++) {
+        rtp->seq_number = htons((guint16)i);
+        rtp->timestamp = htonl(i * 3000);
+        janus_pubsub_relay_rtp(thread->stream, 1, packet, options.packet_size);
+        janus_pubsub_batch_flush_current();
+    }
+    thread->rtp_ns = bench_now_ns() - start;
+
+    /* A PLI and an estimate, like a subscriber's compound RTCP */
+    char rtcp_template[36], rtcp[36];
+    janus_rtcp_pli(rtcp_template, 12);
+    janus_rtcp_remb(rtcp_template + 12, 24, 2000000);
+    bench_wait_phase(2);
+    start = bench_now_ns();
+    for (i = 0; i < options.rtcp && thread->handles_count > 0; i++) {
+        memcpy(rtcp, rtcp_template, sizeof(rtcp));
+        janus_pubsub_incoming_rtcp(thread->handles[i % thread->handles_count], 1, rtcp, sizeof(rtcp));
+    }
+    thread->rtcp_ns = bench_now_ns() - start;
+    g_free(packet);
+    return NULL;
+}
+
+
+/* Wait until every thread is done with the previous phase */
+static void bench_wait_ready(void) {
+    while (g_atomic_int_get(&ready) < (gint)options.threads) {
+        g_usleep(100);
+    }
+    g_atomic_int_set(&ready, 0);
+}
+
+
+/* Whether the workers still hold packets of the stream, relayed or queued */
+static gboolean bench_stream_busy(janus_pubsub_stream *stream) {
+    if (g_atomic_int_get(&stream->fanout_pending) > 0) {
+        return TRUE;
+    }
+    gboolean busy = FALSE;
+    GHashTableIter iter;
+    gpointer value;
+    janus_mutex_lock(&stream->subscribers_mutex);
+    g_hash_table_iter_init(&iter, stream->subscribers);
+    while (!busy && g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_egress *egress = ((janus_pubsub_subscriber *)value)->egress;
+        if (egress == NULL) {
+            continue;
+        }
+        /* A scheduled egress holds a reference of its worker until its last burst went out */
+        janus_mutex_lock(&egress->mutex);
+        busy = egress->count > 0 || g_atomic_int_get(&egress->ref) > 1;
+        janus_mutex_unlock(&egress->mutex);
+    }
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    return busy;
+}
+
+
+/* Wait for the fan-out and egress workers to be done with the previous phase */
+static void bench_wait_drained(bench_thread *threads) {
+    guint i;
+    for (i = 0; i < options.threads; i++) {
+        /* Nothing queues to a stream anymore once its fan-out jobs are done */
+        while (bench_stream_busy(threads[i].stream)) {
+            g_usleep(100);
+        }
+    }
+}
+
+
+/* Let all threads go, allocations are counted from here */
+static void bench_start_phase(gint which) {
+    g_atomic_int_set(&allocations, 0);
+    g_atomic_int_set(&counting, 1);
+    g_atomic_int_set(&phase, which);
+}
+
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-s subscribers] [-f forwarders] [-p packet size] [-t threads]\n"
+        "          [-n packets per thread] [-r rtcp per thread] [-c config dir]\n", name);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:p:t:n:r:c:h")) != -1) {
+        switch (opt) {
+            case 's': options.subscribers = atoi(optarg); break;
+            case 'f': options.forwarders = atoi(optarg); break;
+            case 'p': options.packet_size = MAX(atoi(optarg), 12); break;
+            case 't': options.threads = MAX(atoi(optarg), 1); break;
+            case 'n': options.packets = atoi(optarg); break;
+            case 'r': options.rtcp = atoi(optarg); break;
+            case 'c': options.config_path = optarg; break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    janus_plugin *plugin = create();
+    if (plugin->init(&bench_gateway, options.config_path) < 0) {
+        fprintf(stderr, "Could not initialize the plugin\n");
+        return 1;
+    }
+    relayed_rtp = janus_pubsub_metrics_new(FALSE);
+    relayed_rtcp = janus_pubsub_metrics_new(FALSE);
+    relayed_data = janus_pubsub_metrics_new(FALSE);
+
+    /* Forwarded datagrams go to a socket nobody reads, the kernel drops them */
+    struct sockaddr_in sink;
+    memset(&sink, 0, sizeof(sink));
+    socklen_t sink_len = sizeof(sink);
+    int sink_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sink.sin_family = AF_INET;
+    sink.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sink_sock, (struct sockaddr *)&sink, sizeof(sink));
+    getsockname(sink_sock, (struct sockaddr *)&sink, &sink_len);
+
+    bench_thread *threads = g_malloc0(options.threads * sizeof(bench_thread));
+    guint i;
+    for (i = 0; i < options.threads; i++) {
+        threads[i].index = i;
+        bench_setup(&threads[i], &sink);
+        threads[i].thread = g_thread_new("bench", bench_thread_run, &threads[i]);
+    }
+
+    guint copies = options.subscribers + options.forwarders;
+    gint64 rtp_ns = 0, rtcp_ns = 0;
+    bench_wait_ready();
+    bench_start_phase(1);
+    bench_wait_ready();
+    bench_wait_drained(threads);
+    gint rtp_allocations = g_atomic_int_get(&allocations);
+    bench_start_phase(2);
+    for (i = 0; i < options.threads; i++) {
+        g_thread_join(threads[i].thread);
+        rtp_ns = MAX(rtp_ns, threads[i].rtp_ns);
+        rtcp_ns = MAX(rtcp_ns, threads[i].rtcp_ns);
+    }
+    g_atomic_int_set(&counting, 0);
+    gint rtcp_allocations = g_atomic_int_get(&allocations);
+    /* Let the workers finish what is queued before reading the counters */
+    bench_wait_drained(threads);
+
+    janus_pubsub_metrics_stats rtp_stats, rtcp_stats;
+    janus_pubsub_metrics_read(relayed_rtp, &rtp_stats);
+    janus_pubsub_metrics_read(relayed_rtcp, &rtcp_stats);
+    guint64 forwarded = 0;
+    for (i = 0; i < options.threads; i++) {
+        janus_pubsub_metrics_stats stream_stats;
+        janus_pubsub_metrics_read(threads[i].stream->metrics, &stream_stats);
+        forwarded += stream_stats.packets_out;
+    }
+    guint64 rtp_packets = (guint64)options.packets * options.threads;
+    guint64 rtcp_packets = (guint64)options.rtcp * options.threads;
+
+    json_t *result = json_object();
+    json_object_set_new(result, "subscribers", json_integer(options.subscribers));
+    json_object_set_new(result, "forwarders", json_integer(options.forwarders));
+    json_object_set_new(result, "packet_size", json_integer(options.packet_size));
+    json_object_set_new(result, "threads", json_integer(options.threads));
+    json_t *rtp = json_object();
+    json_object_set_new(rtp, "packets", json_integer(rtp_packets));
+    json_object_set_new(rtp, "packets_per_sec", json_real(rtp_ns > 0 ? rtp_packets * 1e9 / rtp_ns : 0));
+    json_object_set_new(rtp, "ns_per_fanout", json_real(copies > 0 && options.packets > 0 ?
+        (double)rtp_ns / options.packets / copies : 0));
+    json_object_set_new(rtp, "allocations_per_packet", json_real(rtp_packets > 0 ?
+        (double)rtp_allocations / rtp_packets : 0));
+    json_object_set_new(rtp, "relayed", json_integer(rtp_stats.packets_out));
+    json_object_set_new(rtp, "relayed_and_forwarded", json_integer(forwarded));
+    json_object_set_new(result, "relay_rtp", rtp);
+    json_t *rtcp = json_object();
+    json_object_set_new(rtcp, "packets", json_integer(rtcp_packets));
+    json_object_set_new(rtcp, "packets_per_sec", json_real(rtcp_ns > 0 ? rtcp_packets * 1e9 / rtcp_ns : 0));
+    json_object_set_new(rtcp, "ns_per_packet", json_real(options.rtcp > 0 ? (double)rtcp_ns / options.rtcp : 0));
+    json_object_set_new(rtcp, "allocations_per_packet", json_real(rtcp_packets > 0 ?
+        (double)rtcp_allocations / rtcp_packets : 0));
+    json_object_set_new(rtcp, "relayed", json_integer(rtcp_stats.packets_out));
+    json_object_set_new(result, "incoming_rtcp", rtcp);
+    char *text = json_dumps(result, JSON_COMPACT);
+    printf("%s\n", text);
+    free(text);
+    json_decref(result);
+
+    plugin->destroy();
+    close(sink_sock);
+    return 0;
+}
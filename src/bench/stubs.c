@@ -0,0 +1,300 @@
+/*
+ * The parts of the Janus core the plugin links against, reduced to what
+ * the benchmark needs. SDP and recording are not used and fail, the
+ * configuration parser only knows key = value lines, RTCP is just enough
+ * for keyframe requests and estimates to go through the feedback merging,
+ * logging is off.
+ */
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include <plugins/plugin.h>
+#include <apierror.h>
+#include <config.h>
+#include <debug.h>
+#include <mutex.h>
+#include <record.h>
+#include <rtcp.h>
+#include <rtp.h>
+#include <sdp-utils.h>
+#include <utils.h>
+
+int janus_log_level = LOG_NONE;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+
+void janus_vprintf(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+
+gint64 janus_get_monotonic_time(void) {
+    return g_get_monotonic_time();
+}
+
+
+gint64 janus_get_real_time(void) {
+    return g_get_real_time();
+}
+
+
+guint32 janus_random_uint32(void) {
+    return g_random_int();
+}
+
+
+guint64 janus_random_uint64(void) {
+    return ((guint64)g_random_int() << 32) | g_random_int();
+}
+
+
+gboolean janus_is_true(const char *value) {
+    return value && (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "1"));
+}
+
+
+gboolean janus_json_is_valid(json_t *val, json_type jtype, unsigned int flags) {
+    return val != NULL && json_typeof(val) == jtype;
+}
+
+
+const char *janus_get_api_error(int error) {
+    return "bench";
+}
+
+
+janus_plugin_result *janus_plugin_result_new(janus_plugin_result_type type, const char *text, json_t *content) {
+    janus_plugin_result *result = g_malloc0(sizeof(janus_plugin_result));
+    result->type = type;
+    result->text = text;
+    result->content = content;
+    return result;
+}
+
+
+/* Just enough INI parsing for the [general] settings of the plugin */
+janus_config *janus_config_parse(const char *config_file) {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(config_file, &contents, NULL, NULL)) {
+        return NULL;
+    }
+    janus_config *config = g_malloc0(sizeof(janus_config));
+    config->name = g_strdup(config_file);
+    janus_config_category *category = NULL;
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    int i;
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        if (*line == '\0' || *line == ';' || *line == '#') {
+            continue;
+        }
+        if (*line == '[') {
+            category = g_malloc0(sizeof(janus_config_category));
+            category->name = g_strndup(line + 1, strcspn(line + 1, "]"));
+            config->categories = g_list_append(config->categories, category);
+            continue;
+        }
+        gchar *equals = strchr(line, '=');
+        if (category == NULL || equals == NULL) {
+            continue;
+        }
+        *equals = '\0';
+        janus_config_item *item = g_malloc0(sizeof(janus_config_item));
+        item->name = g_strdup(g_strstrip(line));
+        item->value = g_strdup(g_strstrip(equals + 1));
+        category->items = g_list_append(category->items, item);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return config;
+}
+
+
+janus_config_item *janus_config_get_item_drilldown(janus_config *config, const char *category, const char *name) {
+    GList *c, *i;
+    for (c = config ? config->categories : NULL; c != NULL; c = c->next) {
+        janus_config_category *cat = (janus_config_category *)c->data;
+        if (strcasecmp(cat->name, category)) {
+            continue;
+        }
+        for (i = cat->items; i != NULL; i = i->next) {
+            janus_config_item *item = (janus_config_item *)i->data;
+            if (!strcasecmp(item->name, name)) {
+                return item;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+void janus_config_print(janus_config *config) {
+}
+
+
+/* Leaked, the benchmark parses one file */
+void janus_config_destroy(janus_config *config) {
+}
+
+
+gboolean janus_vp8_is_keyframe(char *buffer, int len) {
+    return FALSE;
+}
+
+
+gboolean janus_vp9_is_keyframe(char *buffer, int len) {
+    return FALSE;
+}
+
+
+gboolean janus_h264_is_keyframe(char *buffer, int len) {
+    return FALSE;
+}
+
+
+char *janus_rtp_payload(char *buf, int len, int *plen) {
+    rtp_header *rtp = (rtp_header *)buf;
+    int hlen = 12 + rtp->csrccount * 4;
+    if (rtp->extension && len >= hlen + 4) {
+        hlen += 4 + 4 * ntohs(*(uint16_t *)(buf + hlen + 2));
+    }
+    if (len <= hlen) {
+        return NULL;
+    }
+    *plen = len - hlen;
+    return buf + hlen;
+}
+
+
+int janus_rtcp_pli(char *packet, int len) {
+    if (len < 12) {
+        return -1;
+    }
+    memset(packet, 0, 12);
+    packet[0] = (char)0x81;
+    packet[1] = (char)206;
+    packet[3] = 2;
+    return 12;
+}
+
+
+int janus_rtcp_fir(char *packet, int len, int *seqnr) {
+    if (len < 20) {
+        return -1;
+    }
+    memset(packet, 0, 20);
+    packet[0] = (char)0x84;
+    packet[1] = (char)206;
+    packet[3] = 4;
+    packet[16] = (char)(++(*seqnr));
+    return 20;
+}
+
+
+int janus_rtcp_remb(char *packet, int len, uint32_t bitrate) {
+    if (len < 24) {
+        return -1;
+    }
+    memset(packet, 0, 24);
+    packet[0] = (char)0x8f;
+    packet[1] = (char)206;
+    packet[3] = 5;
+    memcpy(packet + 12, "REMB", 4);
+    uint8_t exp = 0;
+    while (bitrate >= (1 << 18)) {
+        bitrate >>= 1;
+        exp++;
+    }
+    packet[16] = 1;
+    packet[17] = (char)((exp << 2) | ((bitrate >> 16) & 0x03));
+    packet[18] = (char)((bitrate >> 8) & 0xff);
+    packet[19] = (char)(bitrate & 0xff);
+    return 24;
+}
+
+
+uint32_t janus_rtcp_get_remb(char *packet, int len) {
+    int offset = 0;
+    while (offset + 20 <= len) {
+        uint8_t *rtcp = (uint8_t *)packet + offset;
+        int plen = (((rtcp[2] << 8) | rtcp[3]) + 1) * 4;
+        if (rtcp[1] == 206 && (rtcp[0] & 0x1f) == 15 && !memcmp(rtcp + 12, "REMB", 4)) {
+            uint8_t exp = rtcp[17] >> 2;
+            uint32_t mantissa = ((rtcp[17] & 0x03) << 16) | (rtcp[18] << 8) | rtcp[19];
+            return mantissa << exp;
+        }
+        offset += plen;
+    }
+    return 0;
+}
+
+
+int janus_rtcp_cap_remb(char *packet, int len, uint32_t bitrate) {
+    return 0;
+}
+
+
+janus_sdp *janus_sdp_parse(const char *sdp, char *error, size_t errlen) {
+    g_snprintf(error, errlen, "No SDP in the benchmark");
+    return NULL;
+}
+
+
+char *janus_sdp_write(janus_sdp *sdp) {
+    return NULL;
+}
+
+
+janus_sdp *janus_sdp_generate_offer(const char *name, const char *address, ...) {
+    return NULL;
+}
+
+
+janus_sdp *janus_sdp_generate_answer(janus_sdp *offer, ...) {
+    return NULL;
+}
+
+
+janus_sdp_mline *janus_sdp_mline_find(janus_sdp *sdp, janus_sdp_mtype type) {
+    return NULL;
+}
+
+
+janus_sdp_attribute *janus_sdp_attribute_create(const char *name, const char *value, ...) {
+    return NULL;
+}
+
+
+int janus_sdp_attribute_add_to_mline(janus_sdp_mline *mline, janus_sdp_attribute *attr) {
+    return -1;
+}
+
+
+janus_recorder *janus_recorder_create(const char *dir, const char *codec, const char *filename) {
+    return NULL;
+}
+
+
+int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, uint length) {
+    return -1;
+}
+
+
+int janus_recorder_close(janus_recorder *recorder) {
+    return 0;
+}
+
+
+void janus_recorder_free(janus_recorder *recorder) {
+}
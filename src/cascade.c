@@ -0,0 +1,624 @@
+#include <string.h>
+
+#include <glib.h>
+#include <jansson.h>
+#include <curl/curl.h>
+
+#include <debug.h>
+#include <utils.h>
+
+#include "cascade.h"
+#include "stream.h"
+#include "http.h"
+
+/*
+ * One thread runs every cascade. Each has at most one request in flight
+ * towards its upstream node, plus a long poll once subscribed, whose
+ * completions come back from the HTTP thread through the queue, so the
+ * state of a cascade is only ever touched here. The long poll first reads
+ * the upstream's answer to the subscribe, then stays open for as long as
+ * the session does, draining its events and noticing when it goes away;
+ * keyframe requests and estimates are sent as "feedback" messages, which
+ * the upstream answers right away, and an empty one keeps the session
+ * alive when there is nothing to send.
+ */
+
+typedef enum janus_pubsub_cascade_step {
+    JANUS_PUBSUB_CASCADE_STEP_NONE = 0,
+    JANUS_PUBSUB_CASCADE_STEP_CREATE,
+    JANUS_PUBSUB_CASCADE_STEP_ATTACH,
+    JANUS_PUBSUB_CASCADE_STEP_SUBSCRIBE,
+    JANUS_PUBSUB_CASCADE_STEP_POLL,
+    JANUS_PUBSUB_CASCADE_STEP_FEEDBACK,
+    JANUS_PUBSUB_CASCADE_STEP_DESTROY,
+} janus_pubsub_cascade_step;
+
+typedef enum janus_pubsub_cascade_message_type {
+    JANUS_PUBSUB_CASCADE_MSG_START = 0,
+    JANUS_PUBSUB_CASCADE_MSG_DONE,
+    JANUS_PUBSUB_CASCADE_MSG_WAKEUP,
+} janus_pubsub_cascade_message_type;
+
+typedef struct janus_pubsub_cascade_message {
+    janus_pubsub_cascade_message_type type;
+    janus_pubsub_cascade *cascade;      /* Referenced, NULL for a wakeup */
+    gboolean poll;                      /* Answer to the long poll rather than to the request */
+    CURLcode result;
+    long status;
+    json_t *response;                   /* Parsed body, NULL if none */
+} janus_pubsub_cascade_message;
+
+static GThread *cascade_thread;
+static GAsyncQueue *cascade_queue;
+static GList *cascades;                 /* Only touched by the cascade thread */
+static volatile gint cascade_exit;
+static gint64 cascade_retry;
+static gint64 cascade_keepalive;
+static janus_pubsub_cascade_callback cascade_callback;
+static gchar **cascade_upstreams;       /* Janus API URLs streams may be cascaded from */
+
+static const char *janus_pubsub_cascade_state_names[] = {
+    "idle", "connecting", "connected", "stopped",
+};
+
+
+static void janus_pubsub_cascade_ref(janus_pubsub_cascade *cascade) {
+    g_atomic_int_inc(&cascade->ref);
+}
+
+
+void janus_pubsub_cascade_unref(janus_pubsub_cascade *cascade) {
+    if (cascade == NULL || !g_atomic_int_dec_and_test(&cascade->ref)) {
+        return;
+    }
+    g_free(cascade->upstream);
+    g_free(cascade->name);
+    g_free(cascade->host);
+    g_free(cascade);
+}
+
+
+static void janus_pubsub_cascade_push(janus_pubsub_cascade_message_type type, janus_pubsub_cascade *cascade) {
+    janus_pubsub_cascade_message *msg = g_malloc0(sizeof(janus_pubsub_cascade_message));
+    msg->type = type;
+    msg->cascade = cascade;
+    g_async_queue_push(cascade_queue, msg);
+}
+
+
+/* On the HTTP thread, the answer goes to the cascade thread with the request's reference */
+static void janus_pubsub_cascade_answer(janus_pubsub_http_request *request, void *data, gboolean poll) {
+    janus_pubsub_cascade_message *msg = g_malloc0(sizeof(janus_pubsub_cascade_message));
+    msg->type = JANUS_PUBSUB_CASCADE_MSG_DONE;
+    msg->cascade = (janus_pubsub_cascade *)data;
+    msg->poll = poll;
+    msg->result = request->result;
+    msg->status = request->status;
+    if (request->result == CURLE_OK && request->body->len > 0) {
+        msg->response = json_loads(request->body->str, 0, NULL);
+    }
+    g_async_queue_push(cascade_queue, msg);
+}
+
+
+static void janus_pubsub_cascade_http_done(janus_pubsub_http_request *request, void *data) {
+    janus_pubsub_cascade_answer(request, data, FALSE);
+}
+
+
+static void janus_pubsub_cascade_http_polled(janus_pubsub_http_request *request, void *data) {
+    janus_pubsub_cascade_answer(request, data, TRUE);
+}
+
+
+/* Send a Janus API request, a GET long poll when body is NULL */
+static void janus_pubsub_cascade_send(janus_pubsub_cascade *cascade, janus_pubsub_cascade_step step,
+        json_t *body) {
+    gchar *url = NULL;
+    if (step == JANUS_PUBSUB_CASCADE_STEP_CREATE) {
+        url = g_strdup(cascade->upstream);
+    } else if (step == JANUS_PUBSUB_CASCADE_STEP_SUBSCRIBE || step == JANUS_PUBSUB_CASCADE_STEP_FEEDBACK) {
+        url = g_strdup_printf("%s/%"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT,
+            cascade->upstream, cascade->session_id, cascade->handle_id);
+    } else if (step == JANUS_PUBSUB_CASCADE_STEP_POLL) {
+        url = g_strdup_printf("%s/%"G_GUINT64_FORMAT"?maxev=1", cascade->upstream, cascade->session_id);
+    } else {
+        url = g_strdup_printf("%s/%"G_GUINT64_FORMAT, cascade->upstream, cascade->session_id);
+    }
+    janus_pubsub_cascade_ref(cascade);
+    if (body == NULL) {
+        /* The long poll doesn't take the request's slot */
+        cascade->polling = TRUE;
+        cascade->poll_session = cascade->session_id;
+        janus_pubsub_http_get(url, JANUS_PUBSUB_CASCADE_POLL_TIMEOUT, janus_pubsub_cascade_http_polled, cascade);
+    } else {
+        cascade->step = step;
+        cascade->last_sent = janus_get_monotonic_time();
+        char transaction[17];
+        g_snprintf(transaction, sizeof(transaction), "%08x%08x", janus_random_uint32(), janus_random_uint32());
+        json_object_set_new(body, "transaction", json_string(transaction));
+        char *post_data = json_dumps(body, JSON_COMPACT);
+        json_decref(body);
+        janus_pubsub_http_post(url, post_data, janus_pubsub_cascade_http_done, cascade);
+    }
+    g_free(url);
+}
+
+
+static void janus_pubsub_cascade_subscribe(janus_pubsub_cascade *cascade) {
+    json_t *request = json_object();
+    json_object_set_new(request, "request", json_string("subscribe"));
+    if (cascade->name != NULL) {
+        json_object_set_new(request, "name", json_string(cascade->name));
+    } else {
+        json_object_set_new(request, "id", json_integer(cascade->id));
+    }
+    json_object_set_new(request, "kind", json_string("forward"));
+    json_object_set_new(request, "host", json_string(cascade->host));
+    json_object_set_new(request, "audio_port", json_integer(cascade->audio_port));
+    json_object_set_new(request, "video_port", json_integer(cascade->video_port));
+    json_object_set_new(request, "data_port", json_integer(cascade->data_port));
+    json_t *body = json_object();
+    json_object_set_new(body, "janus", json_string("message"));
+    json_object_set_new(body, "body", request);
+    janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_SUBSCRIBE, body);
+}
+
+
+/* Whatever our subscribers asked for since the last one, or nothing to keep the session */
+static void janus_pubsub_cascade_feedback(janus_pubsub_cascade *cascade) {
+    json_t *request = json_object();
+    json_object_set_new(request, "request", json_string("feedback"));
+    if (g_atomic_int_compare_and_exchange(&cascade->keyframe, 1, 0)) {
+        json_object_set_new(request, "keyframe", json_true());
+        g_atomic_int_inc(&cascade->keyframes_sent);
+    }
+    if (g_atomic_int_compare_and_exchange(&cascade->bitrate_pending, 1, 0)) {
+        json_object_set_new(request, "bitrate", json_integer((guint32)g_atomic_int_get(&cascade->bitrate)));
+        g_atomic_int_inc(&cascade->estimates_sent);
+    }
+    json_t *body = json_object();
+    json_object_set_new(body, "janus", json_string("message"));
+    json_object_set_new(body, "body", request);
+    janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_FEEDBACK, body);
+}
+
+
+/* Drop the upstream session, which takes the forwarder with it */
+static void janus_pubsub_cascade_leave(janus_pubsub_cascade *cascade) {
+    if (cascade->session_id == 0) {
+        return;
+    }
+    json_t *body = json_object();
+    json_object_set_new(body, "janus", json_string("destroy"));
+    janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_DESTROY, body);
+    cascade->session_id = 0;
+    cascade->handle_id = 0;
+    cascade->subscribed = FALSE;
+}
+
+
+static void janus_pubsub_cascade_fail(janus_pubsub_cascade *cascade, const char *reason) {
+    JANUS_LOG(LOG_WARN, "[%s] Cascade from %s failed: %s, retrying in %"G_GINT64_FORMAT"s\n",
+        cascade->stream->name, cascade->upstream, reason, cascade_retry / G_USEC_PER_SEC);
+    g_atomic_int_inc(&cascade->failures);
+    g_atomic_int_set(&cascade->state, JANUS_PUBSUB_CASCADE_IDLE);
+    cascade->retry_at = janus_get_monotonic_time() + cascade_retry;
+    janus_pubsub_cascade_leave(cascade);
+    cascade_callback(cascade->stream, cascade->handle, reason, NULL, NULL);
+}
+
+
+/* The "data" of a successful create or attach */
+static guint64 janus_pubsub_cascade_response_id(json_t *response) {
+    const char *janus = json_string_value(json_object_get(response, "janus"));
+    if (janus == NULL || strcmp(janus, "success")) {
+        return 0;
+    }
+    json_t *id = json_object_get(json_object_get(response, "data"), "id");
+    return json_is_integer(id) ? (guint64)json_integer_value(id) : 0;
+}
+
+
+/* Look for the upstream plugin's answer to the subscribe in the events of a long poll */
+static void janus_pubsub_cascade_poll_done(janus_pubsub_cascade *cascade, json_t *response) {
+    json_t *events = response;
+    if (json_is_object(response)) {
+        events = json_array();
+        json_array_append(events, response);
+    } else {
+        json_incref(events);
+    }
+    gboolean answered = FALSE, idle = FALSE;
+    size_t i;
+    for (i = 0; i < json_array_size(events) && !answered; i++) {
+        json_t *event = json_array_get(events, i);
+        const char *janus = json_string_value(json_object_get(event, "janus"));
+        if (janus != NULL && !strcmp(janus, "keepalive")) {
+            idle = TRUE;
+            continue;
+        }
+        json_t *data = json_object_get(json_object_get(event, "plugindata"), "data");
+        if (janus == NULL || strcmp(janus, "event") || data == NULL) {
+            continue;
+        }
+        answered = TRUE;
+        const char *error = json_string_value(json_object_get(data, "error"));
+        if (error != NULL || json_object_get(data, "result") == NULL) {
+            janus_pubsub_cascade_fail(cascade, error ? error : "Unexpected upstream event");
+            continue;
+        }
+        JANUS_LOG(LOG_INFO, "[%s] Cascading from %s\n", cascade->stream->name, cascade->upstream);
+        g_atomic_int_inc(&cascade->connects);
+        g_atomic_int_set(&cascade->state, JANUS_PUBSUB_CASCADE_CONNECTED);
+        cascade_callback(cascade->stream, cascade->handle, NULL, data, json_object_get(event, "jsep"));
+    }
+    json_decref(events);
+    if (!answered && (idle || response == NULL)) {
+        janus_pubsub_cascade_fail(cascade, "No answer to the subscribe");
+    }
+    /* Otherwise something else came first, the next poll keeps waiting */
+}
+
+
+/* Drain what the upstream session queued once connected, it may tell us it's gone */
+static void janus_pubsub_cascade_drain(janus_pubsub_cascade *cascade, json_t *response) {
+    json_t *events = response;
+    if (json_is_object(response)) {
+        events = json_array();
+        json_array_append(events, response);
+    } else {
+        json_incref(events);
+    }
+    const char *lost = NULL;
+    size_t i;
+    for (i = 0; i < json_array_size(events) && lost == NULL; i++) {
+        json_t *event = json_array_get(events, i);
+        const char *janus = json_string_value(json_object_get(event, "janus"));
+        if (janus == NULL || !strcmp(janus, "keepalive")) {
+            continue;
+        }
+        JANUS_LOG(LOG_VERB, "[%s] Upstream %s event from %s\n", cascade->stream->name, janus, cascade->upstream);
+        if (!strcmp(janus, "error") || !strcmp(janus, "detached") || !strcmp(janus, "hangup")) {
+            lost = "Upstream session lost";
+            continue;
+        }
+        json_t *data = json_object_get(json_object_get(event, "plugindata"), "data");
+        lost = json_string_value(json_object_get(data, "error"));
+    }
+    if (lost != NULL) {
+        janus_pubsub_cascade_fail(cascade, lost);
+    }
+    json_decref(events);
+}
+
+
+/* The long poll returned, the next one is sent by the tick */
+static void janus_pubsub_cascade_polled(janus_pubsub_cascade *cascade, janus_pubsub_cascade_message *msg) {
+    cascade->polling = FALSE;
+    if (g_atomic_int_get(&cascade->stopping) || !cascade->subscribed ||
+            cascade->poll_session != cascade->session_id) {
+        /* A poll of a session we already left */
+        return;
+    }
+    if (cascade->step != JANUS_PUBSUB_CASCADE_STEP_NONE) {
+        /* Failing would leave under the request in flight, poll again once it's answered */
+        return;
+    }
+    if (msg->result != CURLE_OK) {
+        janus_pubsub_cascade_fail(cascade, curl_easy_strerror(msg->result));
+        return;
+    }
+    if (g_atomic_int_get(&cascade->state) == JANUS_PUBSUB_CASCADE_CONNECTING) {
+        janus_pubsub_cascade_poll_done(cascade, msg->response);
+    } else {
+        janus_pubsub_cascade_drain(cascade, msg->response);
+    }
+}
+
+
+/* A request of the cascade completed, move on to the next step */
+static void janus_pubsub_cascade_done(janus_pubsub_cascade *cascade, janus_pubsub_cascade_message *msg) {
+    janus_pubsub_cascade_step step = cascade->step;
+    cascade->step = JANUS_PUBSUB_CASCADE_STEP_NONE;
+    if (step == JANUS_PUBSUB_CASCADE_STEP_DESTROY) {
+        return;
+    }
+    if (g_atomic_int_get(&cascade->stopping)) {
+        /* A session created meanwhile still has to go */
+        if (step == JANUS_PUBSUB_CASCADE_STEP_CREATE) {
+            cascade->session_id = janus_pubsub_cascade_response_id(msg->response);
+        }
+        return;
+    }
+    if (msg->result != CURLE_OK) {
+        janus_pubsub_cascade_fail(cascade, curl_easy_strerror(msg->result));
+        return;
+    }
+    const char *janus = json_string_value(json_object_get(msg->response, "janus"));
+    switch (step) {
+        case JANUS_PUBSUB_CASCADE_STEP_CREATE: {
+            cascade->session_id = janus_pubsub_cascade_response_id(msg->response);
+            if (cascade->session_id == 0) {
+                janus_pubsub_cascade_fail(cascade, "Could not create the upstream session");
+                return;
+            }
+            json_t *body = json_object();
+            json_object_set_new(body, "janus", json_string("attach"));
+            json_object_set_new(body, "plugin", json_string(JANUS_PUBSUB_CASCADE_PLUGIN));
+            janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_ATTACH, body);
+            break;
+        }
+        case JANUS_PUBSUB_CASCADE_STEP_ATTACH:
+            cascade->handle_id = janus_pubsub_cascade_response_id(msg->response);
+            if (cascade->handle_id == 0) {
+                janus_pubsub_cascade_fail(cascade, "Could not attach to the upstream plugin");
+                return;
+            }
+            janus_pubsub_cascade_subscribe(cascade);
+            break;
+        case JANUS_PUBSUB_CASCADE_STEP_SUBSCRIBE:
+            if (janus == NULL || strcmp(janus, "ack")) {
+                janus_pubsub_cascade_fail(cascade, "Subscribe refused by the upstream node");
+                return;
+            }
+            /* The tick opens the long poll waiting for the answer */
+            cascade->subscribed = TRUE;
+            break;
+        case JANUS_PUBSUB_CASCADE_STEP_FEEDBACK: {
+            /* Errors mean the upstream stream or our forwarder is gone */
+            json_t *data = json_object_get(json_object_get(msg->response, "plugindata"), "data");
+            if (janus == NULL || strcmp(janus, "success") || json_object_get(data, "error") != NULL) {
+                const char *error = json_string_value(json_object_get(data, "error"));
+                janus_pubsub_cascade_fail(cascade, error ? error : "Upstream session lost");
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+
+/* Start whatever is due, TRUE once a stopped cascade is done with its upstream */
+static gboolean janus_pubsub_cascade_tick(janus_pubsub_cascade *cascade, gint64 now) {
+    if (cascade->step != JANUS_PUBSUB_CASCADE_STEP_NONE) {
+        return FALSE;
+    }
+    if (g_atomic_int_get(&cascade->stopping)) {
+        if (cascade->session_id != 0) {
+            janus_pubsub_cascade_leave(cascade);
+            return FALSE;
+        }
+        g_atomic_int_set(&cascade->state, JANUS_PUBSUB_CASCADE_STOPPED);
+        return TRUE;
+    }
+    if (cascade->subscribed && !cascade->polling) {
+        janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_POLL, NULL);
+    }
+    switch (g_atomic_int_get(&cascade->state)) {
+        case JANUS_PUBSUB_CASCADE_IDLE:
+            if (now >= cascade->retry_at) {
+                g_atomic_int_set(&cascade->state, JANUS_PUBSUB_CASCADE_CONNECTING);
+                json_t *body = json_object();
+                json_object_set_new(body, "janus", json_string("create"));
+                janus_pubsub_cascade_send(cascade, JANUS_PUBSUB_CASCADE_STEP_CREATE, body);
+            }
+            break;
+        case JANUS_PUBSUB_CASCADE_CONNECTED:
+            if (g_atomic_int_get(&cascade->keyframe) || g_atomic_int_get(&cascade->bitrate_pending) ||
+                    now - cascade->last_sent >= cascade_keepalive) {
+                janus_pubsub_cascade_feedback(cascade);
+            }
+            break;
+        default:
+            break;
+    }
+    return FALSE;
+}
+
+
+static void janus_pubsub_cascade_finish(janus_pubsub_cascade *cascade) {
+    JANUS_LOG(LOG_VERB, "[%s] Cascade from %s stopped\n", cascade->stream->name, cascade->upstream);
+    janus_pubsub_stream_unref(cascade->stream);
+    cascade->stream = NULL;
+    janus_pubsub_cascade_unref(cascade);
+}
+
+
+static void *janus_pubsub_cascade_thread(void *data) {
+    JANUS_LOG(LOG_VERB, "Joining PubSub cascade thread\n");
+    while (!g_atomic_int_get(&cascade_exit)) {
+        janus_pubsub_cascade_message *msg = g_async_queue_timeout_pop(cascade_queue, JANUS_PUBSUB_CASCADE_TICK);
+        while (msg != NULL) {
+            if (msg->type == JANUS_PUBSUB_CASCADE_MSG_START) {
+                /* The message's reference is now the list's */
+                cascades = g_list_prepend(cascades, msg->cascade);
+                msg->cascade = NULL;
+            } else if (msg->type == JANUS_PUBSUB_CASCADE_MSG_DONE && msg->poll) {
+                janus_pubsub_cascade_polled(msg->cascade, msg);
+            } else if (msg->type == JANUS_PUBSUB_CASCADE_MSG_DONE) {
+                janus_pubsub_cascade_done(msg->cascade, msg);
+            }
+            janus_pubsub_cascade_unref(msg->cascade);
+            if (msg->response != NULL) {
+                json_decref(msg->response);
+            }
+            g_free(msg);
+            msg = g_async_queue_try_pop(cascade_queue);
+        }
+        gint64 now = janus_get_monotonic_time();
+        GList *l = cascades;
+        while (l != NULL) {
+            GList *next = l->next;
+            janus_pubsub_cascade *cascade = (janus_pubsub_cascade *)l->data;
+            if (janus_pubsub_cascade_tick(cascade, now)) {
+                cascades = g_list_delete_link(cascades, l);
+                janus_pubsub_cascade_finish(cascade);
+            }
+            l = next;
+        }
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub cascade thread\n");
+    return NULL;
+}
+
+
+/* Drop the blanks around an upstream URL and its trailing slashes */
+static gchar *janus_pubsub_cascade_upstream_strip(gchar *upstream) {
+    g_strstrip(upstream);
+    gsize len = strlen(upstream);
+    while (len > 0 && upstream[len - 1] == '/') {
+        upstream[--len] = '\0';
+    }
+    return upstream;
+}
+
+
+int janus_pubsub_cascades_init(guint retry, guint keepalive, const char *upstreams,
+        janus_pubsub_cascade_callback callback) {
+    cascade_upstreams = g_strsplit(upstreams ? upstreams : "", ",", -1);
+    int i;
+    for (i = 0; cascade_upstreams[i] != NULL; i++) {
+        janus_pubsub_cascade_upstream_strip(cascade_upstreams[i]);
+    }
+    cascade_retry = (gint64)retry * G_USEC_PER_SEC;
+    cascade_keepalive = (gint64)(keepalive > 0 ? keepalive : PUBSUB_DEFAULT_CASCADE_KEEPALIVE) * G_USEC_PER_SEC;
+    cascade_callback = callback;
+    cascades = NULL;
+    cascade_queue = g_async_queue_new();
+    g_atomic_int_set(&cascade_exit, 0);
+    GError *error = NULL;
+    cascade_thread = g_thread_try_new("pubsub cascade", &janus_pubsub_cascade_thread, NULL, &error);
+    if (error != NULL) {
+        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub cascade thread...\n",
+            error->code, error->message ? error->message : "??");
+        g_error_free(error);
+        cascade_thread = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Stop the cascade thread after the HTTP thread, whose aborted requests
+ * are still answered through the queue. The upstream sessions left are
+ * timed out by their nodes
+ */
+void janus_pubsub_cascades_destroy(void) {
+    g_strfreev(cascade_upstreams);
+    cascade_upstreams = NULL;
+    if (cascade_thread == NULL) {
+        return;
+    }
+    g_atomic_int_set(&cascade_exit, 1);
+    janus_pubsub_cascade_push(JANUS_PUBSUB_CASCADE_MSG_WAKEUP, NULL);
+    g_thread_join(cascade_thread);
+    cascade_thread = NULL;
+    janus_pubsub_cascade_message *msg = NULL;
+    while ((msg = g_async_queue_try_pop(cascade_queue)) != NULL) {
+        if (msg->type == JANUS_PUBSUB_CASCADE_MSG_START) {
+            janus_pubsub_stream_unref(msg->cascade->stream);
+            msg->cascade->stream = NULL;
+        }
+        janus_pubsub_cascade_unref(msg->cascade);
+        if (msg->response != NULL) {
+            json_decref(msg->response);
+        }
+        g_free(msg);
+    }
+    while (cascades != NULL) {
+        janus_pubsub_cascade *cascade = (janus_pubsub_cascade *)cascades->data;
+        cascades = g_list_delete_link(cascades, cascades);
+        janus_pubsub_cascade_finish(cascade);
+    }
+    g_async_queue_unref(cascade_queue);
+    cascade_queue = NULL;
+}
+
+
+/*
+ * Whether a publish may pull from upstream. Only the configured gateways
+ * are asked, so clients can't point our HTTP requests anywhere else
+ */
+gboolean janus_pubsub_cascade_allowed(const char *upstream) {
+    if (upstream == NULL || cascade_upstreams == NULL) {
+        return FALSE;
+    }
+    gchar *wanted = janus_pubsub_cascade_upstream_strip(g_strdup(upstream));
+    gboolean allowed = FALSE;
+    int i;
+    for (i = 0; cascade_upstreams[i] != NULL && !allowed; i++) {
+        allowed = cascade_upstreams[i][0] != '\0' && !strcmp(cascade_upstreams[i], wanted);
+    }
+    g_free(wanted);
+    return allowed;
+}
+
+
+/* A cascade for a stream that isn't registered yet, the ports are filled in before it starts */
+janus_pubsub_cascade *janus_pubsub_cascade_new(const char *upstream, const char *name, guint64 id,
+        const char *host, janus_plugin_session *handle) {
+    janus_pubsub_cascade *cascade = g_malloc0(sizeof(janus_pubsub_cascade));
+    cascade->ref = 1;
+    cascade->upstream = g_strdup(upstream);
+    /* Session and handle paths are appended to the URL */
+    gsize len = strlen(cascade->upstream);
+    while (len > 0 && cascade->upstream[len - 1] == '/') {
+        cascade->upstream[--len] = '\0';
+    }
+    cascade->name = id > 0 ? NULL : g_strdup(name);
+    cascade->id = id;
+    cascade->host = g_strdup(host);
+    cascade->handle = handle;
+    cascade->state = JANUS_PUBSUB_CASCADE_IDLE;
+    return cascade;
+}
+
+
+/* Hand the cascade of a registered stream to the cascade thread */
+void janus_pubsub_cascade_start(janus_pubsub_cascade *cascade, struct jansus_pubsub_stream *stream) {
+    janus_pubsub_stream_ref(stream);
+    cascade->stream = stream;
+    janus_pubsub_cascade_ref(cascade);
+    janus_pubsub_cascade_push(JANUS_PUBSUB_CASCADE_MSG_START, cascade);
+}
+
+
+/* The owner left, the cascade thread drops the upstream session and the stream */
+void janus_pubsub_cascade_stop(janus_pubsub_cascade *cascade) {
+    g_atomic_int_set(&cascade->stopping, 1);
+    janus_pubsub_cascade_push(JANUS_PUBSUB_CASCADE_MSG_WAKEUP, NULL);
+}
+
+
+/* Called once per keyframe_interval at most, by the stream's feedback */
+void janus_pubsub_cascade_keyframe(janus_pubsub_cascade *cascade) {
+    if (g_atomic_int_compare_and_exchange(&cascade->keyframe, 0, 1)) {
+        janus_pubsub_cascade_push(JANUS_PUBSUB_CASCADE_MSG_WAKEUP, NULL);
+    }
+}
+
+
+/* Called once per remb_interval at most with the combined estimate */
+void janus_pubsub_cascade_bitrate(janus_pubsub_cascade *cascade, guint32 bitrate) {
+    g_atomic_int_set(&cascade->bitrate, (gint)bitrate);
+    if (g_atomic_int_compare_and_exchange(&cascade->bitrate_pending, 0, 1)) {
+        janus_pubsub_cascade_push(JANUS_PUBSUB_CASCADE_MSG_WAKEUP, NULL);
+    }
+}
+
+
+json_t *janus_pubsub_cascade_info(janus_pubsub_cascade *cascade) {
+    json_t *info = json_object();
+    json_object_set_new(info, "upstream", json_string(cascade->upstream));
+    json_object_set_new(info, "state",
+        json_string(janus_pubsub_cascade_state_names[g_atomic_int_get(&cascade->state)]));
+    json_object_set_new(info, "connects", json_integer(g_atomic_int_get(&cascade->connects)));
+    json_object_set_new(info, "failures", json_integer(g_atomic_int_get(&cascade->failures)));
+    json_object_set_new(info, "keyframe_requests", json_integer(g_atomic_int_get(&cascade->keyframes_sent)));
+    json_object_set_new(info, "estimates", json_integer(g_atomic_int_get(&cascade->estimates_sent)));
+    json_object_set_new(info, "bitrate", json_integer((guint32)g_atomic_int_get(&cascade->bitrate)));
+    return info;
+}
@@ -0,0 +1,90 @@
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/* janus includes */
+#include <plugins/plugin.h>
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_CASCADE_RETRY 5          /* Seconds before an upstream node is tried again */
+#define PUBSUB_DEFAULT_CASCADE_KEEPALIVE 25     /* Seconds between requests keeping the upstream session */
+
+/* The plugin asked for on the upstream node */
+#define JANUS_PUBSUB_CASCADE_PLUGIN "janus.plugin.pubsub"
+/* Longest wait of a long poll on the upstream session, Janus answers one within 30s */
+#define JANUS_PUBSUB_CASCADE_POLL_TIMEOUT 35000 /* Milliseconds */
+/* How often the cascade thread looks for due requests without being woken up */
+#define JANUS_PUBSUB_CASCADE_TICK 1000000       /* Microseconds */
+
+struct jansus_pubsub_stream;
+
+typedef enum janus_pubsub_cascade_state {
+    JANUS_PUBSUB_CASCADE_IDLE = 0,      /* Waiting to connect, or to connect again */
+    JANUS_PUBSUB_CASCADE_CONNECTING,    /* Creating the upstream session and subscribing */
+    JANUS_PUBSUB_CASCADE_CONNECTED,     /* The upstream node forwards the stream to us */
+    JANUS_PUBSUB_CASCADE_STOPPED,
+} janus_pubsub_cascade_state;
+
+/*
+ * A stream pulled from another node running the plugin. The cascade
+ * thread drives the upstream's Janus API over HTTP: it creates a session,
+ * attaches to the plugin and subscribes an RTP forwarder pointed at our
+ * pull sockets, then keeps the session alive and long polled and carries
+ * the keyframe requests and bandwidth estimates of our subscribers back
+ * upstream. A lost upstream is tried again until the owner leaves.
+ */
+typedef struct janus_pubsub_cascade {
+    volatile gint ref;                  /* The stream, the cascade thread and each request in flight */
+    gchar *upstream;                    /* Janus API URL of the upstream node */
+    gchar *name;                        /* Upstream stream name, NULL when given by id */
+    guint64 id;                         /* Upstream stream id, 0 when given by name */
+    gchar *host;                        /* Where the upstream node sends the packets */
+    int audio_port;
+    int video_port;
+    int data_port;
+    janus_plugin_session *handle;       /* Owner told about the upstream connecting or failing */
+    struct jansus_pubsub_stream *stream;  /* Referenced while the cascade thread drives it */
+    /* Only touched by the cascade thread */
+    int step;                           /* Request in flight, if any */
+    guint64 session_id;                 /* Upstream Janus session, 0 if none */
+    guint64 handle_id;
+    gboolean subscribed;                /* The upstream acked the subscribe, its session is long polled */
+    gboolean polling;                   /* A long poll is in flight */
+    guint64 poll_session;               /* The session it was sent on */
+    gint64 retry_at;                    /* When to connect again */
+    gint64 last_sent;                   /* Last request to the upstream session */
+    /* Set by the relay threads, sent by the cascade thread */
+    volatile gint keyframe;             /* A keyframe request waits to go upstream */
+    volatile gint bitrate;              /* Latest combined estimate, 0 if none */
+    volatile gint bitrate_pending;
+    volatile gint stopping;
+    volatile gint state;                /* janus_pubsub_cascade_state */
+    volatile gint connects;
+    volatile gint failures;
+    volatile gint keyframes_sent;
+    volatile gint estimates_sent;
+} janus_pubsub_cascade;
+
+/*
+ * Called on the cascade thread when the upstream node answered the
+ * subscribe, with error NULL and its event and jsep, or when it failed
+ */
+typedef void (*janus_pubsub_cascade_callback)(struct jansus_pubsub_stream *stream,
+        janus_plugin_session *handle, const char *error, json_t *result, json_t *jsep);
+
+int janus_pubsub_cascades_init(guint retry, guint keepalive, const char *upstreams,
+        janus_pubsub_cascade_callback callback);
+void janus_pubsub_cascades_destroy(void);
+gboolean janus_pubsub_cascade_allowed(const char *upstream);
+janus_pubsub_cascade *janus_pubsub_cascade_new(const char *upstream, const char *name, guint64 id,
+        const char *host, janus_plugin_session *handle);
+void janus_pubsub_cascade_start(janus_pubsub_cascade *cascade, struct jansus_pubsub_stream *stream);
+void janus_pubsub_cascade_stop(janus_pubsub_cascade *cascade);
+void janus_pubsub_cascade_unref(janus_pubsub_cascade *cascade);
+void janus_pubsub_cascade_keyframe(janus_pubsub_cascade *cascade);
+void janus_pubsub_cascade_bitrate(janus_pubsub_cascade *cascade, guint32 bitrate);
+json_t *janus_pubsub_cascade_info(janus_pubsub_cascade *cascade);
+
+#endif /* CASCADE_H */
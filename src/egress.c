@@ -0,0 +1,388 @@
+#include <string.h>
+#include <strings.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <mutex.h>
+
+#include "egress.h"
+#include "stream.h"
+#include "subscriber.h"
+#include "batch.h"
+#include "epoch.h"
+
+/*
+ * Egress workers. With egress_queue_size set, the relay loop copies each
+ * packet once and pushes it to the queue of every subscriber. A small
+ * pool of workers sends the queued packets, each subscriber sharded to
+ * one of them. A full queue is handled with the configured policy.
+ */
+
+typedef struct janus_pubsub_egress_worker {
+    guint index;
+    GThread *thread;
+    GAsyncQueue *ready;                 /* Queues with packets to send */
+} janus_pubsub_egress_worker;
+
+static janus_pubsub_egress_worker *workers;
+static guint workers_count;
+static guint egress_size;
+static janus_pubsub_egress_policy egress_policy = JANUS_PUBSUB_EGRESS_DROP_OLDEST;
+static janus_pubsub_egress_deliver egress_deliver;
+static janus_pubsub_egress exit_egress;
+
+
+/* Count packets the subscriber won't get. The caller holds the mutex */
+static void janus_pubsub_egress_drop(janus_pubsub_egress *egress, guint packets) {
+    egress->dropped += packets;
+    janus_pubsub_metrics_drop(egress->subscriber->metrics, packets);
+    janus_pubsub_metrics_drop(egress->stream->metrics, packets);
+}
+
+
+static void janus_pubsub_egress_unref(janus_pubsub_egress *egress) {
+    if (g_atomic_int_dec_and_test(&egress->ref)) {
+        guint i;
+        for (i = 0; i < egress->count; i++) {
+            janus_pubsub_egress_packet_unref(egress->ring[(egress->head + i) % egress->size]);
+        }
+        janus_pubsub_subscriber_unref(egress->subscriber);
+        janus_pubsub_stream_unref(egress->stream);
+        janus_mutex_destroy(&egress->mutex);
+        g_free(egress->ring);
+        g_free(egress);
+    }
+}
+
+
+static void *janus_pubsub_egress_thread(void *data) {
+    janus_pubsub_egress_worker *worker = (janus_pubsub_egress_worker *)data;
+    JANUS_LOG(LOG_VERB, "Joining PubSub egress worker %u\n", worker->index);
+    janus_pubsub_egress_packet *burst[JANUS_PUBSUB_EGRESS_BURST];
+    janus_pubsub_egress *egress = NULL;
+    for (;;) {
+        egress = g_async_queue_try_pop(worker->ready);
+        if (egress == NULL) {
+            /* Idle, send any batched forwarder datagrams before blocking */
+            janus_pubsub_batch_flush_current();
+            egress = g_async_queue_pop(worker->ready);
+        }
+        if (egress == &exit_egress) {
+            break;
+        }
+        guint i, taken = 0;
+        janus_mutex_lock(&egress->mutex);
+        while (egress->count > 0 && taken < JANUS_PUBSUB_EGRESS_BURST) {
+            janus_pubsub_egress_packet *packet = egress->ring[egress->head];
+            egress->head = (egress->head + 1) % egress->size;
+            egress->count--;
+            if (packet->video && egress->resync) {
+                if (!packet->keyframe) {
+                    janus_pubsub_egress_drop(egress, 1);
+                    janus_pubsub_egress_packet_unref(packet);
+                    continue;
+                }
+                egress->resync = FALSE;
+            }
+            burst[taken++] = packet;
+        }
+        egress->delivered += taken;
+        gboolean more = egress->count > 0;
+        egress->scheduled = more;
+        janus_mutex_unlock(&egress->mutex);
+        /* Switching layers asks the publisher for a keyframe, its session is read unlocked */
+        janus_pubsub_epoch_enter();
+        for (i = 0; i < taken; i++) {
+            janus_pubsub_egress_packet *packet = burst[i];
+            if (!g_atomic_int_get(&egress->closed)) {
+                egress_deliver(egress->stream, egress->subscriber, packet->video, packet->buf, packet->len);
+                if (janus_pubsub_batch_enabled()) {
+                    janus_pubsub_batch_packet_done(janus_pubsub_batch_get());
+                }
+            }
+            janus_pubsub_egress_packet_unref(packet);
+        }
+        janus_pubsub_epoch_exit();
+        if (more) {
+            /* Back of the line, the other subscribers of this worker get their turn */
+            g_async_queue_push(worker->ready, egress);
+        } else {
+            janus_pubsub_egress_unref(egress);
+        }
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub egress worker %u\n", worker->index);
+    return NULL;
+}
+
+
+int janus_pubsub_egress_init(guint queue_size, guint count, const char *policy,
+        janus_pubsub_egress_deliver deliver) {
+    workers = NULL;
+    workers_count = 0;
+    egress_size = queue_size;
+    egress_deliver = deliver;
+    egress_policy = JANUS_PUBSUB_EGRESS_DROP_OLDEST;
+    if (policy != NULL && !strcasecmp(policy, "keyframe")) {
+        egress_policy = JANUS_PUBSUB_EGRESS_KEYFRAME;
+    } else if (policy != NULL && !strcasecmp(policy, "audio_only")) {
+        egress_policy = JANUS_PUBSUB_EGRESS_AUDIO_ONLY;
+    } else if (policy != NULL && !strcasecmp(policy, "disconnect")) {
+        egress_policy = JANUS_PUBSUB_EGRESS_DISCONNECT;
+    } else if (policy != NULL && strcasecmp(policy, "drop_oldest")) {
+        JANUS_LOG(LOG_WARN, "Unknown egress_policy %s, using drop_oldest\n", policy);
+    }
+    if (queue_size == 0) {
+        return 0;
+    }
+    if (count == 0) {
+        count = PUBSUB_DEFAULT_EGRESS_WORKERS;
+    }
+    workers = g_malloc0(count * sizeof(janus_pubsub_egress_worker));
+    guint i;
+    for (i = 0; i < count; i++) {
+        GError *error = NULL;
+        char tname[16];
+        g_snprintf(tname, sizeof(tname), "pubsub egress %u", i);
+        workers[i].index = i;
+        workers[i].ready = g_async_queue_new();
+        workers[i].thread = g_thread_try_new(tname, &janus_pubsub_egress_thread, &workers[i], &error);
+        if (error != NULL) {
+            JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch a PubSub egress worker...\n",
+                error->code, error->message ? error->message : "??");
+            g_error_free(error);
+            g_async_queue_unref(workers[i].ready);
+            break;
+        }
+        workers_count++;
+    }
+    if (workers_count == 0) {
+        g_free(workers);
+        workers = NULL;
+        return -1;
+    }
+    JANUS_LOG(LOG_INFO, "PubSub egress: %u workers, %u packets per subscriber\n",
+        workers_count, egress_size);
+    return 0;
+}
+
+
+void janus_pubsub_egress_destroy(void) {
+    guint i;
+    for (i = 0; i < workers_count; i++) {
+        g_async_queue_push(workers[i].ready, &exit_egress);
+    }
+    for (i = 0; i < workers_count; i++) {
+        g_thread_join(workers[i].thread);
+        janus_pubsub_egress *egress = NULL;
+        while ((egress = g_async_queue_try_pop(workers[i].ready)) != NULL) {
+            janus_pubsub_egress_unref(egress);
+        }
+        g_async_queue_unref(workers[i].ready);
+    }
+    g_free(workers);
+    workers = NULL;
+    workers_count = 0;
+}
+
+
+gboolean janus_pubsub_egress_enabled(void) {
+    return workers_count > 0;
+}
+
+
+/* Queue of a new subscriber, NULL when packets are relayed inline */
+janus_pubsub_egress *janus_pubsub_egress_new(struct jansus_pubsub_stream *stream,
+        struct janus_pubsub_subscriber *subscriber) {
+    if (workers_count == 0) {
+        return NULL;
+    }
+    janus_pubsub_egress *egress = g_malloc0(sizeof(janus_pubsub_egress));
+    g_atomic_int_set(&egress->ref, 1);
+    janus_mutex_init(&egress->mutex);
+    janus_pubsub_stream_ref(stream);
+    egress->stream = stream;
+    janus_pubsub_subscriber_ref(subscriber);
+    egress->subscriber = subscriber;
+    egress->worker = subscriber->subscriber_id % workers_count;
+    egress->size = egress_size;
+    egress->ring = g_malloc0(egress_size * sizeof(janus_pubsub_egress_packet *));
+    return egress;
+}
+
+
+/* The subscriber is gone, drop what is queued and its reference */
+void janus_pubsub_egress_close(janus_pubsub_egress *egress) {
+    if (egress == NULL) {
+        return;
+    }
+    janus_mutex_lock(&egress->mutex);
+    g_atomic_int_set(&egress->closed, TRUE);
+    while (egress->count > 0) {
+        janus_pubsub_egress_packet_unref(egress->ring[egress->head]);
+        egress->head = (egress->head + 1) % egress->size;
+        egress->count--;
+    }
+    janus_mutex_unlock(&egress->mutex);
+    janus_pubsub_egress_unref(egress);
+}
+
+
+janus_pubsub_egress_packet *janus_pubsub_egress_packet_new(int video, gboolean keyframe, char *buf, int len) {
+    janus_pubsub_egress_packet *packet = g_malloc(sizeof(janus_pubsub_egress_packet) + len);
+    g_atomic_int_set(&packet->ref, 1);
+    packet->video = video;
+    packet->keyframe = keyframe;
+    packet->len = len;
+    memcpy(packet->buf, buf, len);
+    return packet;
+}
+
+
+void janus_pubsub_egress_packet_unref(janus_pubsub_egress_packet *packet) {
+    if (g_atomic_int_dec_and_test(&packet->ref)) {
+        g_free(packet);
+    }
+}
+
+
+/* Drop the queued video, keeping the audio in order. The caller holds the mutex */
+static void janus_pubsub_egress_drop_video(janus_pubsub_egress *egress) {
+    guint i, kept = 0;
+    for (i = 0; i < egress->count; i++) {
+        janus_pubsub_egress_packet *packet = egress->ring[(egress->head + i) % egress->size];
+        if (packet->video) {
+            janus_pubsub_egress_drop(egress, 1);
+            janus_pubsub_egress_packet_unref(packet);
+            continue;
+        }
+        egress->ring[(egress->head + kept) % egress->size] = packet;
+        kept++;
+    }
+    egress->count = kept;
+}
+
+
+/* The subscriber can't keep up, apply the policy. The caller holds the mutex */
+static janus_pubsub_egress_action janus_pubsub_egress_apply_policy(janus_pubsub_egress *egress) {
+    egress->overflows++;
+    switch (egress_policy) {
+        case JANUS_PUBSUB_EGRESS_KEYFRAME:
+            janus_pubsub_egress_drop_video(egress);
+            egress->resync = TRUE;
+            return JANUS_PUBSUB_EGRESS_REQUEST_KEYFRAME;
+        case JANUS_PUBSUB_EGRESS_AUDIO_ONLY:
+            janus_pubsub_egress_drop_video(egress);
+            if (egress->audio_only) {
+                return JANUS_PUBSUB_EGRESS_NONE;
+            }
+            egress->audio_only = TRUE;
+            return JANUS_PUBSUB_EGRESS_WENT_AUDIO_ONLY;
+        case JANUS_PUBSUB_EGRESS_DISCONNECT:
+            janus_pubsub_egress_drop(egress, egress->count);
+            while (egress->count > 0) {
+                janus_pubsub_egress_packet_unref(egress->ring[egress->head]);
+                egress->head = (egress->head + 1) % egress->size;
+                egress->count--;
+            }
+            g_atomic_int_set(&egress->closed, TRUE);
+            return JANUS_PUBSUB_EGRESS_CLOSE;
+        default:
+            return JANUS_PUBSUB_EGRESS_NONE;
+    }
+}
+
+
+/*
+ * Queue a packet for the subscriber, taking a reference on it, and wake
+ * up its worker. Returns what the caller must do if the queue was full
+ */
+janus_pubsub_egress_action janus_pubsub_egress_push(janus_pubsub_egress *egress,
+        janus_pubsub_egress_packet *packet) {
+    janus_pubsub_egress_action action = JANUS_PUBSUB_EGRESS_NONE;
+    janus_mutex_lock(&egress->mutex);
+    if (packet->video && egress->audio_only && !egress->closed &&
+            egress->count * 100 <= egress->size * JANUS_PUBSUB_EGRESS_LOW_WATERMARK) {
+        /* Caught up, video is sent again from its next keyframe */
+        egress->audio_only = FALSE;
+        egress->resync = TRUE;
+        action = JANUS_PUBSUB_EGRESS_VIDEO_RESUMED;
+    }
+    if (egress->closed || (packet->video && egress->audio_only)) {
+        janus_pubsub_egress_drop(egress, 1);
+        janus_mutex_unlock(&egress->mutex);
+        return action;
+    }
+    if (egress->count == egress->size) {
+        action = janus_pubsub_egress_apply_policy(egress);
+        if (egress->closed) {
+            janus_pubsub_egress_drop(egress, 1);
+            janus_mutex_unlock(&egress->mutex);
+            return action;
+        }
+        if (egress->count == egress->size) {
+            /* Still full, of audio, or the policy is to drop the oldest */
+            janus_pubsub_egress_drop(egress, 1);
+            janus_pubsub_egress_packet_unref(egress->ring[egress->head]);
+            egress->head = (egress->head + 1) % egress->size;
+            egress->count--;
+        }
+        if (packet->video && egress->audio_only) {
+            janus_pubsub_egress_drop(egress, 1);
+            janus_mutex_unlock(&egress->mutex);
+            return action;
+        }
+    }
+    g_atomic_int_inc(&packet->ref);
+    egress->ring[(egress->head + egress->count) % egress->size] = packet;
+    egress->count++;
+    egress->enqueued++;
+    gboolean wakeup = !egress->scheduled;
+    egress->scheduled = TRUE;
+    if (wakeup) {
+        g_atomic_int_inc(&egress->ref);
+    }
+    janus_mutex_unlock(&egress->mutex);
+    if (wakeup) {
+        g_async_queue_push(workers[egress->worker].ready, egress);
+    }
+    return action;
+}
+
+
+/* The gateway reported the subscriber's link as slow, act as on an overflow */
+janus_pubsub_egress_action janus_pubsub_egress_slow_link(janus_pubsub_egress *egress) {
+    janus_mutex_lock(&egress->mutex);
+    janus_pubsub_egress_action action = JANUS_PUBSUB_EGRESS_NONE;
+    if (!egress->closed) {
+        if (egress_policy == JANUS_PUBSUB_EGRESS_DROP_OLDEST) {
+            /* Shed the older half of the backlog */
+            egress->overflows++;
+            guint drop = egress->count / 2;
+            janus_pubsub_egress_drop(egress, drop);
+            while (drop-- > 0) {
+                janus_pubsub_egress_packet_unref(egress->ring[egress->head]);
+                egress->head = (egress->head + 1) % egress->size;
+                egress->count--;
+            }
+        } else {
+            action = janus_pubsub_egress_apply_policy(egress);
+        }
+    }
+    janus_mutex_unlock(&egress->mutex);
+    return action;
+}
+
+
+void janus_pubsub_egress_get_stats(janus_pubsub_egress *egress, janus_pubsub_egress_stats *stats) {
+    janus_mutex_lock(&egress->mutex);
+    stats->depth = egress->count;
+    stats->size = egress->size;
+    stats->enqueued = egress->enqueued;
+    stats->delivered = egress->delivered;
+    stats->dropped = egress->dropped;
+    stats->overflows = egress->overflows;
+    stats->audio_only = egress->audio_only;
+    stats->closed = egress->closed;
+    janus_mutex_unlock(&egress->mutex);
+}
@@ -0,0 +1,102 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <glib.h>
+
+/* janus includes */
+#include <mutex.h>
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_EGRESS_QUEUE_SIZE 0     /* Packets queued per subscriber, 0 relays inline */
+#define PUBSUB_DEFAULT_EGRESS_WORKERS 2
+#define PUBSUB_DEFAULT_EGRESS_POLICY "drop_oldest"
+
+/* Packets taken from one queue before the worker moves to the next one */
+#define JANUS_PUBSUB_EGRESS_BURST 32
+/* Percent of its queue an audio only subscriber has to drain to before video resumes */
+#define JANUS_PUBSUB_EGRESS_LOW_WATERMARK 25
+
+struct jansus_pubsub_stream;
+struct janus_pubsub_subscriber;
+
+typedef enum janus_pubsub_egress_policy {
+    JANUS_PUBSUB_EGRESS_DROP_OLDEST = 0,    /* Make room by dropping the oldest packet */
+    JANUS_PUBSUB_EGRESS_KEYFRAME,           /* Drop the queued video and resume at a keyframe */
+    JANUS_PUBSUB_EGRESS_AUDIO_ONLY,         /* Stop sending video to the subscriber */
+    JANUS_PUBSUB_EGRESS_DISCONNECT,         /* Hang up the subscriber */
+} janus_pubsub_egress_policy;
+
+/* What the caller has to do after a queue overflowed */
+typedef enum janus_pubsub_egress_action {
+    JANUS_PUBSUB_EGRESS_NONE = 0,
+    JANUS_PUBSUB_EGRESS_REQUEST_KEYFRAME,
+    JANUS_PUBSUB_EGRESS_WENT_AUDIO_ONLY,
+    JANUS_PUBSUB_EGRESS_VIDEO_RESUMED,      /* Video is back from the next keyframe, ask for one */
+    JANUS_PUBSUB_EGRESS_CLOSE,
+} janus_pubsub_egress_action;
+
+/* A packet copied once and shared by every queue it is pushed to */
+typedef struct janus_pubsub_egress_packet {
+    volatile gint ref;
+    int video;
+    gboolean keyframe;
+    int len;
+    char buf[];
+} janus_pubsub_egress_packet;
+
+/*
+ * Bounded queue of the packets waiting to be sent to one subscriber. The
+ * relay loop only pushes, an egress worker sends, so a slow subscriber
+ * only delays itself. Every subscriber is always served by the same
+ * worker, which keeps its packets in order.
+ */
+typedef struct janus_pubsub_egress {
+    volatile gint ref;                  /* Subscriber and scheduled worker each hold one */
+    janus_mutex mutex;
+    struct jansus_pubsub_stream *stream;       /* Referenced */
+    struct janus_pubsub_subscriber *subscriber;    /* Referenced, until the last packet went out */
+    guint worker;
+    guint size;
+    guint head;
+    guint count;
+    janus_pubsub_egress_packet **ring;
+    gboolean scheduled;                 /* Waiting in its worker's queue */
+    gboolean audio_only;                /* Until the queue drained to the low watermark */
+    gboolean resync;                    /* Video resumes at the next keyframe */
+    volatile gint closed;               /* Subscriber gone or disconnected, nothing is queued, set under mutex */
+    guint64 enqueued;
+    guint64 delivered;
+    guint64 dropped;
+    guint64 overflows;                  /* Times the policy had to be applied */
+} janus_pubsub_egress;
+
+typedef struct janus_pubsub_egress_stats {
+    guint depth;
+    guint size;
+    guint64 enqueued;
+    guint64 delivered;
+    guint64 dropped;
+    guint64 overflows;
+    gboolean audio_only;
+    gboolean closed;
+} janus_pubsub_egress_stats;
+
+/* Sends one packet to one subscriber, on an egress worker */
+typedef void (*janus_pubsub_egress_deliver)(struct jansus_pubsub_stream *stream,
+        struct janus_pubsub_subscriber *subscriber, int video, char *buf, int len);
+
+int janus_pubsub_egress_init(guint queue_size, guint workers, const char *policy,
+        janus_pubsub_egress_deliver deliver);
+void janus_pubsub_egress_destroy(void);
+gboolean janus_pubsub_egress_enabled(void);
+janus_pubsub_egress *janus_pubsub_egress_new(struct jansus_pubsub_stream *stream,
+        struct janus_pubsub_subscriber *subscriber);
+void janus_pubsub_egress_close(janus_pubsub_egress *egress);
+janus_pubsub_egress_packet *janus_pubsub_egress_packet_new(int video, gboolean keyframe, char *buf, int len);
+void janus_pubsub_egress_packet_unref(janus_pubsub_egress_packet *packet);
+janus_pubsub_egress_action janus_pubsub_egress_push(janus_pubsub_egress *egress,
+        janus_pubsub_egress_packet *packet);
+janus_pubsub_egress_action janus_pubsub_egress_slow_link(janus_pubsub_egress *egress);
+void janus_pubsub_egress_get_stats(janus_pubsub_egress *egress, janus_pubsub_egress_stats *stats);
+
+#endif /* EGRESS_H */
@@ -0,0 +1,246 @@
+#include <glib.h>
+
+#include <debug.h>
+#include <mutex.h>
+
+#include "epoch.h"
+
+/*
+ * Every thread that ever entered a critical section has a record telling
+ * whether it is inside one and which epoch it saw on entering. The
+ * reclaimer moves the global epoch forward once all threads inside saw
+ * the current one. Objects retired in epoch e can't be seen by anybody
+ * once the epoch reached e + 2, so three lists of retired objects are
+ * enough, and retiring or entering never waits for the reclaimer.
+ */
+
+#define JANUS_PUBSUB_EPOCH_MASK 0x3fffffff
+
+typedef struct janus_pubsub_epoch_thread {
+    volatile gint state;                /* Epoch seen on entering shifted left, low bit set while inside */
+    volatile gint in_use;               /* Cleared when the thread exits, the record is then reused */
+    guint nesting;                      /* Only touched by the thread owning the record */
+    struct janus_pubsub_epoch_thread *next;
+} janus_pubsub_epoch_thread;
+
+typedef struct janus_pubsub_retired {
+    gpointer object;
+    GDestroyNotify free_func;
+} janus_pubsub_retired;
+
+static void janus_pubsub_epoch_thread_exit(gpointer data);
+
+static GPrivate thread_record = G_PRIVATE_INIT(janus_pubsub_epoch_thread_exit);
+static janus_mutex threads_mutex;
+static janus_pubsub_epoch_thread *threads;     /* Never freed, exited threads' records are reused */
+static volatile gint global_epoch;
+
+static janus_mutex limbo_mutex;
+static GArray *limbo[3];                       /* Retired in the current epoch go to limbo[current] */
+static guint current;
+static GArray *spare;
+static guint pending;
+
+static GThread *reclaimer;
+static GAsyncQueue *reclaimer_wakeup;
+static gint reclaimer_exit;
+
+
+static void janus_pubsub_epoch_thread_exit(gpointer data) {
+    janus_pubsub_epoch_thread *record = (janus_pubsub_epoch_thread *)data;
+    record->nesting = 0;
+    g_atomic_int_set(&record->state, 0);
+    g_atomic_int_set(&record->in_use, 0);
+}
+
+
+/* Record of the calling thread, taken on its first critical section */
+static janus_pubsub_epoch_thread *janus_pubsub_epoch_thread_get(void) {
+    janus_pubsub_epoch_thread *record = g_private_get(&thread_record);
+    if (record != NULL) {
+        return record;
+    }
+    janus_mutex_lock(&threads_mutex);
+    for (record = threads; record != NULL; record = record->next) {
+        if (!g_atomic_int_get(&record->in_use)) {
+            break;
+        }
+    }
+    if (record == NULL) {
+        record = g_malloc0(sizeof(janus_pubsub_epoch_thread));
+        record->next = threads;
+        threads = record;
+    }
+    g_atomic_int_set(&record->in_use, 1);
+    janus_mutex_unlock(&threads_mutex);
+    g_private_set(&thread_record, record);
+    return record;
+}
+
+
+void janus_pubsub_epoch_enter(void) {
+    janus_pubsub_epoch_thread *record = janus_pubsub_epoch_thread_get();
+    if (record->nesting++ > 0) {
+        return;
+    }
+    guint epoch = (guint)g_atomic_int_get(&global_epoch);
+    g_atomic_int_set(&record->state, (gint)(((epoch & JANUS_PUBSUB_EPOCH_MASK) << 1) | 1));
+    /* The reclaimer has to see us inside before we read anything shared */
+    __sync_synchronize();
+}
+
+
+void janus_pubsub_epoch_exit(void) {
+    janus_pubsub_epoch_thread *record = g_private_get(&thread_record);
+    if (record == NULL || record->nesting == 0) {
+        return;
+    }
+    if (--record->nesting == 0) {
+        g_atomic_int_set(&record->state, 0);
+    }
+}
+
+
+/* Free the object once no critical section that could have found it is left */
+void janus_pubsub_epoch_retire(gpointer object, GDestroyNotify free_func) {
+    if (object == NULL) {
+        return;
+    }
+    janus_pubsub_retired retired = { object, free_func };
+    janus_mutex_lock(&limbo_mutex);
+    if (limbo[0] == NULL) {
+        /* No reclaimer, nothing relays anymore */
+        janus_mutex_unlock(&limbo_mutex);
+        free_func(object);
+        return;
+    }
+    g_array_append_val(limbo[current], retired);
+    gboolean wakeup = pending++ == 0;
+    janus_mutex_unlock(&limbo_mutex);
+    if (wakeup) {
+        g_async_queue_push(reclaimer_wakeup, GINT_TO_POINTER(1));
+    }
+}
+
+
+static void janus_pubsub_epoch_free(GArray *expired) {
+    guint i;
+    for (i = 0; i < expired->len; i++) {
+        janus_pubsub_retired *retired = &g_array_index(expired, janus_pubsub_retired, i);
+        retired->free_func(retired->object);
+    }
+    g_array_set_size(expired, 0);
+}
+
+
+/* Move to the next epoch if every thread inside saw this one, on the reclaimer */
+static void janus_pubsub_epoch_try_advance(void) {
+    guint epoch = (guint)g_atomic_int_get(&global_epoch);
+    gint inside = (gint)(((epoch & JANUS_PUBSUB_EPOCH_MASK) << 1) | 1);
+    janus_mutex_lock(&threads_mutex);
+    janus_pubsub_epoch_thread *record;
+    for (record = threads; record != NULL; record = record->next) {
+        gint state = g_atomic_int_get(&record->state);
+        if ((state & 1) && state != inside) {
+            janus_mutex_unlock(&threads_mutex);
+            return;
+        }
+    }
+    janus_mutex_unlock(&threads_mutex);
+    /* What was retired two epochs ago is out of reach now */
+    janus_mutex_lock(&limbo_mutex);
+    g_atomic_int_set(&global_epoch, (gint)(epoch + 1));
+    current = (current + 1) % 3;
+    GArray *expired = limbo[(current + 1) % 3];
+    limbo[(current + 1) % 3] = spare;
+    pending -= expired->len;
+    janus_mutex_unlock(&limbo_mutex);
+    janus_pubsub_epoch_free(expired);
+    spare = expired;
+}
+
+
+static void *janus_pubsub_epoch_reclaimer(void *data) {
+    JANUS_LOG(LOG_VERB, "Joining PubSub reclaimer\n");
+    while (!g_atomic_int_get(&reclaimer_exit)) {
+        janus_mutex_lock(&limbo_mutex);
+        gboolean busy = pending > 0;
+        janus_mutex_unlock(&limbo_mutex);
+        if (busy) {
+            /* Readers are still inside, give them a moment */
+            g_async_queue_timeout_pop(reclaimer_wakeup, JANUS_PUBSUB_EPOCH_RETRY);
+        } else {
+            g_async_queue_pop(reclaimer_wakeup);
+        }
+        janus_pubsub_epoch_try_advance();
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub reclaimer\n");
+    return NULL;
+}
+
+
+int janus_pubsub_epoch_init(void) {
+    guint i;
+    janus_mutex_init(&threads_mutex);
+    janus_mutex_init(&limbo_mutex);
+    for (i = 0; i < 3; i++) {
+        limbo[i] = g_array_new(FALSE, FALSE, sizeof(janus_pubsub_retired));
+    }
+    spare = g_array_new(FALSE, FALSE, sizeof(janus_pubsub_retired));
+    current = 0;
+    pending = 0;
+    g_atomic_int_set(&reclaimer_exit, 0);
+    reclaimer_wakeup = g_async_queue_new();
+    GError *error = NULL;
+    reclaimer = g_thread_try_new("pubsub reclaim", &janus_pubsub_epoch_reclaimer, NULL, &error);
+    if (error != NULL) {
+        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub reclaimer...\n",
+            error->code, error->message ? error->message : "??");
+        g_error_free(error);
+        reclaimer = NULL;
+        janus_pubsub_epoch_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Nothing reads anymore, free everything still retired */
+void janus_pubsub_epoch_destroy(void) {
+    if (reclaimer != NULL) {
+        g_atomic_int_set(&reclaimer_exit, 1);
+        g_async_queue_push(reclaimer_wakeup, GINT_TO_POINTER(1));
+        g_thread_join(reclaimer);
+        reclaimer = NULL;
+    }
+    guint i;
+    for (;;) {
+        GArray *expired[3];
+        janus_mutex_lock(&limbo_mutex);
+        gboolean last = pending == 0;
+        for (i = 0; i < 3; i++) {
+            expired[i] = limbo[i];
+            limbo[i] = last ? NULL : g_array_new(FALSE, FALSE, sizeof(janus_pubsub_retired));
+        }
+        pending = 0;
+        janus_mutex_unlock(&limbo_mutex);
+        /* Freeing may retire more, which goes to the new lists */
+        for (i = 0; i < 3; i++) {
+            if (expired[i] != NULL) {
+                janus_pubsub_epoch_free(expired[i]);
+                g_array_free(expired[i], TRUE);
+            }
+        }
+        if (last) {
+            break;
+        }
+    }
+    if (spare != NULL) {
+        g_array_free(spare, TRUE);
+        spare = NULL;
+    }
+    if (reclaimer_wakeup != NULL) {
+        g_async_queue_unref(reclaimer_wakeup);
+        reclaimer_wakeup = NULL;
+    }
+}
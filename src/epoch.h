@@ -0,0 +1,22 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <glib.h>
+
+/* How long the reclaimer waits before trying again to advance the epoch */
+#define JANUS_PUBSUB_EPOCH_RETRY (1000)          /* Microseconds */
+
+/*
+ * Epoch based reclamation. Threads that read sessions, snapshots or
+ * subscribers without locking do so between janus_pubsub_epoch_enter and
+ * janus_pubsub_epoch_exit. Objects unlinked from everything they can be
+ * found through are retired, and freed by the reclaimer thread once every
+ * thread that could still see them has left its critical section.
+ */
+int janus_pubsub_epoch_init(void);
+void janus_pubsub_epoch_destroy(void);
+void janus_pubsub_epoch_enter(void);
+void janus_pubsub_epoch_exit(void);
+void janus_pubsub_epoch_retire(gpointer object, GDestroyNotify free_func);
+
+#endif /* EPOCH_H */
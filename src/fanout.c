@@ -0,0 +1,209 @@
+#include <glib.h>
+
+#include <debug.h>
+
+#include "fanout.h"
+#include "batch.h"
+#include "epoch.h"
+
+/*
+ * Fan-out worker pool. Above a subscriber count threshold a packet is
+ * copied once and handed to every worker, each worker relays it to its
+ * own shard of the subscriber snapshot. A subscriber always lands in the
+ * same shard, and a worker drains its queue in order, so per subscriber
+ * packet order is kept.
+ */
+
+typedef struct janus_pubsub_fanout_job {
+    volatile gint ref;                  /* One reference per worker */
+    janus_pubsub_stream *stream;
+    janus_pubsub_snapshot *snapshot;
+    janus_pubsub_snapshot_entry *entry; /* Only subscriber to relay to, NULL for the whole shard */
+    int video;
+    int len;
+    char buf[];
+} janus_pubsub_fanout_job;
+
+typedef struct janus_pubsub_fanout_worker {
+    guint index;
+    GThread *thread;
+    GAsyncQueue *jobs;
+} janus_pubsub_fanout_worker;
+
+static janus_pubsub_fanout_worker *workers;
+static guint workers_count;
+static guint fanout_threshold;
+static janus_pubsub_fanout_relay fanout_relay;
+static janus_pubsub_fanout_job exit_job;
+
+
+static void janus_pubsub_fanout_job_unref(janus_pubsub_fanout_job *job) {
+    if (g_atomic_int_dec_and_test(&job->ref)) {
+        g_atomic_int_add(&job->stream->fanout_pending, -1);
+        janus_pubsub_snapshot_unref(job->snapshot);
+        janus_pubsub_stream_unref(job->stream);
+        g_free(job);
+    }
+}
+
+
+static void *janus_pubsub_fanout_thread(void *data) {
+    janus_pubsub_fanout_worker *worker = (janus_pubsub_fanout_worker *)data;
+    JANUS_LOG(LOG_VERB, "Joining PubSub fan-out worker %u\n", worker->index);
+    janus_pubsub_fanout_job *job = NULL;
+    for (;;) {
+        job = g_async_queue_try_pop(worker->jobs);
+        if (job == NULL) {
+            /* Idle, send any batched forwarder datagrams before blocking */
+            janus_pubsub_batch_flush_current();
+            job = g_async_queue_pop(worker->jobs);
+        }
+        if (job == &exit_job) {
+            break;
+        }
+        janus_pubsub_snapshot *snapshot = job->snapshot;
+        janus_pubsub_snapshot_entry *entry = snapshot->entries + snapshot->shard_offsets[worker->index];
+        janus_pubsub_snapshot_entry *last = snapshot->entries + snapshot->shard_offsets[worker->index + 1];
+        if (job->entry != NULL) {
+            entry = job->entry;
+            last = entry + 1;
+        }
+        /* Relaying may reach the publisher's session, keyframe requests go to it */
+        janus_pubsub_epoch_enter();
+        for (; entry < last && !job->stream->destroyed; entry++) {
+            fanout_relay(job->stream, entry, job->video, job->buf, job->len);
+        }
+        janus_pubsub_epoch_exit();
+        if (janus_pubsub_batch_enabled()) {
+            janus_pubsub_batch_packet_done(janus_pubsub_batch_get());
+        }
+        janus_pubsub_fanout_job_unref(job);
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub fan-out worker %u\n", worker->index);
+    return NULL;
+}
+
+
+int janus_pubsub_fanout_init(guint count, guint threshold, janus_pubsub_fanout_relay relay) {
+    workers = NULL;
+    workers_count = 0;
+    fanout_threshold = threshold;
+    fanout_relay = relay;
+    if (count == 0) {
+        return 0;
+    }
+    workers = g_malloc0(count * sizeof(janus_pubsub_fanout_worker));
+    guint i;
+    for (i = 0; i < count; i++) {
+        GError *error = NULL;
+        char tname[16];
+        g_snprintf(tname, sizeof(tname), "pubsub fanout %u", i);
+        workers[i].index = i;
+        workers[i].jobs = g_async_queue_new();
+        workers[i].thread = g_thread_try_new(tname, &janus_pubsub_fanout_thread, &workers[i], &error);
+        if (error != NULL) {
+            JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch a PubSub fan-out worker...\n",
+                error->code, error->message ? error->message : "??");
+            g_error_free(error);
+            g_async_queue_unref(workers[i].jobs);
+            break;
+        }
+        workers_count++;
+    }
+    if (workers_count == 0) {
+        g_free(workers);
+        workers = NULL;
+        return -1;
+    }
+    JANUS_LOG(LOG_INFO, "PubSub fan-out pool: %u workers above %u subscribers\n",
+        workers_count, fanout_threshold);
+    return 0;
+}
+
+
+void janus_pubsub_fanout_destroy(void) {
+    guint i;
+    for (i = 0; i < workers_count; i++) {
+        g_async_queue_push(workers[i].jobs, &exit_job);
+    }
+    for (i = 0; i < workers_count; i++) {
+        g_thread_join(workers[i].thread);
+        janus_pubsub_fanout_job *job = NULL;
+        while ((job = g_async_queue_try_pop(workers[i].jobs)) != NULL) {
+            janus_pubsub_fanout_job_unref(job);
+        }
+        g_async_queue_unref(workers[i].jobs);
+    }
+    g_free(workers);
+    workers = NULL;
+    workers_count = 0;
+}
+
+
+/* Number of shards subscriber snapshots are split into */
+guint janus_pubsub_fanout_shards(void) {
+    return workers_count > 0 ? workers_count : 1;
+}
+
+
+/*
+ * Whether the stream's packets go to the pool. A stream only goes back to
+ * inline relaying once the workers have drained its packets, otherwise
+ * packets could overtake each other
+ */
+static gboolean janus_pubsub_fanout_active(janus_pubsub_stream *stream, janus_pubsub_snapshot *snapshot) {
+    if (workers_count == 0 || snapshot->shards != workers_count) {
+        return FALSE;
+    }
+    return snapshot->count >= fanout_threshold || g_atomic_int_get(&stream->fanout_pending) > 0;
+}
+
+
+static janus_pubsub_fanout_job *janus_pubsub_fanout_job_new(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot *snapshot, janus_pubsub_snapshot_entry *entry, guint refs,
+        int video, char *buf, int len) {
+    janus_pubsub_fanout_job *job = g_malloc(sizeof(janus_pubsub_fanout_job) + len);
+    g_atomic_int_set(&job->ref, refs);
+    janus_pubsub_stream_ref(stream);
+    job->stream = stream;
+    janus_pubsub_snapshot_ref(snapshot);
+    job->snapshot = snapshot;
+    job->entry = entry;
+    job->video = video;
+    job->len = len;
+    memcpy(job->buf, buf, len);
+    g_atomic_int_inc(&stream->fanout_pending);
+    return job;
+}
+
+
+/* Hand a packet to the pool, returns FALSE when the caller should relay inline */
+gboolean janus_pubsub_fanout_dispatch(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot *snapshot, int video, char *buf, int len) {
+    if (!janus_pubsub_fanout_active(stream, snapshot)) {
+        return FALSE;
+    }
+    janus_pubsub_fanout_job *job = janus_pubsub_fanout_job_new(stream, snapshot, NULL,
+        workers_count, video, buf, len);
+    guint i;
+    for (i = 0; i < workers_count; i++) {
+        g_async_queue_push(workers[i].jobs, job);
+    }
+    return TRUE;
+}
+
+
+/*
+ * Hand a packet for a single subscriber of the snapshot to the worker of
+ * its shard, queued behind the packets that worker has yet to relay to it.
+ * Returns FALSE when the caller should relay inline, like the live packets
+ */
+gboolean janus_pubsub_fanout_dispatch_entry(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot *snapshot, janus_pubsub_snapshot_entry *entry, int video, char *buf, int len) {
+    if (!janus_pubsub_fanout_active(stream, snapshot)) {
+        return FALSE;
+    }
+    janus_pubsub_fanout_job *job = janus_pubsub_fanout_job_new(stream, snapshot, entry, 1, video, buf, len);
+    g_async_queue_push(workers[entry->subscriber->subscriber_id % workers_count].jobs, job);
+    return TRUE;
+}
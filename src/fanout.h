@@ -0,0 +1,25 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <glib.h>
+
+#include "stream.h"
+#include "snapshot.h"
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_FANOUT_WORKERS 0       /* Fan-out always runs on the ingress thread */
+#define PUBSUB_DEFAULT_FANOUT_THRESHOLD 500
+
+/* Relays one packet to one subscriber */
+typedef void (*janus_pubsub_fanout_relay)(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot_entry *entry, int video, char *buf, int len);
+
+int janus_pubsub_fanout_init(guint workers, guint threshold, janus_pubsub_fanout_relay relay);
+void janus_pubsub_fanout_destroy(void);
+guint janus_pubsub_fanout_shards(void);
+gboolean janus_pubsub_fanout_dispatch(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot *snapshot, int video, char *buf, int len);
+gboolean janus_pubsub_fanout_dispatch_entry(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot *snapshot, janus_pubsub_snapshot_entry *entry, int video, char *buf, int len);
+
+#endif /* FANOUT_H */
@@ -0,0 +1,241 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <mutex.h>
+#include <rtcp.h>
+#include <utils.h>
+
+#include "feedback.h"
+
+#define RTCP_PSFB 206
+#define RTCP_PSFB_PLI 1
+#define RTCP_PSFB_FIR 4
+#define RTCP_PSFB_AFB 15
+
+typedef struct janus_pubsub_estimate {
+    guint64 sub_id;
+    guint32 bitrate;
+    gint64 updated;                     /* When the subscriber last reported it */
+} janus_pubsub_estimate;
+
+static gint64 remb_interval = PUBSUB_DEFAULT_REMB_INTERVAL * 1000;
+static janus_pubsub_remb_policy remb_policy = JANUS_PUBSUB_REMB_MIN;
+static guint remb_percentile = PUBSUB_DEFAULT_REMB_PERCENTILE;
+static guint remb_outlier = PUBSUB_DEFAULT_REMB_OUTLIER;
+
+
+void janus_pubsub_feedback_init(guint interval, const char *policy, guint percentile, guint outlier) {
+    remb_interval = (gint64)(interval > 0 ? interval : PUBSUB_DEFAULT_REMB_INTERVAL) * 1000;
+    remb_policy = JANUS_PUBSUB_REMB_MIN;
+    if (policy != NULL && !strcasecmp(policy, "percentile")) {
+        remb_policy = JANUS_PUBSUB_REMB_PERCENTILE;
+    } else if (policy != NULL && !strcasecmp(policy, "trimmed")) {
+        remb_policy = JANUS_PUBSUB_REMB_TRIMMED_MIN;
+    } else if (policy != NULL && strcasecmp(policy, "min")) {
+        JANUS_LOG(LOG_WARN, "Unknown remb_policy %s, using min\n", policy);
+    }
+    remb_percentile = MIN(percentile, 100);
+    remb_outlier = MIN(outlier, 100);
+    JANUS_LOG(LOG_INFO, "PubSub bandwidth estimates: %s every %u ms\n",
+        remb_policy == JANUS_PUBSUB_REMB_PERCENTILE ? "percentile" :
+        remb_policy == JANUS_PUBSUB_REMB_TRIMMED_MIN ? "trimmed" : "min",
+        (guint)(remb_interval / 1000));
+}
+
+
+janus_pubsub_feedback *janus_pubsub_feedback_new(guint keyframe_interval) {
+    janus_pubsub_feedback *feedback = g_malloc0(sizeof(janus_pubsub_feedback));
+    janus_mutex_init(&feedback->mutex);
+    feedback->keyframe_interval = (gint64)keyframe_interval * 1000;
+    feedback->remb_interval = remb_interval;
+    feedback->estimates = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    return feedback;
+}
+
+
+void janus_pubsub_feedback_free(janus_pubsub_feedback *feedback) {
+    if (feedback == NULL) {
+        return;
+    }
+    g_hash_table_destroy(feedback->estimates);
+    janus_mutex_destroy(&feedback->mutex);
+    g_free(feedback);
+}
+
+
+/*
+ * Remove the PLI, FIR and REMB packets from a compound RTCP packet, in
+ * place, and report which ones were seen. Returns the length of what is left
+ */
+int janus_pubsub_feedback_strip(char *buf, int len, gboolean *pli, gboolean *fir, gboolean *remb) {
+    *pli = FALSE;
+    *fir = FALSE;
+    *remb = FALSE;
+    int in = 0, out = 0;
+    while (in + 4 <= len) {
+        rtcp_header *rtcp = (rtcp_header *)(buf + in);
+        int plen = (ntohs(rtcp->length) + 1) * 4;
+        if (rtcp->version != 2 || in + plen > len) {
+            /* Malformed, keep the rest untouched */
+            memmove(buf + out, buf + in, len - in);
+            out += len - in;
+            return out;
+        }
+        if (rtcp->type == RTCP_PSFB && rtcp->rc == RTCP_PSFB_PLI) {
+            *pli = TRUE;
+        } else if (rtcp->type == RTCP_PSFB && rtcp->rc == RTCP_PSFB_FIR) {
+            *fir = TRUE;
+        } else if (rtcp->type == RTCP_PSFB && rtcp->rc == RTCP_PSFB_AFB &&
+                plen >= 16 && !memcmp(buf + in + 12, "REMB", 4)) {
+            *remb = TRUE;
+        } else {
+            if (out != in) {
+                memmove(buf + out, buf + in, plen);
+            }
+            out += plen;
+        }
+        in += plen;
+    }
+    return out;
+}
+
+
+/*
+ * A subscriber asked for a keyframe. Writes the request for the publisher
+ * into out and returns its length, or 0 if one was sent less than an
+ * interval ago and this one is merged into it
+ */
+int janus_pubsub_feedback_keyframe_request(janus_pubsub_feedback *feedback, gboolean fir, char *out, int size) {
+    gint64 now = janus_get_monotonic_time();
+    janus_mutex_lock(&feedback->mutex);
+    if (feedback->last_keyframe_request > 0 &&
+            now - feedback->last_keyframe_request < feedback->keyframe_interval) {
+        feedback->keyframe_suppressed++;
+        janus_mutex_unlock(&feedback->mutex);
+        return 0;
+    }
+    feedback->last_keyframe_request = now;
+    feedback->keyframe_requests++;
+    int len = 0;
+    memset(out, 0, size);
+    if (fir && size >= 20) {
+        len = janus_rtcp_fir(out, 20, &feedback->fir_seq);
+    } else if (size >= 12) {
+        len = janus_rtcp_pli(out, 12);
+    }
+    janus_mutex_unlock(&feedback->mutex);
+    return len > 0 ? len : 0;
+}
+
+
+static gint janus_pubsub_estimate_compare(gconstpointer a, gconstpointer b) {
+    guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+/* Combine the current estimates with the configured policy, the caller holds the mutex */
+static guint32 janus_pubsub_feedback_combine(janus_pubsub_feedback *feedback, gint64 now) {
+    guint count = g_hash_table_size(feedback->estimates);
+    if (count == 0) {
+        return 0;
+    }
+    /* Once per interval, so a heap copy is fine even for large audiences */
+    guint32 *bitrates = g_new(guint32, count);
+    guint n = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, feedback->estimates);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_estimate *estimate = value;
+        if (now - estimate->updated > JANUS_PUBSUB_REMB_STALE_INTERVALS * feedback->remb_interval) {
+            /* The subscriber stopped reporting, don't let it hold the publisher back */
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+        bitrates[n++] = estimate->bitrate;
+    }
+    guint32 combined = 0;
+    if (n > 0) {
+        qsort(bitrates, n, sizeof(guint32), janus_pubsub_estimate_compare);
+        combined = bitrates[0];
+        if (remb_policy == JANUS_PUBSUB_REMB_PERCENTILE) {
+            combined = bitrates[(n - 1) * remb_percentile / 100];
+        } else if (remb_policy == JANUS_PUBSUB_REMB_TRIMMED_MIN) {
+            guint64 floor = (guint64)bitrates[n / 2] * remb_outlier / 100;
+            guint i = 0;
+            while (bitrates[i] < floor) {
+                i++;
+            }
+            combined = bitrates[i];
+        }
+    }
+    g_free(bitrates);
+    return combined;
+}
+
+
+/*
+ * A subscriber reported a bandwidth estimate. Keeps it, and once per
+ * interval writes a REMB with the combined estimate of all subscribers
+ * into out and returns its length, otherwise returns 0
+ */
+int janus_pubsub_feedback_remb(janus_pubsub_feedback *feedback, guint64 sub_id, guint32 bitrate,
+        char *out, int size) {
+    gint64 now = janus_get_monotonic_time();
+    janus_mutex_lock(&feedback->mutex);
+    feedback->remb_received++;
+    janus_pubsub_estimate *estimate = g_hash_table_lookup(feedback->estimates, &sub_id);
+    if (estimate == NULL) {
+        estimate = g_malloc0(sizeof(janus_pubsub_estimate));
+        estimate->sub_id = sub_id;
+        g_hash_table_insert(feedback->estimates, &estimate->sub_id, estimate);
+    }
+    estimate->bitrate = bitrate;
+    estimate->updated = now;
+    if (feedback->last_remb > 0 && now - feedback->last_remb < feedback->remb_interval) {
+        janus_mutex_unlock(&feedback->mutex);
+        return 0;
+    }
+    guint32 combined = janus_pubsub_feedback_combine(feedback, now);
+    int len = 0;
+    if (combined > 0 && size >= 24) {
+        memset(out, 0, size);
+        len = janus_rtcp_remb(out, 24, combined);
+    }
+    if (len > 0) {
+        feedback->last_remb = now;
+        feedback->remb_bitrate = combined;
+        feedback->remb_sent++;
+    }
+    janus_mutex_unlock(&feedback->mutex);
+    return len > 0 ? len : 0;
+}
+
+
+/* Forget the estimate of a subscriber that left */
+void janus_pubsub_feedback_remove_subscriber(janus_pubsub_feedback *feedback, guint64 sub_id) {
+    if (feedback == NULL) {
+        return;
+    }
+    janus_mutex_lock(&feedback->mutex);
+    g_hash_table_remove(feedback->estimates, &sub_id);
+    janus_mutex_unlock(&feedback->mutex);
+}
+
+
+void janus_pubsub_feedback_get_stats(janus_pubsub_feedback *feedback, janus_pubsub_feedback_stats *stats) {
+    janus_mutex_lock(&feedback->mutex);
+    stats->keyframe_requests = feedback->keyframe_requests;
+    stats->keyframe_suppressed = feedback->keyframe_suppressed;
+    stats->remb_received = feedback->remb_received;
+    stats->remb_sent = feedback->remb_sent;
+    stats->remb_bitrate = feedback->remb_bitrate;
+    stats->remb_subscribers = g_hash_table_size(feedback->estimates);
+    janus_mutex_unlock(&feedback->mutex);
+}
@@ -0,0 +1,64 @@
+#ifndef FEEDBACK_H
+#define FEEDBACK_H
+
+#include <glib.h>
+
+/* janus includes */
+#include <mutex.h>
+
+#define PUBSUB_DEFAULT_KEYFRAME_INTERVAL 500   /* Milliseconds between keyframe requests to a publisher */
+#define PUBSUB_DEFAULT_REMB_INTERVAL 1000      /* Milliseconds between bandwidth estimates to a publisher */
+#define PUBSUB_DEFAULT_REMB_POLICY "min"
+#define PUBSUB_DEFAULT_REMB_PERCENTILE 10      /* Percentile of the estimates, "percentile" policy */
+#define PUBSUB_DEFAULT_REMB_OUTLIER 25         /* Percent of the median below which an estimate is ignored */
+
+/* Intervals without a report after which a subscriber's estimate is dropped */
+#define JANUS_PUBSUB_REMB_STALE_INTERVALS 5
+
+typedef enum janus_pubsub_remb_policy {
+    JANUS_PUBSUB_REMB_MIN = 0,          /* Lowest estimate */
+    JANUS_PUBSUB_REMB_PERCENTILE,       /* Estimate at a percentile */
+    JANUS_PUBSUB_REMB_TRIMMED_MIN,      /* Lowest estimate that is not an outlier */
+} janus_pubsub_remb_policy;
+
+/*
+ * Subscriber feedback merged per stream before it reaches the publisher.
+ * Keyframe requests (PLI and FIR) from all subscribers are coalesced so
+ * the publisher sees at most one per interval, and the REMB of every
+ * subscriber is kept and combined into a single estimate per interval.
+ */
+typedef struct janus_pubsub_feedback {
+    janus_mutex mutex;
+    gint64 keyframe_interval;           /* Microseconds */
+    gint64 last_keyframe_request;       /* When the publisher was last asked for a keyframe */
+    int fir_seq;                        /* FIR sequence number towards the publisher */
+    guint64 keyframe_requests;          /* Requests sent to the publisher */
+    guint64 keyframe_suppressed;        /* Requests merged into one already sent */
+    gint64 remb_interval;               /* Microseconds */
+    gint64 last_remb;                   /* When the publisher was last sent an estimate */
+    GHashTable *estimates;              /* Latest estimate of each subscriber, by subscriber id */
+    guint32 remb_bitrate;               /* Last estimate sent to the publisher */
+    guint64 remb_received;              /* Estimates reported by subscribers */
+    guint64 remb_sent;                  /* Estimates sent to the publisher */
+} janus_pubsub_feedback;
+
+typedef struct janus_pubsub_feedback_stats {
+    guint64 keyframe_requests;
+    guint64 keyframe_suppressed;
+    guint64 remb_received;
+    guint64 remb_sent;
+    guint32 remb_bitrate;
+    guint remb_subscribers;             /* Subscribers with a current estimate */
+} janus_pubsub_feedback_stats;
+
+void janus_pubsub_feedback_init(guint remb_interval, const char *policy, guint percentile, guint outlier);
+janus_pubsub_feedback *janus_pubsub_feedback_new(guint keyframe_interval);
+void janus_pubsub_feedback_free(janus_pubsub_feedback *feedback);
+int janus_pubsub_feedback_strip(char *buf, int len, gboolean *pli, gboolean *fir, gboolean *remb);
+int janus_pubsub_feedback_keyframe_request(janus_pubsub_feedback *feedback, gboolean fir, char *out, int size);
+int janus_pubsub_feedback_remb(janus_pubsub_feedback *feedback, guint64 sub_id, guint32 bitrate,
+        char *out, int size);
+void janus_pubsub_feedback_remove_subscriber(janus_pubsub_feedback *feedback, guint64 sub_id);
+void janus_pubsub_feedback_get_stats(janus_pubsub_feedback *feedback, janus_pubsub_feedback_stats *stats);
+
+#endif /* FEEDBACK_H */
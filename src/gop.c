@@ -0,0 +1,194 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <rtp.h>
+#include <utils.h>
+
+#include "gop.h"
+
+
+janus_pubsub_video_codec janus_pubsub_gop_codec_from_name(const char *name) {
+    if (name == NULL) {
+        return JANUS_PUBSUB_CODEC_UNKNOWN;
+    }
+    if (!g_ascii_strcasecmp(name, "vp8")) {
+        return JANUS_PUBSUB_CODEC_VP8;
+    }
+    if (!g_ascii_strcasecmp(name, "vp9")) {
+        return JANUS_PUBSUB_CODEC_VP9;
+    }
+    if (!g_ascii_strcasecmp(name, "h264")) {
+        return JANUS_PUBSUB_CODEC_H264;
+    }
+    return JANUS_PUBSUB_CODEC_UNKNOWN;
+}
+
+
+/* The name janus_pubsub_gop_codec_from_name takes back, NULL if unknown */
+const char *janus_pubsub_gop_codec_name(janus_pubsub_video_codec codec) {
+    switch (codec) {
+        case JANUS_PUBSUB_CODEC_VP8:
+            return "vp8";
+        case JANUS_PUBSUB_CODEC_VP9:
+            return "vp9";
+        case JANUS_PUBSUB_CODEC_H264:
+            return "h264";
+        default:
+            return NULL;
+    }
+}
+
+
+janus_pubsub_gop *janus_pubsub_gop_new(gsize max_bytes) {
+    if (max_bytes == 0) {
+        return NULL;
+    }
+    janus_pubsub_gop *gop = g_malloc0(sizeof(janus_pubsub_gop));
+    gop->max_bytes = max_bytes;
+    gop->pt = -1;
+    gop->data = g_byte_array_new();
+    gop->offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+    return gop;
+}
+
+
+void janus_pubsub_gop_free(janus_pubsub_gop *gop) {
+    if (gop == NULL) {
+        return;
+    }
+    g_byte_array_free(gop->data, TRUE);
+    g_array_free(gop->offsets, TRUE);
+    g_free(gop);
+}
+
+
+void janus_pubsub_gop_set_codec(janus_pubsub_gop *gop, janus_pubsub_video_codec codec, int pt) {
+    if (gop == NULL) {
+        return;
+    }
+    g_atomic_int_set(&gop->pt, pt);
+    g_atomic_int_set(&gop->codec, codec);
+}
+
+
+/* First video payload type of an offer that we know how to parse */
+janus_pubsub_video_codec janus_pubsub_gop_codec_from_sdp(const char *sdp, int *pt) {
+    *pt = -1;
+    if (sdp == NULL) {
+        return JANUS_PUBSUB_CODEC_UNKNOWN;
+    }
+    const char *video = strstr(sdp, "m=video");
+    if (video == NULL) {
+        return JANUS_PUBSUB_CODEC_UNKNOWN;
+    }
+    const char *end = strstr(video + 1, "m=");
+    const char *line = video;
+    while ((line = strstr(line, "a=rtpmap:")) != NULL && (end == NULL || line < end)) {
+        char name[32];
+        if (sscanf(line, "a=rtpmap:%d %31[^/]", pt, name) == 2) {
+            janus_pubsub_video_codec codec = janus_pubsub_gop_codec_from_name(name);
+            if (codec != JANUS_PUBSUB_CODEC_UNKNOWN) {
+                return codec;
+            }
+        }
+        line += strlen("a=rtpmap:");
+    }
+    *pt = -1;
+    return JANUS_PUBSUB_CODEC_UNKNOWN;
+}
+
+
+void janus_pubsub_gop_set_codec_from_sdp(janus_pubsub_gop *gop, const char *sdp) {
+    if (gop == NULL || sdp == NULL) {
+        return;
+    }
+    int pt = -1;
+    janus_pubsub_video_codec codec = janus_pubsub_gop_codec_from_sdp(sdp, &pt);
+    if (codec != JANUS_PUBSUB_CODEC_UNKNOWN) {
+        JANUS_LOG(LOG_VERB, "Caching keyframes (pt=%d)\n", pt);
+        janus_pubsub_gop_set_codec(gop, codec, pt);
+    }
+}
+
+
+gboolean janus_pubsub_gop_is_keyframe(janus_pubsub_video_codec codec, char *payload, int plen) {
+    switch (codec) {
+        case JANUS_PUBSUB_CODEC_VP8:
+            return janus_vp8_is_keyframe(payload, plen);
+        case JANUS_PUBSUB_CODEC_VP9:
+            return janus_vp9_is_keyframe(payload, plen);
+        case JANUS_PUBSUB_CODEC_H264:
+            return janus_h264_is_keyframe(payload, plen);
+        default:
+            return FALSE;
+    }
+}
+
+
+static void janus_pubsub_gop_reset(janus_pubsub_gop *gop) {
+    g_byte_array_set_size(gop->data, 0);
+    g_array_set_size(gop->offsets, 0);
+    gop->complete = FALSE;
+}
+
+
+/*
+ * Cache a video packet. A keyframe with a new timestamp starts a new
+ * group, a group that outgrows max_bytes is dropped until the next one.
+ * Returns whether the packet was cached
+ */
+gboolean janus_pubsub_gop_add(janus_pubsub_gop *gop, char *buf, int len) {
+    janus_pubsub_video_codec codec = g_atomic_int_get(&gop->codec);
+    if (codec == JANUS_PUBSUB_CODEC_UNKNOWN || len < 12) {
+        return FALSE;
+    }
+    rtp_header *rtp = (rtp_header *)buf;
+    int pt = g_atomic_int_get(&gop->pt);
+    if (pt >= 0 && rtp->type != pt) {
+        /* Retransmissions and the like */
+        return FALSE;
+    }
+    guint32 ts = ntohl(rtp->timestamp);
+    int plen = 0;
+    char *payload = janus_rtp_payload(buf, len, &plen);
+    if (payload != NULL && plen > 0 && (!gop->complete || ts != gop->keyframe_ts) &&
+            janus_pubsub_gop_is_keyframe(codec, payload, plen)) {
+        janus_pubsub_gop_reset(gop);
+        gop->complete = TRUE;
+        gop->keyframe_ts = ts;
+    }
+    if (!gop->complete) {
+        return FALSE;
+    }
+    if (gop->data->len + len > gop->max_bytes) {
+        JANUS_LOG(LOG_VERB, "Keyframe cache over %zu bytes, waiting for the next keyframe\n", gop->max_bytes);
+        janus_pubsub_gop_reset(gop);
+        return FALSE;
+    }
+    guint offset = gop->data->len;
+    g_array_append_val(gop->offsets, offset);
+    g_byte_array_append(gop->data, (guint8 *)buf, len);
+    return TRUE;
+}
+
+
+/* Number of packets a new subscriber can be given, 0 until a keyframe is cached */
+guint janus_pubsub_gop_count(janus_pubsub_gop *gop) {
+    if (gop == NULL || !gop->complete) {
+        return 0;
+    }
+    return gop->offsets->len;
+}
+
+
+char *janus_pubsub_gop_packet(janus_pubsub_gop *gop, guint i, int *len) {
+    guint start = g_array_index(gop->offsets, guint, i);
+    guint end = (i + 1 < gop->offsets->len) ? g_array_index(gop->offsets, guint, i + 1) : gop->data->len;
+    *len = end - start;
+    return (char *)gop->data->data + start;
+}
@@ -0,0 +1,42 @@
+#ifndef GOP_H
+#define GOP_H
+
+#include <glib.h>
+
+#define PUBSUB_DEFAULT_GOP_CACHE_SIZE 1048576   /* Bytes per stream, 0 disables the cache */
+
+typedef enum janus_pubsub_video_codec {
+    JANUS_PUBSUB_CODEC_UNKNOWN = 0,
+    JANUS_PUBSUB_CODEC_VP8,
+    JANUS_PUBSUB_CODEC_VP9,
+    JANUS_PUBSUB_CODEC_H264,
+} janus_pubsub_video_codec;
+
+/*
+ * The video packets of a stream since its last keyframe. Packets are only
+ * added and replayed by the thread relaying the stream, so no locking is
+ * needed; the codec is set by the handler before media flows.
+ */
+typedef struct janus_pubsub_gop {
+    volatile gint codec;                /* janus_pubsub_video_codec of the video payload type */
+    volatile gint pt;                   /* Video payload type, -1 for any */
+    gsize max_bytes;
+    gboolean complete;                  /* The cache starts with a keyframe and can be replayed */
+    guint32 keyframe_ts;                /* RTP timestamp of the cached keyframe */
+    GByteArray *data;                   /* Packets back to back */
+    GArray *offsets;                    /* Start of each packet in data */
+} janus_pubsub_gop;
+
+janus_pubsub_video_codec janus_pubsub_gop_codec_from_name(const char *name);
+const char *janus_pubsub_gop_codec_name(janus_pubsub_video_codec codec);
+janus_pubsub_gop *janus_pubsub_gop_new(gsize max_bytes);
+void janus_pubsub_gop_free(janus_pubsub_gop *gop);
+void janus_pubsub_gop_set_codec(janus_pubsub_gop *gop, janus_pubsub_video_codec codec, int pt);
+janus_pubsub_video_codec janus_pubsub_gop_codec_from_sdp(const char *sdp, int *pt);
+void janus_pubsub_gop_set_codec_from_sdp(janus_pubsub_gop *gop, const char *sdp);
+gboolean janus_pubsub_gop_is_keyframe(janus_pubsub_video_codec codec, char *payload, int plen);
+gboolean janus_pubsub_gop_add(janus_pubsub_gop *gop, char *buf, int len);
+guint janus_pubsub_gop_count(janus_pubsub_gop *gop);
+char *janus_pubsub_gop_packet(janus_pubsub_gop *gop, guint i, int *len);
+
+#endif /* GOP_H */
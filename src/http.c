@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <curl/curl.h>
+
+#include <debug.h>
+#include <mutex.h>
+
+#include "http.h"
+
+/*
+ * Asynchronous HTTP client for the publish and subscribe callbacks, and
+ * for the Janus API of the nodes cascaded streams are pulled from. A
+ * single thread drives every transfer with curl multi, so a slow backend
+ * only delays the requests waiting on it. Completions are reported
+ * through a callback on that thread.
+ *
+ * Easy handles are kept in a pool once their request is done and the
+ * multi handle keeps up to pool_size connections alive, so consecutive
+ * joins skip the TCP (and TLS) handshake with the endpoints.
+ */
+
+static CURLM *multi;
+static GThread *http_thread;
+static GAsyncQueue *pending;
+static GList *in_flight;                /* Requests added to the multi handle */
+static GQueue *idle_handles;            /* Only touched by the HTTP thread */
+static struct curl_slist *headers;
+static int wakeup[2] = { -1, -1 };
+static volatile gint http_stopping;
+
+static guint http_pool_size;
+static guint http_idle_timeout;
+static guint http_timeout;
+
+static janus_pubsub_http_stats stats;
+static janus_mutex stats_mutex;
+
+
+static size_t janus_pubsub_http_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    janus_pubsub_http_request *request = (janus_pubsub_http_request *)userdata;
+    size_t len = size * nmemb;
+    if (request->body->len < JANUS_PUBSUB_HTTP_MAX_BODY) {
+        g_string_append_len(request->body, ptr, MIN(len, JANUS_PUBSUB_HTTP_MAX_BODY - request->body->len));
+    }
+    return len;
+}
+
+
+/* Take a handle from the pool, its connection is still in the multi cache */
+static CURL *janus_pubsub_http_handle_get(void) {
+    CURL *curl = g_queue_pop_head(idle_handles);
+    if (curl == NULL) {
+        return curl_easy_init();
+    }
+    janus_mutex_lock(&stats_mutex);
+    stats.pooled = g_queue_get_length(idle_handles);
+    janus_mutex_unlock(&stats_mutex);
+    return curl;
+}
+
+
+static void janus_pubsub_http_handle_put(CURL *curl) {
+    if (g_queue_get_length(idle_handles) >= http_pool_size) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    /* Reset drops the options but keeps the connection and DNS caches */
+    curl_easy_reset(curl);
+    g_queue_push_head(idle_handles, curl);
+    janus_mutex_lock(&stats_mutex);
+    stats.pooled = g_queue_get_length(idle_handles);
+    janus_mutex_unlock(&stats_mutex);
+}
+
+
+static void janus_pubsub_http_request_free(janus_pubsub_http_request *request) {
+    if (request->curl != NULL) {
+        janus_pubsub_http_handle_put(request->curl);
+    }
+    g_free(request->url);
+    free(request->post_data);
+    g_string_free(request->body, TRUE);
+    g_free(request);
+}
+
+
+static void janus_pubsub_http_complete(janus_pubsub_http_request *request, CURLcode result) {
+    request->result = result;
+    long connects = 0;
+    if (request->curl != NULL && result == CURLE_OK) {
+        curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &request->status);
+        curl_easy_getinfo(request->curl, CURLINFO_NUM_CONNECTS, &connects);
+    }
+    janus_mutex_lock(&stats_mutex);
+    stats.requests++;
+    if (result != CURLE_OK) {
+        stats.failures++;
+    } else if (connects == 0) {
+        /* No new connection was needed, a kept-alive one served the request */
+        stats.reused++;
+    } else {
+        stats.connects++;
+    }
+    janus_mutex_unlock(&stats_mutex);
+    request->callback(request, request->data);
+    janus_pubsub_http_request_free(request);
+}
+
+
+static int janus_pubsub_http_start(janus_pubsub_http_request *request) {
+    request->curl = janus_pubsub_http_handle_get();
+    if (request->curl == NULL) {
+        return -1;
+    }
+    CURL *curl = request->curl;
+    curl_easy_setopt(curl, CURLOPT_URL, request->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (request->post_data != NULL) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->post_data);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    }
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, janus_pubsub_http_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, request);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long)http_idle_timeout);
+    guint timeout = request->timeout > 0 ? request->timeout : http_timeout;
+    if (timeout > 0) {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout);
+    }
+    CURLMcode mres = curl_multi_add_handle(multi, curl);
+    if (mres != CURLM_OK) {
+        JANUS_LOG(LOG_ERR, "Error starting HTTP request: %s\n", curl_multi_strerror(mres));
+        return -1;
+    }
+    in_flight = g_list_prepend(in_flight, request);
+    return 0;
+}
+
+
+static void *janus_pubsub_http_thread(void *data) {
+    JANUS_LOG(LOG_VERB, "Joining PubSub HTTP thread\n");
+    int running = 0;
+    while (!g_atomic_int_get(&http_stopping)) {
+        /* Start the requests queued since the last wakeup */
+        janus_pubsub_http_request *request = NULL;
+        while ((request = g_async_queue_try_pop(pending)) != NULL) {
+            if (janus_pubsub_http_start(request) < 0) {
+                janus_pubsub_http_complete(request, CURLE_FAILED_INIT);
+            }
+        }
+        curl_multi_perform(multi, &running);
+        CURLMsg *m = NULL;
+        int left = 0;
+        while ((m = curl_multi_info_read(multi, &left)) != NULL) {
+            if (m->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL *curl = m->easy_handle;
+            CURLcode result = m->data.result;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&request);
+            curl_multi_remove_handle(multi, curl);
+            in_flight = g_list_remove(in_flight, request);
+            janus_pubsub_http_complete(request, result);
+        }
+        struct curl_waitfd wfd;
+        wfd.fd = wakeup[0];
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+        curl_multi_wait(multi, &wfd, 1, 1000, NULL);
+        if (wfd.revents) {
+            char buf[64];
+            while (read(wakeup[0], buf, sizeof(buf)) > 0);
+        }
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub HTTP thread\n");
+    return NULL;
+}
+
+
+int janus_pubsub_http_init(guint pool_size, guint idle_timeout, guint timeout) {
+    http_pool_size = pool_size > 0 ? pool_size : 1;
+    http_idle_timeout = idle_timeout;
+    http_timeout = timeout;
+    multi = curl_multi_init();
+    if (multi == NULL) {
+        return -1;
+    }
+    /* Connections kept alive, and opened at most, towards each endpoint */
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)http_pool_size);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)http_pool_size);
+    if (pipe(wakeup) < 0) {
+        JANUS_LOG(LOG_ERR, "Error creating HTTP wakeup pipe... %d (%s)\n", errno, strerror(errno));
+        curl_multi_cleanup(multi);
+        multi = NULL;
+        return -1;
+    }
+    fcntl(wakeup[0], F_SETFL, fcntl(wakeup[0], F_GETFL, 0) | O_NONBLOCK);
+    janus_mutex_init(&stats_mutex);
+    memset(&stats, 0, sizeof(stats));
+    headers = NULL;
+    headers = curl_slist_append(headers, "Accept: application/json");
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    pending = g_async_queue_new();
+    idle_handles = g_queue_new();
+    g_atomic_int_set(&http_stopping, 0);
+    GError *error = NULL;
+    http_thread = g_thread_try_new("pubsub http", &janus_pubsub_http_thread, NULL, &error);
+    if (error != NULL) {
+        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub HTTP thread...\n",
+            error->code, error->message ? error->message : "??");
+        g_error_free(error);
+        return -1;
+    }
+    JANUS_LOG(LOG_INFO, "PubSub HTTP pool: %u connections, %us idle timeout, %ums request timeout\n",
+        http_pool_size, http_idle_timeout, http_timeout);
+    return 0;
+}
+
+
+/* Stop the HTTP thread, requests still in flight complete as aborted */
+void janus_pubsub_http_destroy(void) {
+    if (http_thread == NULL) {
+        return;
+    }
+    g_atomic_int_set(&http_stopping, 1);
+    if (write(wakeup[1], "x", 1) < 0) {
+        JANUS_LOG(LOG_WARN, "Error waking up the HTTP thread\n");
+    }
+    g_thread_join(http_thread);
+    http_thread = NULL;
+    janus_pubsub_http_request *request = NULL;
+    while ((request = g_async_queue_try_pop(pending)) != NULL) {
+        janus_pubsub_http_complete(request, CURLE_ABORTED_BY_CALLBACK);
+    }
+    while (in_flight != NULL) {
+        request = (janus_pubsub_http_request *)in_flight->data;
+        in_flight = g_list_delete_link(in_flight, in_flight);
+        curl_multi_remove_handle(multi, request->curl);
+        janus_pubsub_http_complete(request, CURLE_ABORTED_BY_CALLBACK);
+    }
+    JANUS_LOG(LOG_INFO, "PubSub HTTP: %"G_GUINT64_FORMAT" requests, %"G_GUINT64_FORMAT" failed, "
+        "%"G_GUINT64_FORMAT" new connections, %"G_GUINT64_FORMAT" reused\n",
+        stats.requests, stats.failures, stats.connects, stats.reused);
+    g_queue_free_full(idle_handles, (GDestroyNotify)curl_easy_cleanup);
+    idle_handles = NULL;
+    curl_multi_cleanup(multi);
+    multi = NULL;
+    g_async_queue_unref(pending);
+    curl_slist_free_all(headers);
+    close(wakeup[0]);
+    close(wakeup[1]);
+}
+
+
+static int janus_pubsub_http_queue(janus_pubsub_http_request *request) {
+    if (g_atomic_int_get(&http_stopping)) {
+        janus_pubsub_http_complete(request, CURLE_FAILED_INIT);
+        return -1;
+    }
+    g_async_queue_push(pending, request);
+    if (write(wakeup[1], "x", 1) < 0) {
+        JANUS_LOG(LOG_WARN, "Error waking up the HTTP thread\n");
+    }
+    return 0;
+}
+
+
+/*
+ * Queue a JSON POST, the request takes ownership of post_data (allocated
+ * by json_dumps). The callback runs on the HTTP thread
+ */
+int janus_pubsub_http_post(const char *url, char *post_data,
+        janus_pubsub_http_callback callback, void *data) {
+    janus_pubsub_http_request *request = g_malloc0(sizeof(janus_pubsub_http_request));
+    request->url = g_strdup(url);
+    request->post_data = post_data;
+    request->body = g_string_new(NULL);
+    request->callback = callback;
+    request->data = data;
+    return janus_pubsub_http_queue(request);
+}
+
+
+/* Queue a GET, long polls pass a timeout longer than the configured one */
+int janus_pubsub_http_get(const char *url, guint timeout,
+        janus_pubsub_http_callback callback, void *data) {
+    janus_pubsub_http_request *request = g_malloc0(sizeof(janus_pubsub_http_request));
+    request->url = g_strdup(url);
+    request->timeout = timeout;
+    request->body = g_string_new(NULL);
+    request->callback = callback;
+    request->data = data;
+    return janus_pubsub_http_queue(request);
+}
+
+
+void janus_pubsub_http_get_stats(janus_pubsub_http_stats *out) {
+    janus_mutex_lock(&stats_mutex);
+    *out = stats;
+    janus_mutex_unlock(&stats_mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <glib.h>
+#include <curl/curl.h>
+
+#define PUBSUB_DEFAULT_HTTP_POOL_SIZE 8
+#define PUBSUB_DEFAULT_HTTP_IDLE_TIMEOUT 60     /* Seconds */
+#define PUBSUB_DEFAULT_HTTP_TIMEOUT 5000        /* Milliseconds */
+
+/* Largest response body kept for the completion callback */
+#define JANUS_PUBSUB_HTTP_MAX_BODY 16384
+
+typedef struct janus_pubsub_http_request janus_pubsub_http_request;
+
+/* Called on the HTTP thread once a request completed or failed */
+typedef void (*janus_pubsub_http_callback)(janus_pubsub_http_request *request, void *data);
+
+struct janus_pubsub_http_request {
+    CURL *curl;                         /* Pooled handle, only set while in flight */
+    char *url;
+    char *post_data;                    /* NULL for a GET */
+    guint timeout;                      /* Milliseconds, 0 for the configured one */
+    CURLcode result;                    /* Transfer result */
+    long status;                        /* HTTP response code, 0 if none */
+    GString *body;                      /* Response body, truncated to JANUS_PUBSUB_HTTP_MAX_BODY */
+    janus_pubsub_http_callback callback;
+    void *data;
+};
+
+typedef struct janus_pubsub_http_stats {
+    guint64 requests;                   /* Completed requests */
+    guint64 failures;                   /* Requests that did not get a response */
+    guint64 connects;                   /* Requests that opened a new connection */
+    guint64 reused;                     /* Requests sent on a kept-alive connection */
+    guint pooled;                       /* Idle handles in the pool */
+} janus_pubsub_http_stats;
+
+int janus_pubsub_http_init(guint pool_size, guint idle_timeout, guint timeout);
+void janus_pubsub_http_destroy(void);
+int janus_pubsub_http_post(const char *url, char *post_data,
+        janus_pubsub_http_callback callback, void *data);
+int janus_pubsub_http_get(const char *url, guint timeout,
+        janus_pubsub_http_callback callback, void *data);
+void janus_pubsub_http_get_stats(janus_pubsub_http_stats *stats);
+
+#endif /* HTTP_H */
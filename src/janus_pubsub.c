@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <netdb.h>
+#include <fcntl.h>
 
 
 #include <jansson.h>
@@ -24,6 +25,19 @@
 #include "puller.h"
 #include "forward.h"
 #include "stream.h"
+#include "snapshot.h"
+#include "epoch.h"
+#include "fanout.h"
+#include "batch.h"
+#include "reactor.h"
+#include "http.h"
+#include "authcache.h"
+#include "simulcast.h"
+#include "egress.h"
+#include "recording.h"
+#include "metrics.h"
+#include "cascade.h"
+#include "multicast.h"
 
 
 #define JANUS_PUBSUB_VERSION 1
@@ -52,19 +66,22 @@ void janus_pubsub_incoming_rtcp(janus_plugin_session *handle, int video, char *b
 void janus_pubsub_incoming_data(janus_plugin_session *handle, char *buf, int len);
 void janus_pubsub_slow_link(janus_plugin_session *handle, int uplink, int video);
 void janus_pubsub_hangup_media(janus_plugin_session *handle);
-static void *janus_pubsub_pull_thread(void *data);
 static void *janus_pubsub_handler(void *data);
 void janus_pubsub_relay_rtp(void *stream_p, int video, char *buf, int len); 
+void janus_pubsub_relay_data(void *stream_p, char *buf, int len);
+static void janus_pubsub_relay_entry(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot_entry *entry, int video, char *buf, int len);
+static void janus_pubsub_request_keyframe(janus_pubsub_stream *stream, gboolean fir);
+static json_t *janus_pubsub_feedback_request(janus_plugin_session *handle, json_t *root,
+        int *error_code, char *error_cause);
+static void janus_pubsub_cascade_event(janus_pubsub_stream *stream, janus_plugin_session *handle,
+        const char *error, json_t *result, json_t *jsep);
+static void janus_pubsub_egress_send(janus_pubsub_stream *stream, janus_pubsub_subscriber *subscriber,
+        int video, char *buf, int len);
 json_t *janus_pubsub_query_session(janus_plugin_session *handle);
 
 janus_mutex pubsub_streams_mutex;
-janus_mutex pubsub_sessions_mutex;
 GHashTable *pubsub_streams;
-GList *pubsub_old_sessions;
-GList *pubsub_old_streams;
-GList *pubsub_old_subscribers;
-static GThread *handler_thread;
-static GThread *watchdog;
 static janus_callbacks *gateway = NULL;
 
 static janus_plugin janus_pubsub_plugin =
@@ -112,31 +129,107 @@ static struct janus_json_parameter pull_parameters[] = {
     {"video_port", JSON_INTEGER, 0},
     {"audio_port", JSON_INTEGER, 0},
     {"data_port", JSON_INTEGER, 0},
+    {"batch_size", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"buffer_count", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"video_codec", JSON_STRING, 0},
 };
-static struct janus_json_parameter subscribe_parameters[] = {
+static struct janus_json_parameter cascade_parameters[] = {
     {"name", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
+    {"upstream", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
+    {"upstream_name", JSON_STRING, 0},
+    {"upstream_id", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"host", JSON_STRING, 0},
+    {"video_port", JSON_INTEGER, 0},
+    {"audio_port", JSON_INTEGER, 0},
+    {"data_port", JSON_INTEGER, 0},
+    {"batch_size", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"buffer_count", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"video_codec", JSON_STRING, 0},
+};
+static struct janus_json_parameter subscribe_parameters[] = {
+    {"name", JSON_STRING, 0},
+    {"id", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
     {"kind", JSON_STRING, 0},
 };
 static struct janus_json_parameter forward_parameters[] = {
-    {"name", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
     {"kind", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
     {"host", JSON_STRING, 0},
     {"video_port", JSON_INTEGER, 0},
     {"audio_port", JSON_INTEGER, 0},
     {"data_port", JSON_INTEGER, 0},
 };
+static struct janus_json_parameter multicast_parameters[] = {
+    {"kind", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
+    {"group", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
+    {"video_port", JSON_INTEGER, 0},
+    {"audio_port", JSON_INTEGER, 0},
+    {"data_port", JSON_INTEGER, 0},
+    {"ttl", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+    {"interface", JSON_STRING, 0},
+    {"loopback", JANUS_JSON_BOOL, 0},
+};
+static struct janus_json_parameter configure_parameters[] = {
+    {"substream", JSON_INTEGER, 0},
+};
+static struct janus_json_parameter feedback_parameters[] = {
+    {"keyframe", JANUS_JSON_BOOL, 0},
+    {"bitrate", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+};
+static struct janus_json_parameter stats_parameters[] = {
+    {"name", JSON_STRING, 0},
+    {"id", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+};
+static struct janus_json_parameter record_parameters[] = {
+    {"record", JANUS_JSON_BOOL, JANUS_JSON_PARAM_REQUIRED},
+    {"filename", JSON_STRING, 0},
+};
 
 
 //static volatile gint initialized = 0, stopping = 0;
 //static gboolean notify_events = TRUE;
 static volatile gint initialized, stopping;
-static GThread *handler_thread;
-static GThread *watchdog;
+static GThread **handler_threads;
+static guint handler_count;
 static gboolean notify_events = TRUE;
 
 typedef struct janus_pubsub_config {
     char *publish_endpoint;
     char *subscribe_endpoint;
+    guint fanout_workers;              /* Fan-out worker threads, 0 relays on the ingress thread */
+    guint fanout_threshold;            /* Subscriber count above which a stream uses the workers */
+    gboolean forward_batch;            /* Send forwarder datagrams with sendmmsg */
+    guint forward_batch_size;          /* Datagrams per sendmmsg call */
+    guint forward_batch_packets;       /* Pulled packets collected before a flush */
+    guint pull_batch_size;             /* Default datagrams per recvmmsg call for pulled streams */
+    guint pull_buffer_count;           /* Default packet buffers per pull socket */
+    guint pull_reactors;               /* Threads waiting on the sockets of pulled streams */
+    guint http_pool_size;              /* Connections kept alive towards the publish/subscribe endpoints */
+    guint http_idle_timeout;           /* Seconds before an idle connection is closed */
+    guint http_timeout;                /* Milliseconds before a publish/subscribe request fails */
+    guint keyframe_interval;           /* Milliseconds between keyframe requests sent to a publisher */
+    guint remb_interval;               /* Milliseconds between bandwidth estimates sent to a publisher */
+    gchar *remb_policy;                /* How subscriber estimates are combined */
+    guint remb_percentile;             /* Percentile used by the "percentile" policy */
+    guint remb_outlier;                /* Percent of the median below which "trimmed" ignores an estimate */
+    gchar *simulcast_bitrates;         /* Estimates at which substreams 1 and 2 are picked */
+    guint simulcast_substream;         /* Substream new subscribers start with */
+    guint egress_queue_size;           /* Packets queued per subscriber, 0 relays inline */
+    guint egress_workers;              /* Threads sending the queued packets */
+    gchar *egress_policy;              /* What to do with a subscriber that can't keep up */
+    gchar *record_dir;                 /* Where recordings are written, NULL for the current directory */
+    guint record_buffer_size;          /* Packets buffered per recorded stream */
+    guint record_flush_interval;       /* Milliseconds between recording writes */
+    guint gop_cache_size;              /* Bytes of video cached per stream for joining subscribers */
+    guint handler_threads;             /* Message handler shards, 0 starts one per core */
+    guint auth_cache_ttl;              /* Seconds a subscribe decision is reused, 0 disables */
+    guint auth_cache_size;             /* Most subscribe decisions kept */
+    gchar *auth_cache_fields;          /* Comma separated subscribe fields the decision depends on */
+    guint cascade_retry;               /* Seconds before a lost upstream node is tried again */
+    guint cascade_keepalive;           /* Seconds between requests keeping an upstream session */
+    gchar *cascade_upstreams;          /* Comma separated Janus API URLs streams may be cascaded from */
+    guint multicast_ttl;               /* Hops multicast forwarders' packets may take */
+    gchar *multicast_interface;        /* Interface multicast goes out on, NULL lets routing pick */
+    gboolean multicast_loopback;       /* Whether group members on this host get the packets */
 } janus_pubsub_config;
 
 static janus_pubsub_config *config;
@@ -146,10 +239,15 @@ typedef struct janus_pubsub_message {
     char *transaction;
     json_t *message;
     json_t *jsep;
+    gboolean http_done;                /* Set once the publish/subscribe callback answered */
+    CURLcode http_result;
+    long http_status;
+    gchar *auth_key;                   /* Subscribe cache key while the decision is pending */
 } janus_pubsub_message;
 
 
-static GAsyncQueue *messages = NULL;
+/* One queue per handler thread, a handle's messages always go to the same one */
+static GAsyncQueue **messages = NULL;
 static janus_pubsub_message exit_message;
 
 
@@ -167,80 +265,18 @@ static void janus_pubsub_message_free(janus_pubsub_message *msg) {
     if(msg->jsep)
         json_decref(msg->jsep);
     msg->jsep = NULL;
+    g_free(msg->auth_key);
 
     g_free(msg);
 }
 
 
-/* PubSub watchdog/garbage collector (sort of) */
-static void *janus_pubsub_watchdog(void *data) {
-    JANUS_LOG(LOG_INFO, "PubSub watchdog started\n");
-    gint64 now = 0;
-    while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-      //  janus_mutex_lock(&pubsub_sessions_mutex);
-        /* Iterate on all the dead sessions */
-        now = janus_get_monotonic_time();
-        if(pubsub_old_sessions != NULL) {
-            GList *sl = pubsub_old_sessions;
-            JANUS_LOG(LOG_HUGE, "Checking %d old PubSub sessions...\n", g_list_length(pubsub_old_sessions));
-            while(sl) {
-                janus_pubsub_session *session = (janus_pubsub_session *)sl->data;
-                if(!session) {
-                    sl = sl->next;
-                    continue;
-                }
-                if(now - session->destroyed >= 5*G_USEC_PER_SEC) {
-                    /* We're lazy and actually get rid of the stuff only after a few seconds */
-                    JANUS_LOG(LOG_VERB, "Freeing old PubSub session\n");
-                    GList *rm = sl->next;
-                    pubsub_old_sessions = g_list_delete_link(pubsub_old_sessions, sl);
-                    sl = rm;
-                    session->handle = NULL;
-                    g_free(session);
-                    session = NULL;
-                    continue;
-                }
-                sl = sl->next;
-            }
-        }
-      //  janus_mutex_unlock(&pubsub_sessions_mutex);
-      //  janus_mutex_lock(&pubsub_streams_mutex);
-        /* Iterate on all the dead streams */
-        now = janus_get_monotonic_time();
-        if(pubsub_old_streams != NULL) {
-            GList *sl = pubsub_old_streams;
-            JANUS_LOG(LOG_HUGE, "Checking %d old PubSub streams...\n", g_list_length(pubsub_old_streams));
-            while(sl) {
-                janus_pubsub_stream *stream = (janus_pubsub_stream *)sl->data;
-                if(!stream) {
-                    sl = sl->next;
-                    continue;
-                }
-                if(now - stream->destroyed >= 5*G_USEC_PER_SEC) {
-                    /* We're lazy and actually get rid of the stuff only after a few seconds */
-                    JANUS_LOG(LOG_VERB, "Freeing old PubSub stream\n");
-                    GList *rm = sl->next;
-                    pubsub_old_streams = g_list_delete_link(pubsub_old_streams, sl);
-                    sl = rm;
-                   // if (stream->fwd_sock > 0) {
-                   //     close(stream->fwd_sock);
-                   // }
-                    g_free(stream);
-                    stream = NULL;
-                    continue;
-                }
-                sl = sl->next;
-            }
-        }
-      //  janus_mutex_unlock(&pubsub_streams_mutex);
-        g_usleep(500000);
-    }
-    JANUS_LOG(LOG_INFO, "PubSub watchdog stopped\n");
-    return NULL;
+/* Pick the handler shard of a handle, so its requests stay in order */
+static GAsyncQueue *janus_pubsub_message_queue(janus_plugin_session *handle) {
+    return messages[janus_pubsub_session_hash(handle) % handler_count];
 }
 
 
-
 /* Provides access to module initalized state
  */
 int janus_pubsub_is_initialized(void) {
@@ -262,6 +298,43 @@ int janus_pubsub_init(janus_callbacks *callback, const char *config_path) {
         return -1;
     }
     config = g_malloc0(sizeof(janus_pubsub_config));
+    config->publish_endpoint = PUBSUB_DEFAULT_PUB_URL;
+    config->subscribe_endpoint = PUBSUB_DEFAULT_SUB_URL;
+    config->fanout_workers = PUBSUB_DEFAULT_FANOUT_WORKERS;
+    config->fanout_threshold = PUBSUB_DEFAULT_FANOUT_THRESHOLD;
+    config->forward_batch = FALSE;
+    config->forward_batch_size = PUBSUB_DEFAULT_BATCH_SIZE;
+    config->forward_batch_packets = PUBSUB_DEFAULT_BATCH_PACKETS;
+    config->pull_batch_size = PUBSUB_DEFAULT_PULL_BATCH_SIZE;
+    config->pull_buffer_count = PUBSUB_DEFAULT_PULL_BUFFER_COUNT;
+    config->pull_reactors = PUBSUB_DEFAULT_PULL_REACTORS;
+    config->http_pool_size = PUBSUB_DEFAULT_HTTP_POOL_SIZE;
+    config->http_idle_timeout = PUBSUB_DEFAULT_HTTP_IDLE_TIMEOUT;
+    config->http_timeout = PUBSUB_DEFAULT_HTTP_TIMEOUT;
+    config->handler_threads = PUBSUB_DEFAULT_HANDLER_THREADS;
+    config->gop_cache_size = PUBSUB_DEFAULT_GOP_CACHE_SIZE;
+    config->keyframe_interval = PUBSUB_DEFAULT_KEYFRAME_INTERVAL;
+    config->remb_interval = PUBSUB_DEFAULT_REMB_INTERVAL;
+    config->remb_policy = g_strdup(PUBSUB_DEFAULT_REMB_POLICY);
+    config->remb_percentile = PUBSUB_DEFAULT_REMB_PERCENTILE;
+    config->remb_outlier = PUBSUB_DEFAULT_REMB_OUTLIER;
+    config->simulcast_bitrates = g_strdup(PUBSUB_DEFAULT_SIMULCAST_BITRATES);
+    config->simulcast_substream = PUBSUB_DEFAULT_SIMULCAST_SUBSTREAM;
+    config->egress_queue_size = PUBSUB_DEFAULT_EGRESS_QUEUE_SIZE;
+    config->egress_workers = PUBSUB_DEFAULT_EGRESS_WORKERS;
+    config->egress_policy = g_strdup(PUBSUB_DEFAULT_EGRESS_POLICY);
+    config->record_dir = NULL;
+    config->record_buffer_size = PUBSUB_DEFAULT_RECORD_BUFFER_SIZE;
+    config->record_flush_interval = PUBSUB_DEFAULT_RECORD_FLUSH_INTERVAL;
+    config->auth_cache_ttl = PUBSUB_DEFAULT_AUTH_CACHE_TTL;
+    config->auth_cache_size = PUBSUB_DEFAULT_AUTH_CACHE_SIZE;
+    config->auth_cache_fields = NULL;
+    config->cascade_retry = PUBSUB_DEFAULT_CASCADE_RETRY;
+    config->cascade_keepalive = PUBSUB_DEFAULT_CASCADE_KEEPALIVE;
+    config->cascade_upstreams = NULL;
+    config->multicast_ttl = PUBSUB_DEFAULT_MULTICAST_TTL;
+    config->multicast_interface = NULL;
+    config->multicast_loopback = PUBSUB_DEFAULT_MULTICAST_LOOPBACK;
 
     /* Read configuration */
     char filename[255];
@@ -288,6 +361,153 @@ int janus_pubsub_init(janus_callbacks *callback, const char *config_path) {
         } else {
                 config->subscribe_endpoint = PUBSUB_DEFAULT_SUB_URL;
         }
+        janus_config_item *item = janus_config_get_item_drilldown(fconfig, "general", "fanout_workers");
+        if(item != NULL && item->value != NULL) {
+                config->fanout_workers = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "fanout_threshold");
+        if(item != NULL && item->value != NULL) {
+                config->fanout_threshold = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "forward_batch");
+        if(item != NULL && item->value != NULL) {
+                config->forward_batch = janus_is_true(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "forward_batch_size");
+        if(item != NULL && item->value != NULL) {
+                config->forward_batch_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "forward_batch_packets");
+        if(item != NULL && item->value != NULL) {
+                config->forward_batch_packets = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "pull_batch_size");
+        if(item != NULL && item->value != NULL) {
+                config->pull_batch_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "pull_buffer_count");
+        if(item != NULL && item->value != NULL) {
+                config->pull_buffer_count = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "pull_reactors");
+        if(item != NULL && item->value != NULL) {
+                config->pull_reactors = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "http_pool_size");
+        if(item != NULL && item->value != NULL) {
+                config->http_pool_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "http_idle_timeout");
+        if(item != NULL && item->value != NULL) {
+                config->http_idle_timeout = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "http_timeout");
+        if(item != NULL && item->value != NULL) {
+                config->http_timeout = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "keyframe_interval");
+        if(item != NULL && item->value != NULL) {
+                config->keyframe_interval = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "remb_interval");
+        if(item != NULL && item->value != NULL) {
+                config->remb_interval = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "remb_policy");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->remb_policy);
+                config->remb_policy = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "remb_percentile");
+        if(item != NULL && item->value != NULL) {
+                config->remb_percentile = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "remb_outlier");
+        if(item != NULL && item->value != NULL) {
+                config->remb_outlier = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "simulcast_bitrates");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->simulcast_bitrates);
+                config->simulcast_bitrates = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "simulcast_substream");
+        if(item != NULL && item->value != NULL) {
+                config->simulcast_substream = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "egress_queue_size");
+        if(item != NULL && item->value != NULL) {
+                config->egress_queue_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "egress_workers");
+        if(item != NULL && item->value != NULL) {
+                config->egress_workers = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "egress_policy");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->egress_policy);
+                config->egress_policy = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "record_dir");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->record_dir);
+                config->record_dir = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "record_buffer_size");
+        if(item != NULL && item->value != NULL) {
+                config->record_buffer_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "record_flush_interval");
+        if(item != NULL && item->value != NULL) {
+                config->record_flush_interval = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "gop_cache_size");
+        if(item != NULL && item->value != NULL) {
+                config->gop_cache_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "handler_threads");
+        if(item != NULL && item->value != NULL) {
+                config->handler_threads = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "auth_cache_ttl");
+        if(item != NULL && item->value != NULL) {
+                config->auth_cache_ttl = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "auth_cache_size");
+        if(item != NULL && item->value != NULL) {
+                config->auth_cache_size = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "auth_cache_fields");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->auth_cache_fields);
+                config->auth_cache_fields = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "cascade_retry");
+        if(item != NULL && item->value != NULL) {
+                config->cascade_retry = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "cascade_keepalive");
+        if(item != NULL && item->value != NULL) {
+                config->cascade_keepalive = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "cascade_upstreams");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->cascade_upstreams);
+                config->cascade_upstreams = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "multicast_ttl");
+        if(item != NULL && item->value != NULL) {
+                config->multicast_ttl = atoi(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "multicast_interface");
+        if(item != NULL && item->value != NULL) {
+                g_free(config->multicast_interface);
+                config->multicast_interface = g_strdup(item->value);
+        }
+        item = janus_config_get_item_drilldown(fconfig, "general", "multicast_loopback");
+        if(item != NULL && item->value != NULL) {
+                config->multicast_loopback = janus_is_true(item->value);
+        }
     }
     janus_config_destroy(fconfig);
     fconfig = NULL;
@@ -296,28 +516,62 @@ int janus_pubsub_init(janus_callbacks *callback, const char *config_path) {
     janus_mutex_init(&pubsub_streams_mutex);
     janus_pubsub_sessions_init();
     janus_pubsub_streams_init();
-    //pubsub_sessions = g_hash_table_new(NULL, NULL);
-    janus_mutex_init(&pubsub_sessions_mutex);
-    g_atomic_int_set(&initialized, 1);
-    messages = g_async_queue_new_full((GDestroyNotify) janus_pubsub_message_free);
-    GError *error = NULL;
-    /* Start the sessions watchdog */
-    watchdog = g_thread_try_new("pubsub watchdog", &janus_pubsub_watchdog, NULL, &error);
-    if(error != NULL) {
-        g_atomic_int_set(&initialized, 0);
-        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub watchdog thread...\n",
-                        error->code, error->message ? error->message : "??");
+    if(janus_pubsub_epoch_init() < 0) {
+        JANUS_LOG(LOG_ERR, "Could not start the PubSub reclaimer\n");
         return -1;
     }
-    /* Start message handler thread */
-    handler_thread = g_thread_try_new("pubsub handler", janus_pubsub_handler, NULL, &error);
-    if(error != NULL) {
-        g_atomic_int_set(&initialized, 0);
-        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub handler thread...\n",
-                        error->code, error->message ? error->message : "??");
+    janus_pubsub_feedback_init(config->remb_interval, config->remb_policy,
+        config->remb_percentile, config->remb_outlier);
+    janus_pubsub_simulcast_init(config->simulcast_bitrates);
+    janus_pubsub_batch_init(config->forward_batch, config->forward_batch_size, config->forward_batch_packets);
+    janus_pubsub_multicast_init(config->multicast_ttl, config->multicast_interface, config->multicast_loopback);
+    if(janus_pubsub_reactors_init(config->pull_reactors) < 0) {
+        JANUS_LOG(LOG_ERR, "Could not start the PubSub pull reactors\n");
         return -1;
     }
+    if(janus_pubsub_fanout_init(config->fanout_workers, config->fanout_threshold, janus_pubsub_relay_entry) < 0) {
+        JANUS_LOG(LOG_WARN, "No PubSub fan-out workers, relaying on the ingress threads\n");
+    }
+    if(janus_pubsub_egress_init(config->egress_queue_size, config->egress_workers,
+            config->egress_policy, janus_pubsub_egress_send) < 0) {
+        JANUS_LOG(LOG_WARN, "No PubSub egress workers, relaying on the ingress threads\n");
+    }
+    if(janus_pubsub_recordings_init(config->record_buffer_size, config->record_flush_interval) < 0) {
+        JANUS_LOG(LOG_WARN, "No PubSub recording writer, streams can't be recorded\n");
+    }
+    g_atomic_int_set(&initialized, 1);
+    handler_count = config->handler_threads > 0 ? config->handler_threads : g_get_num_processors();
+    messages = g_malloc0(handler_count * sizeof(GAsyncQueue *));
+    handler_threads = g_malloc0(handler_count * sizeof(GThread *));
+    guint i;
+    for(i = 0; i < handler_count; i++) {
+        messages[i] = g_async_queue_new_full((GDestroyNotify) janus_pubsub_message_free);
+    }
     curl_global_init(CURL_GLOBAL_ALL);
+    janus_pubsub_authcache_init(config->auth_cache_ttl, config->auth_cache_size, config->auth_cache_fields);
+    if(janus_pubsub_http_init(config->http_pool_size, config->http_idle_timeout, config->http_timeout) < 0) {
+        g_atomic_int_set(&initialized, 0);
+        JANUS_LOG(LOG_ERR, "Could not start the PubSub HTTP client\n");
+        return -1;
+    }
+    if(janus_pubsub_cascades_init(config->cascade_retry, config->cascade_keepalive,
+            config->cascade_upstreams, janus_pubsub_cascade_event) < 0) {
+        JANUS_LOG(LOG_WARN, "No PubSub cascade thread, streams can't be cascaded\n");
+    }
+    GError *error = NULL;
+    /* Start the message handler threads */
+    for(i = 0; i < handler_count; i++) {
+        char tname[16];
+        g_snprintf(tname, sizeof(tname), "pubsub hdl %u", i);
+        handler_threads[i] = g_thread_try_new(tname, janus_pubsub_handler, messages[i], &error);
+        if(error != NULL) {
+            g_atomic_int_set(&initialized, 0);
+            JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub handler thread...\n",
+                            error->code, error->message ? error->message : "??");
+            return -1;
+        }
+    }
+    JANUS_LOG(LOG_INFO, "PubSub message handling sharded across %u threads\n", handler_count);
     JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_PUBSUB_NAME);
     return 0;
 }
@@ -327,23 +581,32 @@ void janus_pubsub_destroy(void) {
     if(!g_atomic_int_get(&initialized))
         return;
     g_atomic_int_set(&stopping, 1);
-    g_async_queue_push(messages, &exit_message);
-    if(handler_thread != NULL) {
-        g_thread_join(handler_thread);
-        handler_thread = NULL;
+    guint i;
+    for(i = 0; i < handler_count; i++) {
+        g_async_queue_push(messages[i], &exit_message);
     }
-    if(watchdog != NULL) {
-        g_thread_join(watchdog);
-        watchdog = NULL;
+    for(i = 0; i < handler_count; i++) {
+        if(handler_threads[i] != NULL) {
+            g_thread_join(handler_threads[i]);
+            handler_threads[i] = NULL;
+        }
     }
+    /* Requests still waiting on the callbacks are dropped */
+    janus_pubsub_http_destroy();
+    janus_pubsub_cascades_destroy();
+    janus_pubsub_authcache_destroy();
+    janus_pubsub_reactors_destroy();
+    janus_pubsub_fanout_destroy();
+    janus_pubsub_egress_destroy();
+    /* Nothing relays anymore, free what was retired and close what is still being recorded */
+    janus_pubsub_epoch_destroy();
+    janus_pubsub_recordings_destroy();
 
     janus_mutex_lock(&pubsub_streams_mutex);
     //g_hash_table_destroy(pubsub_streams);
     janus_mutex_unlock(&pubsub_streams_mutex);
 
-    janus_mutex_lock(&pubsub_sessions_mutex);
     janus_pubsub_sessions_destroy();
-    janus_mutex_unlock(&pubsub_sessions_mutex);
 
     g_atomic_int_set(&initialized, 0);
     g_atomic_int_set(&stopping, 0);
@@ -387,15 +650,6 @@ const char *janus_pubsub_get_package(void) {
 }
 
 
-static janus_pubsub_session *janus_pubsub_lookup_session(janus_plugin_session *handle) {
-    janus_pubsub_session *session = NULL;
-    if (janus_pubsub_has_session(handle)) {
-        session = (janus_pubsub_session *)handle->plugin_handle;
-    }
-    return session;
-}
-
-
 static guint32 janus_pubsub_forwarder_add_helper(janus_pubsub_subscriber *p,
         const gchar* host, int port, int pt, uint32_t ssrc, gboolean is_video, gboolean is_data) {
     if(!p || !host) {
@@ -408,6 +662,7 @@ static guint32 janus_pubsub_forwarder_add_helper(janus_pubsub_subscriber *p,
     forward->payload_type = pt;
     forward->ssrc = ssrc;
     forward->is_data = is_data;
+    forward->metrics = janus_pubsub_metrics_new(FALSE);
 
     forward->serv_addr.sin_family = AF_INET;
     inet_pton(AF_INET, host, &(forward->serv_addr.sin_addr));
@@ -424,6 +679,83 @@ static guint32 janus_pubsub_forwarder_add_helper(janus_pubsub_subscriber *p,
 }
 
 
+/*
+ * Set up the stream's multicast socket for a multicast subscriber, or
+ * check the one set up before has the same options. -1 with the reason
+ * in error_cause otherwise.
+ */
+static int janus_pubsub_multicast_setup(janus_pubsub_stream *stream,
+        const janus_pubsub_multicast_options *options, char *error_cause) {
+    int result = 0;
+    janus_mutex_lock(&stream->subscribers_mutex);
+    if (stream->mcast_sock <= 0) {
+        stream->mcast_sock = janus_pubsub_multicast_socket(options);
+        if (stream->mcast_sock <= 0) {
+            stream->mcast_sock = 0;
+            g_snprintf(error_cause, 512, "%s", "Could not set up the multicast socket");
+            result = -1;
+        } else {
+            stream->mcast_options = *options;
+        }
+    } else if (!janus_pubsub_multicast_options_equal(&stream->mcast_options, options)) {
+        g_snprintf(error_cause, 512, "%s", "Stream already multicast with another ttl, interface or loopback");
+        result = -1;
+    }
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    return result;
+}
+
+
+/* The socket forwarding subscribers send from, opened by the first of them */
+static int janus_pubsub_forward_setup(janus_pubsub_stream *stream, char *error_cause) {
+    int result = 0;
+    janus_mutex_lock(&stream->subscribers_mutex);
+    if (stream->fwd_sock <= 0) {
+        stream->fwd_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (stream->fwd_sock <= 0) {
+            JANUS_LOG(LOG_ERR, "Could not open UDP socket for rtp stream for publisher (%s)\n", stream->name);
+            stream->fwd_sock = 0;
+            g_snprintf(error_cause, 512, "%s", "Could not open UDP socket for rtp stream");
+            result = -1;
+        }
+    }
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    return result;
+}
+
+
+/*
+ * Port of a new multicast subscriber the stream already sends to on the
+ * same group, which would get every packet twice, 0 if none. Called with
+ * subscribers_mutex held, right before the subscriber is inserted.
+ */
+static int janus_pubsub_multicast_taken(janus_pubsub_stream *stream, janus_pubsub_subscriber *subscriber) {
+    struct in_addr group, other;
+    inet_pton(AF_INET, subscriber->host, &group);
+    int ports[3] = { subscriber->audio_port, subscriber->video_port, subscriber->data_port };
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, stream->subscribers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_subscriber *sp = (janus_pubsub_subscriber *)value;
+        if (sp->kind != JANUS_SUBTYP_MULTICAST || inet_pton(AF_INET, sp->host, &other) != 1 ||
+                other.s_addr != group.s_addr) {
+            continue;
+        }
+        int taken[3] = { sp->audio_port, sp->video_port, sp->data_port };
+        int i, j;
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 3; j++) {
+                if (ports[i] > 0 && ports[i] == taken[j]) {
+                    return ports[i];
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+
 static guint32 janus_pubsub_puller_add_helper(janus_pubsub_stream *p,
         const gchar* host, int port, int pt, uint32_t ssrc, gboolean is_video, gboolean is_data) {
     JANUS_LOG(LOG_WARN, "puller helper %s %d\n", host, port);
@@ -448,6 +780,12 @@ static guint32 janus_pubsub_puller_add_helper(janus_pubsub_stream *p,
             perror("bind failed");
             return 0;
     }
+    /* Port 0 got an ephemeral port, cascades tell the upstream node which */
+    socklen_t addrlen = sizeof(puller->serv_addr);
+    getsockname(puller->pull_sock, (struct sockaddr *)&puller->serv_addr, &addrlen);
+    /* Sockets are drained in bursts until they would block */
+    fcntl(puller->pull_sock, F_SETFL, fcntl(puller->pull_sock, F_GETFL, 0) | O_NONBLOCK);
+    janus_pubsub_puller_buffers_init(puller, p->pull_batch_size, p->pull_buffer_count);
     if (is_video) {
         p->video_puller = puller;
     }
@@ -461,21 +799,183 @@ static guint32 janus_pubsub_puller_add_helper(janus_pubsub_stream *p,
 }
 
 
+/* Egress queue of a subscriber, the caller holds the stream's subscribers_mutex */
+static json_t *janus_pubsub_subscriber_egress_info(janus_pubsub_subscriber *subscriber) {
+    json_t *egress = json_object();
+    json_object_set_new(egress, "id", json_integer(subscriber->subscriber_id));
+    json_object_set_new(egress, "slowlinks", json_integer(
+        subscriber->subscriber_session ? g_atomic_int_get(&subscriber->subscriber_session->slowlink_count) : 0));
+    if (subscriber->egress == NULL) {
+        return egress;
+    }
+    janus_pubsub_egress_stats stats;
+    janus_pubsub_egress_get_stats(subscriber->egress, &stats);
+    json_object_set_new(egress, "depth", json_integer(stats.depth));
+    json_object_set_new(egress, "size", json_integer(stats.size));
+    json_object_set_new(egress, "enqueued", json_integer(stats.enqueued));
+    json_object_set_new(egress, "delivered", json_integer(stats.delivered));
+    json_object_set_new(egress, "dropped", json_integer(stats.dropped));
+    json_object_set_new(egress, "overflows", json_integer(stats.overflows));
+    json_object_set_new(egress, "audio_only", stats.audio_only ? json_true() : json_false());
+    json_object_set_new(egress, "closed", stats.closed ? json_true() : json_false());
+    return egress;
+}
+
+
+static json_t *janus_pubsub_metrics_json(janus_pubsub_metrics_stats *stats, gboolean histogram) {
+    json_t *metrics = json_object();
+    json_object_set_new(metrics, "packets_in", json_integer(stats->packets_in));
+    json_object_set_new(metrics, "bytes_in", json_integer(stats->bytes_in));
+    json_object_set_new(metrics, "packets_out", json_integer(stats->packets_out));
+    json_object_set_new(metrics, "bytes_out", json_integer(stats->bytes_out));
+    json_object_set_new(metrics, "dropped", json_integer(stats->dropped));
+    json_object_set_new(metrics, "errors", json_integer(stats->errors));
+    if (histogram) {
+        /* Bucket i counts the packets relayed in under 2^i microseconds */
+        json_t *fanout = json_array();
+        guint i;
+        for (i = 0; i < JANUS_PUBSUB_METRICS_BUCKETS; i++) {
+            json_array_append_new(fanout, json_integer(stats->fanout[i]));
+        }
+        json_object_set_new(metrics, "fanout_us", fanout);
+    }
+    return metrics;
+}
+
+
+/*
+ * Counters of a subscriber and its forwarders, the forwarders' send
+ * errors are added to the subscriber's. The caller holds the stream's
+ * subscribers_mutex
+ */
+static json_t *janus_pubsub_subscriber_stats(janus_pubsub_subscriber *subscriber,
+        janus_pubsub_metrics_stats *stats) {
+    janus_pubsub_metrics_read(subscriber->metrics, stats);
+    json_t *forwarders = json_array();
+    janus_mutex_lock(&subscriber->rtp_forwarders_mutex);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, subscriber->rtp_forwarders);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        janus_pubsub_forwarder *forward = (janus_pubsub_forwarder *)value;
+        janus_pubsub_metrics_stats forward_stats;
+        janus_pubsub_metrics_read(forward->metrics, &forward_stats);
+        stats->errors += forward_stats.errors;
+        json_t *jforward = json_object();
+        json_object_set_new(jforward, "id", json_integer(GPOINTER_TO_UINT(key)));
+        json_object_set_new(jforward, "media", json_string(
+            forward->is_data ? "data" : forward->is_video ? "video" : "audio"));
+        json_object_set_new(jforward, "metrics", janus_pubsub_metrics_json(&forward_stats, FALSE));
+        json_array_append_new(forwarders, jforward);
+    }
+    janus_mutex_unlock(&subscriber->rtp_forwarders_mutex);
+    json_t *jsubscriber = json_object();
+    json_object_set_new(jsubscriber, "id", json_integer(subscriber->subscriber_id));
+    json_object_set_new(jsubscriber, "kind", json_string(
+        subscriber->kind == JANUS_SUBTYP_SESSION ? "session" :
+        subscriber->kind == JANUS_SUBTYP_MULTICAST ? "multicast" : "forward"));
+    json_object_set_new(jsubscriber, "metrics", janus_pubsub_metrics_json(stats, FALSE));
+    json_object_set_new(jsubscriber, "forwarders", forwarders);
+    return jsubscriber;
+}
+
+
+/* Counters of a stream and of each of its subscribers, merged as they are read */
+static json_t *janus_pubsub_stream_stats(janus_pubsub_stream *stream) {
+    janus_pubsub_metrics_stats stats, subscriber_stats;
+    janus_pubsub_metrics_read(stream->metrics, &stats);
+    json_t *subscribers = json_array();
+    janus_mutex_lock(&stream->subscribers_mutex);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, stream->subscribers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        json_array_append_new(subscribers, janus_pubsub_subscriber_stats(value, &subscriber_stats));
+        stats.errors += subscriber_stats.errors;
+    }
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    json_t *jstream = json_object();
+    json_object_set_new(jstream, "name", json_string(stream->name));
+    json_object_set_new(jstream, "metrics", janus_pubsub_metrics_json(&stats, TRUE));
+    json_object_set_new(jstream, "subscribers", subscribers);
+    return jstream;
+}
+
+
 json_t *janus_pubsub_query_session(janus_plugin_session *handle) {
     if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
         return NULL;
     }
-    janus_mutex_lock(&pubsub_sessions_mutex);
-    janus_pubsub_session *session = janus_pubsub_lookup_session(handle);
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = janus_pubsub_session_get(handle);
     if(!session) {
-        janus_mutex_unlock(&pubsub_sessions_mutex);
+        janus_pubsub_epoch_exit();
         JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
         return NULL;
     }
     /* In the echo test, every session is the same: we just provide some configure info */
     json_t *info = json_object();
-    janus_mutex_unlock(&pubsub_sessions_mutex);
-    // XXX: Populate info
+    janus_pubsub_http_stats http_stats;
+    janus_pubsub_http_get_stats(&http_stats);
+    json_t *http = json_object();
+    json_object_set_new(http, "requests", json_integer(http_stats.requests));
+    json_object_set_new(http, "failures", json_integer(http_stats.failures));
+    json_object_set_new(http, "connects", json_integer(http_stats.connects));
+    json_object_set_new(http, "reused", json_integer(http_stats.reused));
+    json_object_set_new(http, "pooled", json_integer(http_stats.pooled));
+    json_object_set_new(info, "http", http);
+    janus_pubsub_stream *stream = session->stream;
+    if(stream != NULL && stream->feedback != NULL) {
+        janus_pubsub_feedback_stats feedback_stats;
+        janus_pubsub_feedback_get_stats(stream->feedback, &feedback_stats);
+        json_t *feedback = json_object();
+        json_object_set_new(feedback, "keyframe_requests", json_integer(feedback_stats.keyframe_requests));
+        json_object_set_new(feedback, "keyframe_suppressed", json_integer(feedback_stats.keyframe_suppressed));
+        json_object_set_new(feedback, "remb_received", json_integer(feedback_stats.remb_received));
+        json_object_set_new(feedback, "remb_sent", json_integer(feedback_stats.remb_sent));
+        json_object_set_new(feedback, "remb_bitrate", json_integer(feedback_stats.remb_bitrate));
+        json_object_set_new(feedback, "remb_subscribers", json_integer(feedback_stats.remb_subscribers));
+        json_object_set_new(info, "feedback", feedback);
+    }
+    janus_pubsub_recording *recording = stream ? g_atomic_pointer_get(&stream->recording) : NULL;
+    if(recording != NULL && stream->owner == session) {
+        janus_pubsub_recording_stats recording_stats;
+        janus_pubsub_recording_get_stats(recording, &recording_stats);
+        json_t *jrecording = json_object();
+        json_object_set_new(jrecording, "written", json_integer(recording_stats.written));
+        json_object_set_new(jrecording, "bytes", json_integer(recording_stats.bytes));
+        json_object_set_new(jrecording, "dropped", json_integer(recording_stats.dropped));
+        json_object_set_new(info, "recording", jrecording);
+    }
+    if(stream != NULL && stream->owner == session) {
+        json_object_set_new(info, "stats", janus_pubsub_stream_stats(stream));
+    }
+    if(stream != NULL && stream->owner == session && stream->cascade != NULL) {
+        json_object_set_new(info, "cascade", janus_pubsub_cascade_info(stream->cascade));
+    }
+    if(stream != NULL) {
+        /* Publishers see every subscriber's queue, subscribers their own */
+        janus_mutex_lock(&stream->subscribers_mutex);
+        if(stream->owner == session) {
+            json_t *subscribers = json_array();
+            GHashTableIter iter;
+            gpointer value;
+            g_hash_table_iter_init(&iter, stream->subscribers);
+            while(g_hash_table_iter_next(&iter, NULL, &value)) {
+                json_array_append_new(subscribers, janus_pubsub_subscriber_egress_info(value));
+            }
+            json_object_set_new(info, "subscribers", subscribers);
+        } else if(session->sub_id > 0) {
+            janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+            if(subscriber != NULL) {
+                janus_pubsub_metrics_stats subscriber_stats;
+                json_object_set_new(info, "egress", janus_pubsub_subscriber_egress_info(subscriber));
+                json_object_set_new(info, "stats", janus_pubsub_subscriber_stats(subscriber, &subscriber_stats));
+            }
+        }
+        janus_mutex_unlock(&stream->subscribers_mutex);
+    }
+    janus_pubsub_epoch_exit();
     return info;
 }
 
@@ -530,7 +1030,14 @@ struct janus_plugin_result *janus_pubsub_handle_message(janus_plugin_session *ha
     if(error_code != 0)
             goto error;
 
-    g_async_queue_push(messages, msg);
+    if(!strcasecmp(json_string_value(json_object_get(root, "request")), "feedback")) {
+        response = janus_pubsub_feedback_request(handle, root, &error_code, error_cause);
+        if(response == NULL)
+            goto error;
+        janus_pubsub_message_free(msg);
+        return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, response);
+    }
+    g_async_queue_push(janus_pubsub_message_queue(handle), msg);
     JANUS_LOG(LOG_VERB, "PubSub got message. (%s)\n", json_object_get(message, "video"));
     return janus_plugin_result_new(JANUS_PLUGIN_OK_WAIT, "I'm taking my time!", NULL);
 error:
@@ -554,240 +1061,875 @@ error:
 
 void janus_pubsub_setup_media(janus_plugin_session *handle) {
     JANUS_LOG(LOG_INFO, "WebRTC media is now available.\n");
-}
-
-void janus_pubsub_relay_rtp(void *stream_p, int video, char *buf, int len) {
-    janus_pubsub_stream *stream = (janus_pubsub_stream *)stream_p;
-    if(gateway) {
-        rtp_header *rtp = (rtp_header *)buf;
-        int count = 0;
-        GHashTableIter iter;
-        gpointer value;
-        g_hash_table_iter_init(&iter, stream->subscribers);
-        while (!stream->destroyed && g_hash_table_iter_next(&iter, NULL, &value)) {
-            janus_pubsub_subscriber *sp = value;
-            if (sp->kind == JANUS_SUBTYP_SESSION) {
-                janus_pubsub_session *p = sp->subscriber_session;
-                gateway->relay_rtp(p->handle, video, buf, len);
-                //JANUS_LOG(LOG_INFO, "Relayed rtp packet (%d)\n", len);
-            } else {
-                janus_mutex_lock(&sp->rtp_forwarders_mutex);
-                /* subscriber is forwarder */
-                GHashTableIter fwd_iter;
-                gpointer fwd_value;
-                g_hash_table_iter_init(&fwd_iter, sp->rtp_forwarders);
-                while(stream->fwd_sock > 0 && g_hash_table_iter_next(&fwd_iter, NULL, &fwd_value)) {
-                    janus_pubsub_forwarder* rtp_forward = (janus_pubsub_forwarder*)fwd_value;
-                    /* Check if payload type and/or SSRC need to be overwritten for this forwarder */
-                    int pt = rtp->type;
-                    uint32_t ssrc = ntohl(rtp->ssrc);
-                    //if(rtp_forward->payload_type > 0)
-                    //    rtp->type = rtp_forward->payload_type;
-                    //if(rtp_forward->ssrc > 0)
-                    //    rtp->ssrc = htonl(rtp_forward->ssrc);
-                    if(video && rtp_forward->is_video) {
-                       int rv = sendto(stream->fwd_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr));
-                       if (rv < 0) {
-                           JANUS_LOG(LOG_WARN, "Error forwarding RTP video packet for %s... %s (len=%d)...\n",
-                           stream->name, strerror(errno), len);
-                       }
-                       else {
-                           JANUS_LOG(LOG_VERB, "Forward rtp video packet: %d bytes\n", rv);
-                       }
-                    }
-                    else if(!video && !rtp_forward->is_video && !rtp_forward->is_data) {
-                        int rv = sendto(stream->fwd_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr));
-                        if (rv < 0) {
-                            JANUS_LOG(LOG_WARN, "Error forwarding RTP audio packet for %s... %s (len=%d)...\n",
-                                 stream->name, strerror(errno), len);
-                        }
-                       else {
-                           JANUS_LOG(LOG_VERB, "Forward rtp audio packet: %d bytes\n", rv);
-                       }
-                    }
-                    /* Restore original values of payload type and SSRC before going on */
-                    rtp->type = pt;
-                    rtp->ssrc = htonl(ssrc);
-
-                }
-                janus_mutex_unlock(&sp->rtp_forwarders_mutex);
+    if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+        return;
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = janus_pubsub_session_get(handle);
+    if(session && !session->destroyed && session->kind == JANUS_SESSION_SUBSCRIBE) {
+        janus_pubsub_stream *stream = session->stream;
+        if(stream && stream->gop) {
+            /* Start the subscriber from the cached keyframe, not the next one */
+            janus_mutex_lock(&stream->subscribers_mutex);
+            janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+            if(subscriber && g_atomic_int_compare_and_exchange(&subscriber->gop_pending, 0, 1)) {
+                g_atomic_int_inc(&stream->gop_waiters);
             }
+            janus_mutex_unlock(&stream->subscribers_mutex);
         }
     }
-};
-
+    janus_pubsub_epoch_exit();
+}
 
-void janus_pubsub_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
-    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
-        return;
-   // JANUS_LOG(LOG_DBG, "IN - Got an RTP message (%d bytes.)\n", len);
-    if(gateway) {
-        rtp_header *rtp = (rtp_header *)buf;
-        /* Honour the audio/video active flags */
-        janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
-        if(!session) {
-            JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
-            return;
+static void janus_pubsub_forward_rtp(janus_pubsub_stream *stream, janus_pubsub_subscriber *sp,
+        int video, char *buf, int len, gboolean shared) {
+    /*
+     * With batching on, datagrams are queued here and sent with sendmmsg.
+     * A batch carries one payload, packets rewritten for this subscriber
+     * are sent right away
+     */
+    janus_pubsub_batch *batch = (shared && janus_pubsub_batch_enabled()) ? janus_pubsub_batch_get() : NULL;
+    /* A multicast subscriber sends each packet once, to its groups */
+    int sock = sp->kind == JANUS_SUBTYP_MULTICAST ? stream->mcast_sock : stream->fwd_sock;
+    janus_mutex_lock(&sp->rtp_forwarders_mutex);
+    /* subscriber is forwarder */
+    GHashTableIter fwd_iter;
+    gpointer fwd_value;
+    g_hash_table_iter_init(&fwd_iter, sp->rtp_forwarders);
+    while(sock > 0 && g_hash_table_iter_next(&fwd_iter, NULL, &fwd_value)) {
+        janus_pubsub_forwarder* rtp_forward = (janus_pubsub_forwarder*)fwd_value;
+        /*
+         * The packet buffer is shared with the other subscribers, and with
+         * the fan-out workers, so it is never rewritten in place here
+         */
+        if(batch && ((video && rtp_forward->is_video) ||
+                (!video && !rtp_forward->is_video && !rtp_forward->is_data))) {
+            janus_pubsub_batch_add(batch, stream, sock, sp, rtp_forward, buf, len);
         }
-        if(session->destroyed) {
-            JANUS_LOG(LOG_ERR, "Skip destroyed session...\n");
-            return;
+        else if(video && rtp_forward->is_video) {
+           int rv = sendto(sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr));
+           if (rv < 0) {
+               janus_pubsub_metrics_error(rtp_forward->metrics);
+               JANUS_LOG(LOG_WARN, "Error forwarding RTP video packet for %s... %s (len=%d)...\n",
+               stream->name, strerror(errno), len);
+           }
+           else {
+               janus_pubsub_metrics_out(rtp_forward->metrics, rv);
+               JANUS_LOG(LOG_VERB, "Forward rtp video packet: %d bytes\n", rv);
+           }
         }
-
-        janus_mutex_lock(&pubsub_streams_mutex);
-        janus_pubsub_stream *stream = janus_pubsub_stream_get(session->stream_name);
-        if (!stream || stream->destroyed) {
-            JANUS_LOG(LOG_ERR, "Skip destroyed stream\n");
-            janus_mutex_unlock(&pubsub_streams_mutex);
-            return;
+        else if(!video && !rtp_forward->is_video && !rtp_forward->is_data) {
+            int rv = sendto(sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr));
+            if (rv < 0) {
+                janus_pubsub_metrics_error(rtp_forward->metrics);
+                JANUS_LOG(LOG_WARN, "Error forwarding RTP audio packet for %s... %s (len=%d)...\n",
+                     stream->name, strerror(errno), len);
+            }
+           else {
+               janus_pubsub_metrics_out(rtp_forward->metrics, rv);
+               JANUS_LOG(LOG_VERB, "Forward rtp audio packet: %d bytes\n", rv);
+           }
         }
-        janus_mutex_unlock(&pubsub_streams_mutex);
-        stream->relay_rtp((void *)stream, video, buf, len);
     }
-end:
-   return;
+    janus_mutex_unlock(&sp->rtp_forwarders_mutex);
 }
 
 
-void janus_pubsub_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
-    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
-        return;
-    JANUS_LOG(LOG_DBG, "IN - Got an RTCP message (%d bytes.)\n", len);
-    if(gateway) {
-        janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
-        if(!session) {
-            JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
-            return;
+/* Same as above for DataChannel messages, which go to the data forwarders */
+static void janus_pubsub_forward_data(janus_pubsub_stream *stream, janus_pubsub_subscriber *sp,
+        char *buf, int len) {
+    janus_pubsub_batch *batch = janus_pubsub_batch_enabled() ? janus_pubsub_batch_get() : NULL;
+    int sock = sp->kind == JANUS_SUBTYP_MULTICAST ? stream->mcast_sock : stream->fwd_sock;
+    janus_mutex_lock(&sp->rtp_forwarders_mutex);
+    GHashTableIter fwd_iter;
+    gpointer fwd_value;
+    g_hash_table_iter_init(&fwd_iter, sp->rtp_forwarders);
+    while(sock > 0 && g_hash_table_iter_next(&fwd_iter, NULL, &fwd_value)) {
+        janus_pubsub_forwarder* data_forward = (janus_pubsub_forwarder*)fwd_value;
+        if(!data_forward->is_data) {
+            continue;
         }
-        if(session->destroyed) {
-            JANUS_LOG(LOG_ERR, "session destroyed...\n");
-            return;
+        if(batch) {
+            janus_pubsub_batch_add(batch, stream, sock, sp, data_forward, buf, len);
+            continue;
         }
-        if (session->stream_name == NULL) {
-            JANUS_LOG(LOG_ERR, "RTCP with no stream name...\n");
-            return;
+        int rv = sendto(sock, buf, len, 0, (struct sockaddr*)&data_forward->serv_addr, sizeof(data_forward->serv_addr));
+        if (rv < 0) {
+            janus_pubsub_metrics_error(data_forward->metrics);
+            JANUS_LOG(LOG_WARN, "Error forwarding data message for %s... %s (len=%d)...\n",
+                stream->name, strerror(errno), len);
         }
-        janus_mutex_lock(&pubsub_streams_mutex);
-        janus_pubsub_stream *stream = janus_pubsub_stream_get(session->stream_name);
-        janus_mutex_unlock(&pubsub_streams_mutex);
-        if (!stream) {
-            JANUS_LOG(LOG_ERR, "RTCP with no stream...\n");
-            return;
+        else {
+            janus_pubsub_metrics_out(data_forward->metrics, rv);
+            JANUS_LOG(LOG_VERB, "Forward data message: %d bytes\n", rv);
         }
-        else if (stream->destroyed) {
-            JANUS_LOG(LOG_ERR, "RTCP with destroyed stream...\n");
-            return;
+    }
+    janus_mutex_unlock(&sp->rtp_forwarders_mutex);
+}
+
+
+static void janus_pubsub_send_entry(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot_entry *entry, int video, char *buf, int len) {
+    janus_pubsub_simulcast *simulcast = video ? stream->simulcast : NULL;
+    char rewritten[JANUS_PUBSUB_SIMULCAST_MTU];
+    if (simulcast != NULL) {
+        /* Only the subscriber's substream goes out, as a single stream */
+        gboolean keyframe_needed = FALSE;
+        len = janus_pubsub_layer_rewrite(&entry->subscriber->layer, simulcast,
+            buf, len, rewritten, &keyframe_needed);
+        if (keyframe_needed) {
+            janus_pubsub_request_keyframe(stream, FALSE);
         }
-        if (stream->publisher == NULL) {
-            JANUS_LOG(LOG_ERR, "No publisher on stream...\n");
+        if (len == 0) {
             return;
         }
-        janus_mutex_lock(&stream->subscribers_mutex);
-        guint32 bitrate = janus_rtcp_get_remb(buf, len);
-        if (session->handle == stream->publisher->handle) {
-            /* This is and RTCP from the publishing session */
-            int count = 0;
-            GHashTableIter iter;
-            gpointer value;
-            g_hash_table_iter_init(&iter, stream->subscribers);
-            while (!session->destroyed && g_hash_table_iter_next(&iter, NULL, &value)) {
-                janus_pubsub_subscriber *sp = value;
-                if (!sp || sp->destroyed) {
-                    JANUS_LOG(LOG_ERR, "Skip destroyed subscriber (b)...\n");
-                    continue;
-                }
-                if (sp->kind == JANUS_SUBTYP_SESSION) {
-                        janus_pubsub_session *p = sp->subscriber_session;
-                        if (!p || p->destroyed) {
-                            JANUS_LOG(LOG_ERR, "Skip destroyed session (b)...\n");
-                            continue;
-                        }
-                        if(bitrate > 0) {
-                            /*
-                             * If a REMB arrived, make sure we cap it to our configuration, and send it as
-                             * a video RTCP
-                             */
-                            if(session->bitrate > 0)
-                                janus_rtcp_cap_remb(buf, len, session->bitrate);
-                            gateway->relay_rtcp(p->handle, 1, buf, len);
-                            continue;
-                        }
-                        gateway->relay_rtcp(p->handle, video, buf, len);
-                }
-            }
-        } else {
-            /* This is and RTCP from a subscriber session */
-            if(bitrate > 0) {
-                /* If a REMB arrived, make sure we cap it to our configuration, and send it as a
-                 * video RTCP
-                 */
-                if(session->bitrate > 0)
-                    janus_rtcp_cap_remb(buf, len, session->bitrate);
-                gateway->relay_rtcp(stream->publisher->handle, 1, buf, len);
-                janus_mutex_unlock(&stream->subscribers_mutex);
-                return;
-            }
-            gateway->relay_rtcp(stream->publisher->handle, video, buf, len);
-        }
-        janus_mutex_unlock(&stream->subscribers_mutex);
-        JANUS_LOG(LOG_DBG, "OUT - Got an RTCP message (%d bytes.)\n", len);
+        buf = rewritten;
+    }
+    janus_pubsub_metrics_out(entry->subscriber->metrics, len);
+    janus_pubsub_metrics_out(stream->metrics, len);
+    if (entry->kind == JANUS_SUBTYP_SESSION) {
+        gateway->relay_rtp(entry->handle, video, buf, len);
+        //JANUS_LOG(LOG_INFO, "Relayed rtp packet (%d)\n", len);
+    } else {
+        janus_pubsub_forward_rtp(stream, entry->subscriber, video, buf, len, simulcast == NULL);
     }
-end:
-   return;
 }
 
 
-void janus_pubsub_incoming_data(janus_plugin_session *handle, char *buf, int len) {
-    JANUS_LOG(LOG_VERB, "Got a DataChannel message (%d bytes.)\n", len);
+/* Called by the egress workers with the packets queued for a subscriber */
+static void janus_pubsub_egress_send(janus_pubsub_stream *stream, janus_pubsub_subscriber *subscriber,
+        int video, char *buf, int len) {
+    janus_pubsub_snapshot_entry entry;
+    entry.kind = subscriber->kind;
+    entry.handle = subscriber->subscriber_session ? subscriber->subscriber_session->handle : NULL;
+    entry.subscriber = subscriber;
+    janus_pubsub_send_entry(stream, &entry, video, buf, len);
 }
 
 
-void janus_pubsub_slow_link(janus_plugin_session *handle, int uplink, int video) {
-    JANUS_LOG(LOG_VERB, "Slow link detected.\n");
+static gboolean janus_pubsub_is_keyframe(janus_pubsub_stream *stream, char *buf, int len) {
+    janus_pubsub_video_codec codec = g_atomic_int_get(&stream->video_codec);
+    if (codec == JANUS_PUBSUB_CODEC_UNKNOWN) {
+        /* Can't tell, don't hold the video back waiting for one */
+        return TRUE;
+    }
+    rtp_header *rtp = (rtp_header *)buf;
+    int pt = g_atomic_int_get(&stream->video_pt);
+    if (len < 12 || (pt >= 0 && rtp->type != pt)) {
+        return FALSE;
+    }
+    int plen = 0;
+    char *payload = janus_rtp_payload(buf, len, &plen);
+    return payload != NULL && plen > 0 && janus_pubsub_gop_is_keyframe(codec, payload, plen);
 }
 
 
-void janus_pubsub_hangup_media(janus_plugin_session *handle) {
+/* Carry out what the slow-consumer policy decided for a subscriber */
+static void janus_pubsub_egress_act(janus_pubsub_stream *stream, janus_pubsub_subscriber *subscriber,
+        janus_pubsub_egress_action action) {
+    switch (action) {
+        case JANUS_PUBSUB_EGRESS_REQUEST_KEYFRAME:
+            janus_pubsub_request_keyframe(stream, FALSE);
+            break;
+        case JANUS_PUBSUB_EGRESS_WENT_AUDIO_ONLY:
+            JANUS_LOG(LOG_WARN, "[%s] Subscriber %"G_GUINT64_FORMAT" can't keep up, sending audio only\n",
+                stream->name, subscriber->subscriber_id);
+            break;
+        case JANUS_PUBSUB_EGRESS_VIDEO_RESUMED:
+            JANUS_LOG(LOG_INFO, "[%s] Subscriber %"G_GUINT64_FORMAT" caught up, sending video again\n",
+                stream->name, subscriber->subscriber_id);
+            janus_pubsub_request_keyframe(stream, FALSE);
+            break;
+        case JANUS_PUBSUB_EGRESS_CLOSE:
+            JANUS_LOG(LOG_WARN, "[%s] Subscriber %"G_GUINT64_FORMAT" can't keep up, disconnecting\n",
+                stream->name, subscriber->subscriber_id);
+            if (subscriber->kind == JANUS_SUBTYP_SESSION && subscriber->subscriber_session != NULL) {
+                gateway->close_pc(subscriber->subscriber_session->handle);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Queue a packet for a subscriber and act on its slow-consumer policy */
+static void janus_pubsub_egress_queue(janus_pubsub_stream *stream, janus_pubsub_subscriber *subscriber,
+        janus_pubsub_egress_packet *packet) {
+    janus_pubsub_egress_action action = janus_pubsub_egress_push(subscriber->egress, packet);
+    janus_pubsub_egress_act(stream, subscriber, action);
+}
+
+
+static void janus_pubsub_relay_entry(janus_pubsub_stream *stream,
+        janus_pubsub_snapshot_entry *entry, int video, char *buf, int len) {
+    if (entry->subscriber->egress == NULL) {
+        janus_pubsub_send_entry(stream, entry, video, buf, len);
+        return;
+    }
+    janus_pubsub_egress_packet *packet = janus_pubsub_egress_packet_new(video,
+        video && janus_pubsub_is_keyframe(stream, buf, len), buf, len);
+    janus_pubsub_egress_queue(stream, entry->subscriber, packet);
+    janus_pubsub_egress_packet_unref(packet);
+}
+
+
+/* Ask the publisher, or the upstream node, for a keyframe, unless another subscriber just did */
+static void janus_pubsub_request_keyframe(janus_pubsub_stream *stream, gboolean fir) {
+    char rtcp[20];
+    int len = janus_pubsub_feedback_keyframe_request(stream->feedback, fir, rtcp, sizeof(rtcp));
+    janus_pubsub_session *publisher = g_atomic_pointer_get(&stream->publisher);
+    if (len > 0 && publisher != NULL) {
+        gateway->relay_rtcp(publisher->handle, 1, rtcp, len);
+    } else if (len > 0 && stream->cascade != NULL) {
+        janus_pubsub_cascade_keyframe(stream->cascade);
+    }
+}
+
+
+/* Keep a subscriber's estimate, the publisher gets the combined one once per interval */
+static void janus_pubsub_report_bitrate(janus_pubsub_stream *stream, janus_pubsub_session *session,
+        guint32 bitrate) {
+    if (session->bitrate > 0 && bitrate > session->bitrate) {
+        bitrate = session->bitrate;
+    }
+    if (stream->simulcast != NULL) {
+        /* The estimate also picks the substream, unless the subscriber chose one */
+        janus_mutex_lock(&stream->subscribers_mutex);
+        janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+        if (subscriber != NULL) {
+            janus_pubsub_layer_set_target(&subscriber->layer, janus_pubsub_simulcast_for_bitrate(bitrate), FALSE);
+        }
+        janus_mutex_unlock(&stream->subscribers_mutex);
+    }
+    char rtcp[24];
+    int len = janus_pubsub_feedback_remb(stream->feedback, session->sub_id, bitrate, rtcp, sizeof(rtcp));
+    janus_pubsub_session *publisher = g_atomic_pointer_get(&stream->publisher);
+    if (len > 0 && publisher != NULL) {
+        if (publisher->bitrate > 0) {
+            janus_rtcp_cap_remb(rtcp, len, publisher->bitrate);
+        }
+        gateway->relay_rtcp(publisher->handle, 1, rtcp, len);
+    } else if (len > 0 && stream->cascade != NULL) {
+        janus_pubsub_cascade_bitrate(stream->cascade, janus_rtcp_get_remb(rtcp, len));
+    }
+}
+
+
+/*
+ * Keyframe requests and estimates of a downstream node cascading the
+ * stream this forwarder subscribed to, merged with our other subscribers'.
+ * Answered right away instead of through an event, nobody polls for them
+ */
+static json_t *janus_pubsub_feedback_request(janus_plugin_session *handle, json_t *root,
+        int *error_code, char *error_cause) {
+    JANUS_VALIDATE_JSON_OBJECT(root, feedback_parameters,
+        *error_code, error_cause, TRUE,
+        JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+    if (*error_code != 0) {
+        return NULL;
+    }
+    json_t *response = NULL;
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = janus_pubsub_session_get(handle);
+    janus_pubsub_stream *stream = session ? session->stream : NULL;
+    if (session == NULL || session->destroyed || stream == NULL || stream->destroyed || session->sub_id == 0) {
+        /* The downstream node subscribes again once the stream is back */
+        *error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+        g_snprintf(error_cause, 512, "%s", "Session not subscribed to a stream");
+    } else {
+        if (json_is_true(json_object_get(root, "keyframe"))) {
+            janus_pubsub_request_keyframe(stream, FALSE);
+        }
+        json_t *bitrate = json_object_get(root, "bitrate");
+        if (bitrate != NULL && json_integer_value(bitrate) > 0) {
+            janus_pubsub_report_bitrate(stream, session, (guint32)json_integer_value(bitrate));
+        }
+        response = json_object();
+        json_object_set_new(response, "pubsub", json_string("feedback"));
+        json_object_set_new(response, "result", json_string("ok"));
+    }
+    janus_pubsub_epoch_exit();
+    return response;
+}
+
+
+/*
+ * The upstream node of a cascaded stream answered our subscribe, or was
+ * lost. Its offer and codec let our own subscribers and keyframe cache
+ * work as with a WebRTC publisher; the first answer is kept across
+ * reconnections. Runs on the cascade thread
+ */
+static void janus_pubsub_cascade_event(janus_pubsub_stream *stream, janus_plugin_session *handle,
+        const char *error, json_t *result, json_t *jsep) {
+    if (error == NULL) {
+        const char *sdp_type = json_string_value(json_object_get(jsep, "type"));
+        const char *sdp = json_string_value(json_object_get(jsep, "sdp"));
+        if (sdp_type != NULL && sdp != NULL && g_atomic_pointer_get(&stream->sdp) == NULL) {
+            stream->sdp_type = g_strdup(sdp_type);
+            g_atomic_pointer_set(&stream->sdp, g_strdup(sdp));
+        }
+        janus_pubsub_video_codec codec = janus_pubsub_gop_codec_from_name(
+            json_string_value(json_object_get(result, "video_codec")));
+        if (codec != JANUS_PUBSUB_CODEC_UNKNOWN &&
+                g_atomic_int_get(&stream->video_codec) == JANUS_PUBSUB_CODEC_UNKNOWN) {
+            json_t *video_pt = json_object_get(result, "video_pt");
+            int pt = video_pt ? json_integer_value(video_pt) : -1;
+            janus_pubsub_gop_set_codec(stream->gop, codec, pt);
+            g_atomic_int_set(&stream->video_pt, pt);
+            g_atomic_int_set(&stream->video_codec, codec);
+        }
+    }
+    /* The owner may be leaving, only its registered session is told */
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = janus_pubsub_session_get(handle);
+    if (session != NULL && !session->destroyed && session->stream == stream) {
+        json_t *event = json_object();
+        json_object_set_new(event, "pubsub", json_string("event"));
+        json_object_set_new(event, "cascade", json_string(error ? "failed" : "connected"));
+        if (error != NULL) {
+            json_object_set_new(event, "error", json_string(error));
+        }
+        gateway->push_event(handle, &janus_pubsub_plugin, NULL, event, NULL);
+        json_decref(event);
+    }
+    janus_pubsub_epoch_exit();
+}
+
+
+/*
+ * Send the cached video to the subscribers of the snapshot that just
+ * joined, ahead of the live packet being relayed. Runs on the thread
+ * relaying the stream, which is the only one touching the cache. The
+ * cached packets take the route the live ones take: the subscriber's
+ * egress queue, the fan-out worker of its shard, or this thread
+ */
+static void janus_pubsub_gop_replay(janus_pubsub_stream *stream, janus_pubsub_snapshot *snapshot,
+        gboolean current_cached) {
+    guint count = janus_pubsub_gop_count(stream->gop);
+    /* The live packet is relayed to everyone afterwards */
+    if (count > 0 && current_cached) {
+        count--;
+    }
+    gboolean need_keyframe = FALSE;
+    guint i, j;
+    for (i = 0; i < snapshot->count; i++) {
+        janus_pubsub_snapshot_entry *entry = &snapshot->entries[i];
+        if (!g_atomic_int_compare_and_exchange(&entry->subscriber->gop_pending, 1, 0)) {
+            continue;
+        }
+        g_atomic_int_add(&stream->gop_waiters, -1);
+        if (count == 0) {
+            need_keyframe = TRUE;
+            continue;
+        }
+        for (j = 0; j < count; j++) {
+            int plen = 0;
+            char *packet = janus_pubsub_gop_packet(stream->gop, j, &plen);
+            if (!janus_pubsub_egress_enabled() &&
+                    janus_pubsub_fanout_dispatch_entry(stream, snapshot, entry, 1, packet, plen)) {
+                continue;
+            }
+            janus_pubsub_relay_entry(stream, entry, 1, packet, plen);
+            if (janus_pubsub_batch_enabled()) {
+                /* Each cached packet is a payload of its own */
+                janus_pubsub_batch_packet_done(janus_pubsub_batch_get());
+            }
+        }
+    }
+    if (need_keyframe) {
+        /* Nothing cached yet, ask the publisher for a keyframe instead */
+        janus_pubsub_request_keyframe(stream, FALSE);
+    }
+}
+
+
+static void janus_pubsub_relay_packet(janus_pubsub_stream *stream, int video, char *buf, int len) {
+    if(gateway) {
+        /*
+         * No locking here: subscribe and unsubscribe swap in a new snapshot
+         * and the one we are reading is only released once we left the
+         * critical section janus_pubsub_relay_rtp put us in
+         */
+        janus_pubsub_snapshot *snapshot = g_atomic_pointer_get(&stream->snapshot);
+        janus_pubsub_recording *recording = g_atomic_pointer_get(&stream->recording);
+        if (recording != NULL && (!video || stream->simulcast == NULL ||
+                janus_pubsub_simulcast_substream(stream->simulcast, buf, len) == 0)) {
+            /* Copied for the recording writer, a simulcast is recorded at its lowest substream */
+            janus_pubsub_recording_push(recording,
+                video ? JANUS_PUBSUB_RECORD_VIDEO : JANUS_PUBSUB_RECORD_AUDIO, buf, len);
+        }
+        if (video && stream->gop != NULL) {
+            /* Joining subscribers start from the lowest substream of a simulcast */
+            gboolean cached = (stream->simulcast == NULL ||
+                janus_pubsub_simulcast_substream(stream->simulcast, buf, len) == 0) &&
+                janus_pubsub_gop_add(stream->gop, buf, len);
+            if (g_atomic_int_get(&stream->gop_waiters) > 0) {
+                janus_pubsub_gop_replay(stream, snapshot, cached);
+            }
+        }
+        if (janus_pubsub_egress_enabled()) {
+            /* One copy for all the subscriber queues, the egress workers send it */
+            janus_pubsub_egress_packet *packet = janus_pubsub_egress_packet_new(video,
+                video && janus_pubsub_is_keyframe(stream, buf, len), buf, len);
+            guint i;
+            /* Every subscriber has a queue while the egress workers run */
+            for (i = 0; i < snapshot->count && !stream->destroyed; i++) {
+                janus_pubsub_egress_queue(stream, snapshot->entries[i].subscriber, packet);
+            }
+            janus_pubsub_egress_packet_unref(packet);
+            return;
+        }
+        /* Popular streams are sharded across the fan-out workers */
+        if (janus_pubsub_fanout_dispatch(stream, snapshot, video, buf, len)) {
+            return;
+        }
+        janus_pubsub_snapshot_entry *entry = snapshot->entries;
+        janus_pubsub_snapshot_entry *last = entry + snapshot->count;
+        for (; entry < last && !stream->destroyed; entry++) {
+            janus_pubsub_relay_entry(stream, entry, video, buf, len);
+        }
+        if (janus_pubsub_batch_enabled()) {
+            janus_pubsub_batch_packet_done(janus_pubsub_batch_get());
+        }
+    }
+}
+
+
+void janus_pubsub_relay_rtp(void *stream_p, int video, char *buf, int len) {
+    janus_pubsub_stream *stream = (janus_pubsub_stream *)stream_p;
+    janus_pubsub_metrics_in(stream->metrics, len);
+    /* With the fan-out workers this only covers handing the packet over */
+    gint64 start = janus_get_monotonic_time();
+    /* Pulled packets come from the reactors, outside of any session callback */
+    janus_pubsub_epoch_enter();
+    janus_pubsub_relay_packet(stream, video, buf, len);
+    janus_pubsub_epoch_exit();
+    janus_pubsub_metrics_fanout(stream->metrics, janus_get_monotonic_time() - start);
+}
+
+
+/*
+ * Relay a DataChannel message of the publisher, or a datagram of a pulled
+ * data port, to every subscriber. Messages are small and rare next to the
+ * media, so they skip the fan-out workers and egress queues and are sent
+ * from the calling thread, in order; the forwarders' copies still go
+ * through the sendmmsg batch
+ */
+void janus_pubsub_relay_data(void *stream_p, char *buf, int len) {
+    janus_pubsub_stream *stream = (janus_pubsub_stream *)stream_p;
+    if (!gateway) {
+        return;
+    }
+    janus_pubsub_metrics_in(stream->metrics, len);
+    janus_pubsub_epoch_enter();
+    janus_pubsub_recording *recording = g_atomic_pointer_get(&stream->recording);
+    if (recording != NULL) {
+        janus_pubsub_recording_push(recording, JANUS_PUBSUB_RECORD_DATA, buf, len);
+    }
+    janus_pubsub_snapshot *snapshot = g_atomic_pointer_get(&stream->snapshot);
+    janus_pubsub_snapshot_entry *entry = snapshot->entries;
+    janus_pubsub_snapshot_entry *last = entry + snapshot->count;
+    for (; entry < last && !stream->destroyed; entry++) {
+        janus_pubsub_metrics_out(entry->subscriber->metrics, len);
+        janus_pubsub_metrics_out(stream->metrics, len);
+        if (entry->kind == JANUS_SUBTYP_SESSION) {
+            gateway->relay_data(entry->handle, buf, len);
+        } else {
+            janus_pubsub_forward_data(stream, entry->subscriber, buf, len);
+        }
+    }
+    janus_pubsub_epoch_exit();
+    if (janus_pubsub_batch_enabled()) {
+        janus_pubsub_batch_packet_done(janus_pubsub_batch_get());
+    }
+}
+
+
+void janus_pubsub_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
+    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+        return;
+    /* The session and what it leads to can't be freed until we leave */
+    janus_pubsub_epoch_enter();
+   // JANUS_LOG(LOG_DBG, "IN - Got an RTP message (%d bytes.)\n", len);
+    if(gateway) {
+        rtp_header *rtp = (rtp_header *)buf;
+        /* Honour the audio/video active flags */
+        janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
+        if(!session) {
+            JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+            goto end;
+        }
+        if(session->destroyed) {
+            JANUS_LOG(LOG_ERR, "Skip destroyed session...\n");
+            goto end;
+        }
+
+        /* The session holds a reference on its stream until it is freed */
+        janus_pubsub_stream *stream = g_atomic_pointer_get(&session->stream);
+        if (!stream || stream->destroyed) {
+            JANUS_LOG(LOG_ERR, "Skip destroyed stream\n");
+            goto end;
+        }
+        if (stream->publisher != session) {
+            JANUS_LOG(LOG_ERR, "Skip rtp from non publishing session\n");
+            goto end;
+        }
+        stream->relay_rtp((void *)stream, video, buf, len);
+        /* Nothing tells us when the next packet comes, send what is queued */
+        janus_pubsub_batch_flush_current();
+    }
+end:
+    janus_pubsub_epoch_exit();
+}
+
+
+void janus_pubsub_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
+    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+        return;
+    janus_pubsub_epoch_enter();
+    JANUS_LOG(LOG_DBG, "IN - Got an RTCP message (%d bytes.)\n", len);
+    if(gateway) {
+        janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
+        if(!session) {
+            JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+            goto end;
+        }
+        if(session->destroyed) {
+            JANUS_LOG(LOG_ERR, "session destroyed...\n");
+            goto end;
+        }
+        janus_pubsub_stream *stream = g_atomic_pointer_get(&session->stream);
+        if (!stream) {
+            JANUS_LOG(LOG_ERR, "RTCP with no stream...\n");
+            goto end;
+        }
+        else if (stream->destroyed) {
+            JANUS_LOG(LOG_ERR, "RTCP with destroyed stream...\n");
+            goto end;
+        }
+        guint32 bitrate = janus_rtcp_get_remb(buf, len);
+        janus_pubsub_session *publisher = g_atomic_pointer_get(&stream->publisher);
+        if (publisher != NULL && session->handle == publisher->handle) {
+            /* This is and RTCP from the publishing session */
+            janus_pubsub_snapshot *snapshot = g_atomic_pointer_get(&stream->snapshot);
+            guint i;
+            for (i = 0; !session->destroyed && i < snapshot->count; i++) {
+                janus_pubsub_subscriber *sp = snapshot->entries[i].subscriber;
+                if (!sp || sp->destroyed) {
+                    JANUS_LOG(LOG_ERR, "Skip destroyed subscriber (b)...\n");
+                    continue;
+                }
+                if (sp->kind == JANUS_SUBTYP_SESSION) {
+                        janus_pubsub_session *p = sp->subscriber_session;
+                        if (!p || p->destroyed) {
+                            JANUS_LOG(LOG_ERR, "Skip destroyed session (b)...\n");
+                            continue;
+                        }
+                        if(bitrate > 0) {
+                            /*
+                             * If a REMB arrived, make sure we cap it to our configuration, and send it as
+                             * a video RTCP
+                             */
+                            if(session->bitrate > 0)
+                                janus_rtcp_cap_remb(buf, len, session->bitrate);
+                            gateway->relay_rtcp(p->handle, 1, buf, len);
+                            continue;
+                        }
+                        gateway->relay_rtcp(p->handle, video, buf, len);
+                }
+            }
+        } else {
+            /* This is and RTCP from a subscriber session */
+            gboolean pli = FALSE, fir = FALSE, remb = FALSE;
+            len = janus_pubsub_feedback_strip(buf, len, &pli, &fir, &remb);
+            if (pli || fir) {
+                /* Keyframe requests from all subscribers are merged */
+                janus_pubsub_request_keyframe(stream, fir);
+            }
+            if (remb && bitrate > 0) {
+                /* So are bandwidth estimates, capped to our configuration */
+                janus_pubsub_report_bitrate(stream, session, bitrate);
+            }
+            /* Pulled and cascaded streams have nobody to relay the rest to */
+            if (len == 0 || publisher == NULL) {
+                goto end;
+            }
+            gateway->relay_rtcp(publisher->handle, video, buf, len);
+        }
+        JANUS_LOG(LOG_DBG, "OUT - Got an RTCP message (%d bytes.)\n", len);
+    }
+end:
+    janus_pubsub_epoch_exit();
+}
+
+
+void janus_pubsub_incoming_data(janus_plugin_session *handle, char *buf, int len) {
+    JANUS_LOG(LOG_VERB, "Got a DataChannel message (%d bytes.)\n", len);
+    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+        return;
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
+    if(!session || session->destroyed) {
+        goto end;
+    }
+    janus_pubsub_stream *stream = g_atomic_pointer_get(&session->stream);
+    if (stream == NULL || stream->destroyed || stream->publisher != session) {
+        goto end;
+    }
+    stream->relay_data((void *)stream, buf, len);
+    /* Nothing tells us when the next message comes, send what is queued */
+    janus_pubsub_batch_flush_current();
+end:
+    janus_pubsub_epoch_exit();
+}
+
+
+void janus_pubsub_slow_link(janus_plugin_session *handle, int uplink, int video) {
+    if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+        return;
+    janus_pubsub_epoch_enter();
+    janus_pubsub_session *session = (janus_pubsub_session *)handle->plugin_handle;
+    if(!session || session->destroyed) {
+        goto end;
+    }
+    g_atomic_int_inc(&session->slowlink_count);
+    janus_pubsub_stream *stream = g_atomic_pointer_get(&session->stream);
+    /* Only the downlink of a subscriber is ours to relieve */
+    if (uplink || stream == NULL || stream->destroyed || session->kind != JANUS_SESSION_SUBSCRIBE) {
+        JANUS_LOG(LOG_VERB, "Slow link detected.\n");
+        goto end;
+    }
+    JANUS_LOG(LOG_VERB, "[%s] Slow %s link on subscriber %"G_GUINT64_FORMAT"\n",
+        stream->name, video ? "video" : "audio", session->sub_id);
+    janus_pubsub_egress_action action = JANUS_PUBSUB_EGRESS_NONE;
+    janus_mutex_lock(&stream->subscribers_mutex);
+    janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+    if (subscriber != NULL) {
+        if (video && stream->simulcast != NULL) {
+            /* A lower substream may be enough, unless one was chosen */
+            int target = g_atomic_int_get(&subscriber->layer.target);
+            if (target > 0) {
+                janus_pubsub_layer_set_target(&subscriber->layer, target - 1, FALSE);
+            }
+        }
+        if (subscriber->egress != NULL) {
+            action = janus_pubsub_egress_slow_link(subscriber->egress);
+        }
+    }
+    janus_mutex_unlock(&stream->subscribers_mutex);
+    if (subscriber != NULL) {
+        janus_pubsub_egress_act(stream, subscriber, action);
+    }
+end:
+    janus_pubsub_epoch_exit();
+}
+
+
+void janus_pubsub_hangup_media(janus_plugin_session *handle) {
     JANUS_LOG(LOG_INFO, "No WebRTC media anymore.\n");
 }
 
 
-/* Thread to handle incoming messages */
+/*
+ * Open the owner's recorders for the media the stream carries and hand
+ * them to a recording, the relay threads start copying packets into it
+ */
+static int janus_pubsub_start_recording(janus_pubsub_stream *stream, janus_pubsub_session *session,
+        const char *filename) {
+    gboolean audio, video, data;
+    if (stream->publisher == session) {
+        audio = session->has_audio;
+        video = session->has_video;
+        data = session->has_data;
+    } else {
+        audio = stream->audio_puller != NULL;
+        video = stream->video_puller != NULL;
+        data = stream->data_puller != NULL;
+    }
+    const char *video_codec = "vp8";
+    switch (g_atomic_int_get(&stream->video_codec)) {
+        case JANUS_PUBSUB_CODEC_VP9:
+            video_codec = "vp9";
+            break;
+        case JANUS_PUBSUB_CODEC_H264:
+            video_codec = "h264";
+            break;
+        default:
+            break;
+    }
+    gchar *base = NULL;
+    if (filename != NULL) {
+        base = g_strdup(filename);
+    } else {
+        /* Stream names are chosen by the publisher, keep them out of the path */
+        gchar *stream_name = g_strcanon(g_strdup(stream->name), JANUS_PUBSUB_RECORD_NAME_CHARS, '_');
+        base = g_strdup_printf("pubsub-%s-%"G_GINT64_FORMAT, stream_name, janus_get_real_time());
+        g_free(stream_name);
+    }
+    char name[255];
+    janus_mutex_lock(&session->rec_mutex);
+    if (audio) {
+        g_snprintf(name, sizeof(name), "%s-audio", base);
+        session->arc = janus_recorder_create(config->record_dir, "opus", name);
+    }
+    if (video) {
+        g_snprintf(name, sizeof(name), "%s-video", base);
+        session->vrc = janus_recorder_create(config->record_dir, video_codec, name);
+    }
+    if (data) {
+        g_snprintf(name, sizeof(name), "%s-data", base);
+        session->drc = janus_recorder_create(config->record_dir, "text", name);
+    }
+    g_free(base);
+    janus_pubsub_recording *recording = NULL;
+    if (session->arc != NULL || session->vrc != NULL || session->drc != NULL) {
+        recording = janus_pubsub_recording_start(session->arc, session->vrc, session->drc);
+    }
+    if (recording == NULL) {
+        janus_recorder *recorders[3] = { session->arc, session->vrc, session->drc };
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (recorders[i] != NULL) {
+                janus_recorder_close(recorders[i]);
+                janus_recorder_free(recorders[i]);
+            }
+        }
+        session->arc = NULL;
+        session->vrc = NULL;
+        session->drc = NULL;
+        janus_mutex_unlock(&session->rec_mutex);
+        return -1;
+    }
+    janus_mutex_unlock(&session->rec_mutex);
+    g_atomic_pointer_set(&stream->recording, recording);
+    JANUS_LOG(LOG_INFO, "[%s] Recording started\n", stream->name);
+    if (video) {
+        /* Make the video file start with something decodable */
+        janus_pubsub_request_keyframe(stream, FALSE);
+    }
+    return 0;
+}
+
+
+/* Back on the handler thread once the publish/subscribe callback answered */
+static void janus_pubsub_message_http_done(janus_pubsub_http_request *request, void *data) {
+    janus_pubsub_message *msg = (janus_pubsub_message *)data;
+    msg->http_done = TRUE;
+    msg->http_result = request->result;
+    msg->http_status = request->status;
+    if(!g_atomic_int_get(&initialized) || g_atomic_int_get(&stopping)) {
+        janus_pubsub_message_free(msg);
+        return;
+    }
+    g_async_queue_push(janus_pubsub_message_queue(msg->handle), msg);
+}
+
+
+/* Resume every subscribe that was waiting on the same cached decision */
+static void janus_pubsub_message_auth_done(janus_pubsub_http_request *request, void *data) {
+    janus_pubsub_message *msg = (janus_pubsub_message *)data;
+    /* Only the backend's decisions are cached, failures and server errors are asked again */
+    long status = request->status;
+    GList *waiters = janus_pubsub_authcache_complete(msg->auth_key, request->result == CURLE_OK &&
+        ((status >= 200 && status < 300) || status == 401 || status == 403), status);
+    GList *l = NULL;
+    for (l = waiters; l != NULL; l = l->next) {
+        janus_pubsub_message_http_done(request, l->data);
+    }
+    g_list_free(waiters);
+    janus_pubsub_message_http_done(request, msg);
+}
+
+
+/* Hand the request to the HTTP thread, the handler carries on with the next message */
+/* msg belongs to the HTTP layer once posted, the callback may already have run on return */
+static void janus_pubsub_message_post(janus_pubsub_message *msg, const char *url,
+        gboolean with_jsep, janus_pubsub_http_callback callback) {
+    json_t *post_msg;
+    if (with_jsep && msg->jsep) {
+        post_msg = json_pack("{sOsO}", "msg", msg->message, "jesp", msg->jsep);
+    } else {
+        post_msg = json_pack("{sO}", "msg", msg->message);
+    }
+    char *post_data = json_dumps(post_msg, JSON_ENCODE_ANY);
+    json_decref(post_msg);
+    janus_pubsub_http_post(url, post_data, callback, msg);
+}
+
+
+/* Accept the rid based simulcast of an offer, SSRC groups need nothing in the answer */
+static void janus_pubsub_answer_simulcast(janus_sdp *answer, janus_pubsub_simulcast *simulcast) {
+    janus_sdp_mline *video = janus_sdp_mline_find(answer, JANUS_SDP_VIDEO);
+    if (video == NULL || simulcast->rids[0] == NULL) {
+        return;
+    }
+    GString *rids = g_string_new("recv ");
+    int i;
+    for (i = JANUS_PUBSUB_SIMULCAST_LAYERS - 1; i >= 0; i--) {
+        if (simulcast->rids[i] == NULL) {
+            continue;
+        }
+        janus_sdp_attribute_add_to_mline(video,
+            janus_sdp_attribute_create("rid", "%s recv", simulcast->rids[i]));
+        g_string_append_printf(rids, "%s%s", rids->len > 5 ? ";" : "", simulcast->rids[i]);
+    }
+    gboolean has_extmap = FALSE;
+    GList *l;
+    for (l = video->attributes; l != NULL; l = l->next) {
+        janus_sdp_attribute *a = (janus_sdp_attribute *)l->data;
+        if (a->name && a->value && !strcasecmp(a->name, "extmap") &&
+                strstr(a->value, "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id") != NULL) {
+            has_extmap = TRUE;
+        }
+    }
+    if (!has_extmap) {
+        janus_sdp_attribute_add_to_mline(video,
+            janus_sdp_attribute_create("extmap", "%d urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id",
+                simulcast->rid_ext_id));
+    }
+    janus_sdp_attribute_add_to_mline(video, janus_sdp_attribute_create("simulcast", "%s", rids->str));
+    g_string_free(rids, TRUE);
+}
+
+
+/* Thread to handle incoming messages, one per shard */
 static void *janus_pubsub_handler(void *data) {
     JANUS_LOG(LOG_VERB, "Joining PubSub handler thread\n");
+    GAsyncQueue *queue = (GAsyncQueue *)data;
     janus_pubsub_message *msg = NULL;
     int error_code, kind = 0;
+    /* Each shard reports its errors through its own buffer */
     char *error_cause = g_malloc0(512);
     json_t *root = NULL;
+    /* The session of a message stays valid until the next one is popped */
+    gboolean reading = FALSE;
     while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-        msg = g_async_queue_pop(messages);
+        if(reading) {
+            janus_pubsub_epoch_exit();
+            reading = FALSE;
+        }
+        msg = g_async_queue_pop(queue);
 
         if(msg == NULL)
             continue;
         if(msg == &exit_message)
             break;
+        janus_pubsub_epoch_enter();
+        reading = TRUE;
         if(msg->handle == NULL) {
             janus_pubsub_message_free(msg);
             continue;
         }
-        janus_pubsub_session *session = NULL;
-
-        janus_mutex_lock(&pubsub_sessions_mutex);
-        if (janus_pubsub_session_get(msg->handle) != NULL) {
-            session = (janus_pubsub_session *)msg->handle->plugin_handle;
-        }
+        janus_pubsub_session *session = janus_pubsub_session_get(msg->handle);
         if(!session) {
-            janus_mutex_unlock(&pubsub_sessions_mutex);
             JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
             janus_pubsub_message_free(msg);
             continue;
         }
         if(session->destroyed) {
-            janus_mutex_unlock(&pubsub_sessions_mutex);
             janus_pubsub_message_free(msg);
             continue;
         }
-        janus_mutex_unlock(&pubsub_sessions_mutex);
 
         /* Handle request */
         error_code = 0;
@@ -810,34 +1952,61 @@ static void *janus_pubsub_handler(void *data) {
             }
             json_t *name = json_object_get(root, "name");
             const char *publish_name = json_string_value(name);
-            if (janus_pubsub_has_stream(publish_name)) {
+            const char *publish_kind = json_string_value(json_object_get(root, "kind"));
+            if (publish_kind != NULL && !strcasecmp(publish_kind, "cascade")) {
+                JANUS_VALIDATE_JSON_OBJECT(root, cascade_parameters,
+                        error_code, error_cause, TRUE,
+                        JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+                if(error_code != 0) {
+                        goto error;
+                }
+                if(!janus_pubsub_cascade_allowed(json_string_value(json_object_get(root, "upstream")))) {
+                        error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                        g_snprintf(error_cause, 512, "%s", "Invalid element (upstream not in cascade_upstreams)");
+                        goto error;
+                }
+            }
+            else if (publish_kind != NULL && !strcasecmp(publish_kind, "session")) {
+                JANUS_VALIDATE_JSON_OBJECT(root, pull_parameters,
+                        error_code, error_cause, TRUE,
+                        JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+                if(error_code != 0) {
+                        goto error;
+                }
+            }
+            /* Each pull socket allocates its ring from these, 0 makes no sense */
+            json_t *j_pull_size = json_object_get(root, "batch_size");
+            json_t *j_pull_count = json_object_get(root, "buffer_count");
+            if ((j_pull_size && json_integer_value(j_pull_size) < 1) ||
+                    (j_pull_count && json_integer_value(j_pull_count) < 1)) {
+                error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                g_snprintf(error_cause, 512, "%s", "Invalid element (batch_size and buffer_count start at 1)");
+                goto error;
+            }
+            if (session->stream != NULL) {
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
-                error_cause = g_strdup("Publish name exists");
+                g_snprintf(error_cause, 512, "%s", "Session already bound to a stream");
                 goto error;
             }
-            struct curl_slist *headers = NULL;
-            headers = curl_slist_append(headers, "Accept: application/json");
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-
-            /* Example curl request */
-            CURL *curl = curl_easy_init();
-            curl_easy_setopt(curl, CURLOPT_URL, config->publish_endpoint);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            json_t *post_msg;
-            if (msg->jsep) {
-                post_msg = json_pack("{soso}", "msg", root, "jesp", msg->jsep);
-            } else {
-                post_msg = json_pack("{so}", "msg", root);
+            janus_mutex_lock(&pubsub_streams_mutex);
+            gboolean exists = janus_pubsub_has_stream(publish_name);
+            janus_mutex_unlock(&pubsub_streams_mutex);
+            if (exists) {
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Publish name exists");
+                goto error;
             }
-            char *post_data = json_dumps(post_msg, JSON_ENCODE_ANY);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
-            CURLcode res = curl_easy_perform(curl);
-            if (res != CURLE_OK) {
-                JANUS_LOG(LOG_WARN, "CURL PUBLISH RESP NOT OK \n");
+            if (!msg->http_done) {
+                janus_pubsub_message_post(msg, config->publish_endpoint, TRUE, janus_pubsub_message_http_done);
+                continue;
+            }
+            if (msg->http_result != CURLE_OK) {
+                JANUS_LOG(LOG_WARN, "CURL PUBLISH RESP NOT OK (%s)\n", curl_easy_strerror(msg->http_result));
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Publish request failed");
                 goto error;
             }
-            JANUS_LOG(LOG_WARN, "CURL PUBLISH RESP OK \n");
+            JANUS_LOG(LOG_WARN, "CURL PUBLISH RESP OK (%ld)\n", msg->http_status);
             kind = JANUS_PUBTYP_SESSION;
             json_t *jkind = json_object_get(root, "kind");
             if (jkind) {
@@ -845,11 +2014,64 @@ static void *janus_pubsub_handler(void *data) {
                 if (skind != NULL && !strcasecmp(skind, "session")) {
                     kind = JANUS_PUBTYP_PULL;
                 }
+                else if (skind != NULL && !strcasecmp(skind, "cascade")) {
+                    kind = JANUS_PUBTYP_CASCADE;
+                }
+            }
+            /* What subscribers are offered comes from the publisher's SDP, it is
+             * all set before the stream is registered and can be subscribed to */
+            char *answer_sdp = NULL, *offer_sdp = NULL;
+            janus_pubsub_simulcast *simulcast = NULL;
+            if (msg_sdp != NULL) {
+                JANUS_LOG(LOG_VERB, "This is involving a negotiation (%s) as well:\n%s\n", msg_sdp_type, msg_sdp);
+                char error_str[512];
+                janus_sdp *offer = janus_sdp_parse(msg_sdp, error_str, sizeof(error_str));
+                if(offer == NULL) {
+                    JANUS_LOG(LOG_ERR, "Error parsing offer: %s\n", error_str);
+                    error_code = JANUS_PUBSUB_ERROR_INVALID_SDP;
+                    g_snprintf(error_cause, 512, "Error parsing offer: %s", error_str);
+                    goto error;
+                }
+                janus_sdp *answer = janus_sdp_generate_answer(offer, JANUS_SDP_OA_DONE);
+                simulcast = janus_pubsub_simulcast_from_sdp(msg_sdp);
+                if (simulcast != NULL) {
+                    janus_pubsub_answer_simulcast(answer, simulcast);
+                }
+                answer_sdp = janus_sdp_write(answer);
+                offer = janus_sdp_generate_offer(answer->s_name, answer->c_addr,
+                    JANUS_SDP_OA_AUDIO, TRUE,
+                    //JANUS_SDP_OA_AUDIO_CODEC, janus_pubsub_audiocodec_name(videoroom->acodec),
+                    //JANUS_SDP_OA_AUDIO_PT, janus_pubsub_audiocodec_pt(videoroom->acodec),
+                    JANUS_SDP_OA_AUDIO_DIRECTION, JANUS_SDP_SENDONLY,
+                    JANUS_SDP_OA_VIDEO, TRUE,
+                    //JANUS_SDP_OA_VIDEO_CODEC, janus_pubsub_videocodec_name(videoroom->vcodec),
+                    //JANUS_SDP_OA_VIDEO_PT, janus_pubsub_videocodec_pt(videoroom->vcodec),
+                    JANUS_SDP_OA_VIDEO_DIRECTION, JANUS_SDP_SENDONLY,
+                    JANUS_SDP_OA_DATA, TRUE,
+                    JANUS_SDP_OA_DONE);
+                offer_sdp = janus_sdp_write(offer);
             }
             int ret = janus_pubsub_create_stream(&stream);
             stream->kind = kind;
             stream->relay_rtp = janus_pubsub_relay_rtp;
+            stream->relay_data = janus_pubsub_relay_data;
             stream->name = g_strdup(publish_name);
+            stream->gop = janus_pubsub_gop_new(config->gop_cache_size);
+            stream->feedback = janus_pubsub_feedback_new(config->keyframe_interval);
+            if (msg_sdp != NULL) {
+                /* The stream owns these from now on */
+                stream->sdp_type = g_strdup(msg_sdp_type);
+                stream->sdp = offer_sdp;
+                stream->simulcast = simulcast;
+                janus_pubsub_gop_set_codec_from_sdp(stream->gop, msg_sdp);
+                int video_pt = -1;
+                janus_pubsub_video_codec video_codec = janus_pubsub_gop_codec_from_sdp(msg_sdp, &video_pt);
+                g_atomic_int_set(&stream->video_pt, video_pt);
+                g_atomic_int_set(&stream->video_codec, video_codec);
+                session->has_audio = (strstr(msg_sdp, "m=audio") != NULL);
+                session->has_video = (strstr(msg_sdp, "m=video") != NULL);
+                session->has_data = (strstr(msg_sdp, "DTLS/SCTP") != NULL);
+            }
             if (stream->kind == JANUS_PUBTYP_SESSION) {
                 JANUS_LOG(LOG_WARN, "Init publisher (session)\n");
                 stream->publisher = session;
@@ -879,40 +2101,104 @@ static void *janus_pubsub_handler(void *data) {
                 if(j_port) {
                     stream->data_port = json_integer_value(j_port);
                 }
+                json_t *j_batch = json_object_get(root, "batch_size");
+                stream->pull_batch_size = MIN(j_batch ? json_integer_value(j_batch) : config->pull_batch_size,
+                    JANUS_PUBSUB_PULL_MAX_BATCH_SIZE);
+                json_t *j_buffers = json_object_get(root, "buffer_count");
+                stream->pull_buffer_count = MIN(j_buffers ? json_integer_value(j_buffers) : config->pull_buffer_count,
+                    JANUS_PUBSUB_PULL_MAX_BUFFER_COUNT);
+                /* Without an SDP the keyframes can only be found if we are told the codec */
+                json_t *j_codec = json_object_get(root, "video_codec");
+                if(j_codec) {
+                    g_atomic_int_set(&stream->video_codec,
+                        janus_pubsub_gop_codec_from_name(json_string_value(j_codec)));
+                    janus_pubsub_gop_set_codec(stream->gop, stream->video_codec, -1);
+                }
                 guint32 audio_handle;
                 guint32 video_handle;
                 guint32 data_handle;
                 /*
                  * TODO: video and audio payload_type and ssrc for the forwarder helper calls
                  */
-                if(stream->audio_port > 0) {
+                gboolean cascade = stream->kind == JANUS_PUBTYP_CASCADE;
+                if(stream->audio_port > 0 || cascade) {
                     audio_handle = janus_pubsub_puller_add_helper(
                         stream, stream->host, stream->audio_port, 0, 0, FALSE, FALSE);
                 }
-                if(stream->video_port > 0) {
+                if(stream->video_port > 0 || cascade) {
                     video_handle = janus_pubsub_puller_add_helper(
                         stream, stream->host, stream->video_port, 0, 0, TRUE, FALSE);
                 }
-                if(stream->data_port > 0) {
+                if(stream->data_port > 0 || cascade) {
                     data_handle = janus_pubsub_puller_add_helper(
                         stream, stream->host, stream->data_port, 0, 0, FALSE, TRUE);
                 }
-                GError *thread_error = NULL;
-                stream->relay_thread = g_thread_try_new(
-                    stream->name, &janus_pubsub_pull_thread, stream, &thread_error);
-                if(thread_error != NULL) {
+                if(cascade) {
+                    /* The upstream node forwards to whatever ports we got */
+                    if(!stream->audio_puller || !stream->video_puller || !stream->data_puller) {
+                        janus_pubsub_stream_unref(stream);
+                        g_free(answer_sdp);
+                        error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                        g_snprintf(error_cause, 512, "%s", "Could not bind the cascade ports");
+                        goto error;
+                    }
+                    /* Without an upstream stream the one with our name is pulled */
+                    const char *upstream_name = json_string_value(json_object_get(root, "upstream_name"));
+                    json_t *upstream_id = json_object_get(root, "upstream_id");
+                    stream->cascade = janus_pubsub_cascade_new(
+                        json_string_value(json_object_get(root, "upstream")),
+                        upstream_name ? upstream_name : publish_name,
+                        upstream_id ? json_integer_value(upstream_id) : 0, stream->host, msg->handle);
+                    stream->cascade->audio_port = ntohs(stream->audio_puller->serv_addr.sin_port);
+                    stream->cascade->video_port = ntohs(stream->video_puller->serv_addr.sin_port);
+                    stream->cascade->data_port = ntohs(stream->data_puller->serv_addr.sin_port);
+                    stream->audio_port = stream->cascade->audio_port;
+                    stream->video_port = stream->cascade->video_port;
+                    stream->data_port = stream->cascade->data_port;
+                }
+                /* One of the pull reactors waits on the sockets from now on */
+                if(janus_pubsub_reactor_add_stream(stream) < 0) {
+                    janus_pubsub_stream_unref(stream);
+                    g_free(answer_sdp);
                     error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
-                    error_cause = g_strdup("Invalid subscriber kind");
+                    g_snprintf(error_cause, 512, "%s", "Could not start pulling the stream");
                     goto error;
                 }
             }
-            session->stream_name = g_strdup(stream->name);
+            /* Another shard may have published the same name meanwhile */
             janus_mutex_lock(&pubsub_streams_mutex);
+            if (janus_pubsub_has_stream(stream->name)) {
+                janus_mutex_unlock(&pubsub_streams_mutex);
+                stream->destroyed = janus_get_monotonic_time();
+                janus_pubsub_reactor_remove_stream(stream);
+                janus_pubsub_stream_unref(stream);
+                g_free(answer_sdp);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Publish name exists");
+                goto error;
+            }
+            stream->owner = session;
+            janus_pubsub_stream_ref(stream);
+            g_atomic_pointer_set(&session->stream, stream);
             janus_pubsub_add_stream(stream);
             janus_mutex_unlock(&pubsub_streams_mutex);
+            if (stream->cascade != NULL) {
+                /* Subscribing upstream goes on in the background, the owner hears how it went */
+                janus_pubsub_cascade_start(stream->cascade, stream);
+            }
             JANUS_LOG(LOG_WARN, "CURL RESP OK (%s)\n", stream->name);
-            curl_easy_cleanup(curl);
-            free(post_data);
+            /* Pulled streams have no answer, the event alone carries the id */
+            json_t *event = json_object();
+            json_object_set_new(event, "pubsub", json_string("event"));
+            json_object_set_new(event, "result", json_string("ok"));
+            json_object_set_new(event, "id", json_integer(stream->pub_id));
+            json_t *jsep = answer_sdp ? json_pack("{ssss}", "type", "answer", "sdp", answer_sdp) : NULL;
+            gateway->push_event(msg->handle, &janus_pubsub_plugin, msg->transaction, event, jsep);
+            json_decref(event);
+            if (jsep != NULL) {
+                json_decref(jsep);
+            }
+            g_free(answer_sdp);
         }
         if (!strcasecmp(request_text, "subscribe")) {
             JANUS_LOG(LOG_VERB, "Handle subscribe\n");
@@ -922,9 +2208,16 @@ static void *janus_pubsub_handler(void *data) {
             if (error_code != 0) {
                 goto error;
             }
-            json_t *name = json_object_get(root, "name");
-            const char *play_name = json_string_value(name);
+            /* Streams are looked up by id, or by name as before */
+            const char *play_name = json_string_value(json_object_get(root, "name"));
+            json_t *play_id = json_object_get(root, "id");
+            if (play_name == NULL && play_id == NULL) {
+                error_code = JANUS_PUBSUB_ERROR_MISSING_ELEMENT;
+                g_snprintf(error_cause, 512, "%s", "Missing element (name or id)");
+                goto error;
+            }
             kind = JANUS_SUBTYP_SESSION;
+            janus_pubsub_multicast_options mcast_options;
             json_t *jkind = json_object_get(root, "kind");
             if (jkind && !strcasecmp(json_string_value(jkind), "session")) {
                 kind = JANUS_SUBTYP_SESSION;
@@ -938,65 +2231,168 @@ static void *janus_pubsub_handler(void *data) {
                 }
                 kind = JANUS_SUBTYP_FORWARD;
             }
+            else if (jkind && !strcasecmp(json_string_value(jkind), "multicast")) {
+                JANUS_VALIDATE_JSON_OBJECT(root, multicast_parameters,
+                        error_code, error_cause, TRUE,
+                        JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+                if(error_code != 0) {
+                    goto error;
+                }
+                if(!janus_pubsub_multicast_group(json_string_value(json_object_get(root, "group")))) {
+                    error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                    g_snprintf(error_cause, 512, "%s", "Invalid element (group is not an IPv4 multicast address)");
+                    goto error;
+                }
+                const char *port_names[] = { "audio_port", "video_port", "data_port" };
+                int p, ports = 0;
+                for(p = 0; p < 3; p++) {
+                    json_t *j_mport = json_object_get(root, port_names[p]);
+                    if(j_mport && (json_integer_value(j_mport) < 1 || json_integer_value(j_mport) > 65535)) {
+                        error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                        g_snprintf(error_cause, 512, "Invalid element (%s is not 1-65535)", port_names[p]);
+                        goto error;
+                    }
+                    ports += j_mport != NULL;
+                }
+                if(ports == 0) {
+                    error_code = JANUS_PUBSUB_ERROR_MISSING_ELEMENT;
+                    g_snprintf(error_cause, 512, "%s", "Missing element (audio_port, video_port or data_port)");
+                    goto error;
+                }
+                json_t *j_ttl = json_object_get(root, "ttl");
+                json_t *j_loopback = json_object_get(root, "loopback");
+                if(janus_pubsub_multicast_options_get(&mcast_options,
+                        j_ttl ? (int)json_integer_value(j_ttl) : -1,
+                        json_string_value(json_object_get(root, "interface")),
+                        j_loopback ? json_is_true(j_loopback) : -1) < 0) {
+                    error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                    g_snprintf(error_cause, 512, "%s", "Invalid element (unknown interface)");
+                    goto error;
+                }
+                kind = JANUS_SUBTYP_MULTICAST;
+            }
             else if (jkind) {
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
-                error_cause = g_strdup("Invalid subscriber kind");
+                g_snprintf(error_cause, 512, "%s", "Invalid subscriber kind");
                 goto error;
             }
 
-            struct curl_slist *headers = NULL;
-            headers = curl_slist_append(headers, "Accept: application/json");
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-
-            /* Example curl request */
-            CURL *curl = curl_easy_init();
-            curl_easy_setopt(curl, CURLOPT_URL, config->subscribe_endpoint);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-            json_t *post_msg = json_pack("{so}", "msg", root);
-            char *post_data = json_dumps(post_msg, JSON_ENCODE_ANY);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
-
-
-            CURLcode res = curl_easy_perform(curl);
-            if(res != CURLE_OK) {
-                JANUS_LOG(LOG_WARN, "CURL SUBSCRIBE RESP NOT OK \n");
+            if (session->stream != NULL) {
+                JANUS_LOG(LOG_WARN, "Session already bound to a stream\n");
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Session already bound to a stream");
                 goto error;
             }
-            JANUS_LOG(LOG_WARN, "CURL SUBSCRIBE RESP OK \n");
-            json_t *event_x = json_object();
-            json_object_set_new(event_x, "pubsub", json_string("event"));
-            json_object_set_new(event_x, "result", json_string("ok"));
+            if (!msg->http_done && janus_pubsub_authcache_enabled()) {
+                msg->auth_key = janus_pubsub_authcache_key(root);
+                long status = 0;
+                janus_pubsub_authcache_state state = janus_pubsub_authcache_lookup(msg->auth_key, msg, &status);
+                if (state == JANUS_PUBSUB_AUTHCACHE_PENDING) {
+                    /* Resumed with the answer of the identical request in flight */
+                    continue;
+                }
+                if (state == JANUS_PUBSUB_AUTHCACHE_FULL) {
+                    /* Asked on its own, its answer isn't recorded */
+                    g_free(msg->auth_key);
+                    msg->auth_key = NULL;
+                }
+                if (state == JANUS_PUBSUB_AUTHCACHE_HIT) {
+                    msg->http_done = TRUE;
+                    msg->http_result = CURLE_OK;
+                    msg->http_status = status;
+                }
+            }
+            if (!msg->http_done) {
+                /* The subscribe message goes out without the jsep, as before */
+                janus_pubsub_message_post(msg, config->subscribe_endpoint, FALSE,
+                    msg->auth_key ? janus_pubsub_message_auth_done : janus_pubsub_message_http_done);
+                continue;
+            }
+            if (msg->http_result != CURLE_OK) {
+                JANUS_LOG(LOG_WARN, "CURL SUBSCRIBE RESP NOT OK (%s)\n", curl_easy_strerror(msg->http_result));
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Subscribe request failed");
+                goto error;
+            }
+            if (msg->http_status < 200 || msg->http_status >= 300) {
+                /* Cached or not, anything but a 2xx refuses the subscribe */
+                JANUS_LOG(LOG_WARN, "CURL SUBSCRIBE RESP REFUSED (%ld)\n", msg->http_status);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "Subscribe refused (%ld)", msg->http_status);
+                goto error;
+            }
+            JANUS_LOG(LOG_WARN, "CURL SUBSCRIBE RESP OK (%ld)\n", msg->http_status);
             JANUS_LOG(LOG_WARN, "Lookup stream \n");
-            stream = janus_pubsub_stream_get(play_name);
-            //stream = g_hash_table_lookup(pubsub_streams, play_name);
+            /* Another subscribe may have completed while this one was in flight */
+            if (session->stream != NULL) {
+                JANUS_LOG(LOG_WARN, "Session already bound to a stream\n");
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Session already bound to a stream");
+                goto error;
+            }
+            janus_mutex_lock(&pubsub_streams_mutex);
+            if (play_id != NULL) {
+                stream = janus_pubsub_stream_get_ref_by_id(json_integer_value(play_id));
+            } else {
+                stream = janus_pubsub_stream_get_ref(play_name);
+            }
+            janus_mutex_unlock(&pubsub_streams_mutex);
             if (stream == NULL) {
                 JANUS_LOG(LOG_WARN, "Stream does not exist\n");
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Stream does not exist");
                 goto error;
             }
             if (stream->destroyed) {
                 JANUS_LOG(LOG_WARN, "Stream destroyed\n");
+                janus_pubsub_stream_unref(stream);
                 error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Stream does not exist");
                 goto error;
             }
+            if (kind == JANUS_SUBTYP_SESSION && g_atomic_pointer_get(&stream->sdp) == NULL) {
+                /* A cascaded stream learns its SDP from the upstream node */
+                janus_pubsub_stream_unref(stream);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Stream has no offer for subscribers yet");
+                goto error;
+            }
+            if (kind == JANUS_SUBTYP_MULTICAST &&
+                    janus_pubsub_multicast_setup(stream, &mcast_options, error_cause) < 0) {
+                janus_pubsub_stream_unref(stream);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                goto error;
+            }
+            if (kind == JANUS_SUBTYP_FORWARD && janus_pubsub_forward_setup(stream, error_cause) < 0) {
+                janus_pubsub_stream_unref(stream);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                goto error;
+            }
+            json_t *event_x = json_object();
+            json_object_set_new(event_x, "pubsub", json_string("event"));
+            json_object_set_new(event_x, "result", json_string("ok"));
+            json_object_set_new(event_x, "id", json_integer(stream->pub_id));
+            /* Lets a downstream node cascading the stream find its keyframes */
+            const char *codec_name = janus_pubsub_gop_codec_name(g_atomic_int_get(&stream->video_codec));
+            if (codec_name != NULL) {
+                json_object_set_new(event_x, "video_codec", json_string(codec_name));
+                json_object_set_new(event_x, "video_pt", json_integer(g_atomic_int_get(&stream->video_pt)));
+            }
+            /* The reference taken above now belongs to the session */
+            g_atomic_pointer_set(&session->stream, stream);
             guint64 subscriber_id = janus_random_uint64();
-            janus_pubsub_subscriber *subscriber = g_malloc0(sizeof(janus_pubsub_stream));
-            subscriber->subscriber_id = subscriber_id;
-            subscriber->kind = kind;
-            session->stream_name = g_strdup(stream->name); /* lock sessions ? */
-            subscriber->rtp_forwarders = g_hash_table_new(NULL, NULL);
-            janus_mutex_init(&subscriber->rtp_forwarders_mutex);
-            subscriber->destroyed = 0;
+            janus_pubsub_subscriber *subscriber = janus_pubsub_subscriber_new(subscriber_id, kind);
+            janus_pubsub_layer_init(&subscriber->layer, config->simulcast_substream);
+            subscriber->egress = janus_pubsub_egress_new(stream, subscriber);
             if (subscriber->kind == JANUS_SUBTYP_SESSION ) {
                 JANUS_LOG(LOG_WARN, "Init stream subscriber (session)\n");
+                janus_pubsub_session_ref(session);
                 subscriber->subscriber_session = session;
                 session->kind = JANUS_SESSION_SUBSCRIBE;
             } else {
                 JANUS_LOG(LOG_WARN, "Init stream subscriber (forward)\n");
-                /* must be forward */
-                json_t *j_host = json_object_get(root, "host");
+                /* must be forward, or multicast to a group */
+                json_t *j_host = json_object_get(root, kind == JANUS_SUBTYP_MULTICAST ? "group" : "host");
                 if(j_host) {
                     subscriber->host = g_strdup(json_string_value(j_host));
                 }
@@ -1022,17 +2418,6 @@ static void *janus_pubsub_handler(void *data) {
                 if(j_dport) {
                     subscriber->data_port = json_integer_value(j_dport);
                 }
-                if(stream->fwd_sock <= 0) {
-                    stream->fwd_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-                    if(stream->fwd_sock <= 0) {
-                        JANUS_LOG(LOG_ERR, "Could not open UDP socket for rtp stream for publisher (%s)\n", stream->name);
-                        error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
-                        g_snprintf(error_cause, 512, "Could not open UDP socket for rtp stream");
-                        goto error;
-                    } else {
-                        JANUS_LOG(LOG_WARN, "Added forwarder socket %s\n", subscriber->host);
-                    }
-                }
                 guint32 audio_handle;
                 guint32 video_handle;
                 guint32 data_handle;
@@ -1051,12 +2436,34 @@ static void *janus_pubsub_handler(void *data) {
                     data_handle = janus_pubsub_forwarder_add_helper(
                         subscriber, subscriber->host, subscriber->data_port, 0, 0, FALSE, TRUE);
                 }
+                if(stream->gop != NULL && subscriber->video_port > 0) {
+                    /* Flagged before it is visible to the relay loop, so it gets the cache first */
+                    subscriber->gop_pending = 1;
+                    g_atomic_int_inc(&stream->gop_waiters);
+                }
                 JANUS_LOG(LOG_WARN, "Subscriber %s video=%d audio=%d data=%d\n",
                         subscriber->host, subscriber->video_port, subscriber->audio_port, subscriber->data_port);
             }
-            session->sub_id  = subscriber_id;
             janus_mutex_lock(&stream->subscribers_mutex);
-            g_hash_table_insert(stream->subscribers, subscriber_id, subscriber);
+            /* Checked where it is inserted, so two subscribes can't both take a group */
+            int taken = kind == JANUS_SUBTYP_MULTICAST ? janus_pubsub_multicast_taken(stream, subscriber) : 0;
+            if (taken > 0) {
+                janus_mutex_unlock(&stream->subscribers_mutex);
+                if (subscriber->gop_pending) {
+                    g_atomic_int_add(&stream->gop_waiters, -1);
+                }
+                janus_pubsub_egress_close(subscriber->egress);
+                janus_pubsub_subscriber_unref(subscriber);
+                g_atomic_pointer_set(&session->stream, NULL);
+                janus_pubsub_stream_unref(stream);
+                json_decref(event_x);
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "Stream already sent to that group on port %d", taken);
+                goto error;
+            }
+            session->sub_id  = subscriber_id;
+            g_hash_table_insert(stream->subscribers, &subscriber->subscriber_id, subscriber);
+            janus_pubsub_stream_update_snapshot(stream);
             janus_mutex_unlock(&stream->subscribers_mutex);
             JANUS_LOG(LOG_WARN, "Added subscriber: %d\n", subscriber->subscriber_id);
 
@@ -1065,8 +2472,124 @@ static void *janus_pubsub_handler(void *data) {
             json_decref(event_x);
             json_decref(jsep_x);
             JANUS_LOG(LOG_WARN, "CURL PLAY RESP OK (%s) \n", stream->name);
-            curl_easy_cleanup(curl);
-            free(post_data);
+        }
+        if (!strcasecmp(request_text, "configure")) {
+            JANUS_VALIDATE_JSON_OBJECT(root, configure_parameters,
+                error_code, error_cause, TRUE,
+                JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+            if (error_code != 0) {
+                goto error;
+            }
+            stream = session->stream;
+            if (stream == NULL || session->sub_id == 0) {
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Session not subscribed to a stream");
+                goto error;
+            }
+            json_t *j_substream = json_object_get(root, "substream");
+            int substream = -1;
+            janus_mutex_lock(&stream->subscribers_mutex);
+            janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+            if (subscriber != NULL) {
+                if (j_substream) {
+                    /* A negative substream lets the bandwidth estimates choose again */
+                    janus_pubsub_layer_set_target(&subscriber->layer, json_integer_value(j_substream), TRUE);
+                }
+                substream = g_atomic_int_get(&subscriber->layer.target);
+            }
+            janus_mutex_unlock(&stream->subscribers_mutex);
+            json_t *event = json_object();
+            json_object_set_new(event, "pubsub", json_string("event"));
+            json_object_set_new(event, "result", json_string("ok"));
+            json_object_set_new(event, "simulcast", stream->simulcast ? json_true() : json_false());
+            json_object_set_new(event, "substream", json_integer(substream));
+            gateway->push_event(msg->handle, &janus_pubsub_plugin, msg->transaction, event, NULL);
+            json_decref(event);
+        }
+        if (!strcasecmp(request_text, "stats")) {
+            JANUS_VALIDATE_JSON_OBJECT(root, stats_parameters,
+                error_code, error_cause, TRUE,
+                JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+            if (error_code != 0) {
+                goto error;
+            }
+            /* By id or name, or the one this session is bound to, which is the only one it may read */
+            const char *stats_name = json_string_value(json_object_get(root, "name"));
+            json_t *stats_id = json_object_get(root, "id");
+            janus_mutex_lock(&pubsub_streams_mutex);
+            if (stats_id != NULL) {
+                stream = janus_pubsub_stream_get_ref_by_id(json_integer_value(stats_id));
+            } else if (stats_name != NULL) {
+                stream = janus_pubsub_stream_get_ref(stats_name);
+            } else {
+                stream = session->stream;
+                if (stream != NULL) {
+                    janus_pubsub_stream_ref(stream);
+                }
+            }
+            janus_mutex_unlock(&pubsub_streams_mutex);
+            if (stream == NULL) {
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "No such stream");
+                goto error;
+            }
+            if (stream != session->stream) {
+                /* Other streams' subscribers are theirs to know, the admin API sees everything */
+                janus_pubsub_stream_unref(stream);
+                stream = NULL;
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Session doesn't publish or subscribe to that stream");
+                goto error;
+            }
+            json_t *event = json_object();
+            json_object_set_new(event, "pubsub", json_string("event"));
+            json_object_set_new(event, "result", json_string("ok"));
+            json_object_set_new(event, "stats", janus_pubsub_stream_stats(stream));
+            janus_pubsub_stream_unref(stream);
+            stream = NULL;
+            gateway->push_event(msg->handle, &janus_pubsub_plugin, msg->transaction, event, NULL);
+            json_decref(event);
+        }
+        if (!strcasecmp(request_text, "record")) {
+            JANUS_VALIDATE_JSON_OBJECT(root, record_parameters,
+                error_code, error_cause, TRUE,
+                JANUS_PUBSUB_ERROR_MISSING_ELEMENT, JANUS_PUBSUB_ERROR_INVALID_ELEMENT);
+            if (error_code != 0) {
+                goto error;
+            }
+            stream = session->stream;
+            if (stream == NULL || stream->owner != session || stream->destroyed) {
+                error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                g_snprintf(error_cause, 512, "%s", "Session doesn't own a stream");
+                goto error;
+            }
+            gboolean record = json_is_true(json_object_get(root, "record"));
+            json_t *jfilename = json_object_get(root, "filename");
+            const char *filename = json_string_value(jfilename);
+            /* A plain name inside record_dir, no paths, dot files or embedded NULs */
+            if (filename != NULL && (filename[0] == '\0' || filename[0] == '.' ||
+                    strlen(filename) != json_string_length(jfilename) ||
+                    strspn(filename, JANUS_PUBSUB_RECORD_NAME_CHARS) != strlen(filename))) {
+                error_code = JANUS_PUBSUB_ERROR_INVALID_ELEMENT;
+                g_snprintf(error_cause, 512, "%s", "Invalid element (filename)");
+                goto error;
+            }
+            if (record && g_atomic_pointer_get(&stream->recording) == NULL) {
+                if (janus_pubsub_start_recording(stream, session, filename) < 0) {
+                    error_code = JANUS_PUBSUB_ERROR_UNKNOWN_ERROR;
+                    g_snprintf(error_cause, 512, "%s", "Could not start recording");
+                    goto error;
+                }
+            } else if (!record && janus_pubsub_stream_stop_recording(stream)) {
+                JANUS_LOG(LOG_INFO, "[%s] Recording stopped\n", stream->name);
+            }
+            json_t *event = json_object();
+            json_object_set_new(event, "pubsub", json_string("event"));
+            json_object_set_new(event, "result", json_string("ok"));
+            json_object_set_new(event, "recording",
+                g_atomic_pointer_get(&stream->recording) ? json_true() : json_false());
+            gateway->push_event(msg->handle, &janus_pubsub_plugin, msg->transaction, event, NULL);
+            json_decref(event);
         }
         if(!session->video_active) {
             /* Send a PLI */
@@ -1080,61 +2603,6 @@ static void *janus_pubsub_handler(void *data) {
 
         /* TODO: Enforce request (see echotest plugin) */
 
-        /* Any SDP to handle? */
-        if(msg_sdp) {
-            JANUS_LOG(LOG_VERB, "This is involving a negotiation (%s) as well:\n%s\n", msg_sdp_type, msg_sdp);
-
-            if(!strcasecmp(request_text, "publish")) {
-                session->has_audio = (strstr(msg_sdp, "m=audio") != NULL);
-                session->has_video = (strstr(msg_sdp, "m=video") != NULL);
-                session->has_data = (strstr(msg_sdp, "DTLS/SCTP") != NULL);
-
-                json_t *event = json_object();
-                json_object_set_new(event, "pubsub", json_string("event"));
-                json_object_set_new(event, "result", json_string("ok"));
-                // Answer the offer and send it to the gateway, to start the echo test //
-                const char *type = "answer";
-                char error_str[512];
-                janus_sdp *answer = NULL;
-                janus_sdp *offer = NULL;
-                offer = janus_sdp_parse(msg_sdp, error_str, sizeof(error_str));
-                if(offer == NULL) {
-                    json_decref(event);
-                    JANUS_LOG(LOG_ERR, "Error parsing offer: %s\n", error_str);
-                    error_code = JANUS_PUBSUB_ERROR_INVALID_SDP;
-                    g_snprintf(error_cause, 512, "Error parsing offer: %s", error_str);
-                    goto error;
-                }
-                answer = janus_sdp_generate_answer(offer, JANUS_SDP_OA_DONE);
-                char *answer_sdp = janus_sdp_write(answer);
-                offer = janus_sdp_generate_offer(answer->s_name, answer->c_addr,
-                    JANUS_SDP_OA_AUDIO, TRUE,
-                    //JANUS_SDP_OA_AUDIO_CODEC, janus_pubsub_audiocodec_name(videoroom->acodec),
-                    //JANUS_SDP_OA_AUDIO_PT, janus_pubsub_audiocodec_pt(videoroom->acodec),
-                    JANUS_SDP_OA_AUDIO_DIRECTION, JANUS_SDP_SENDONLY,
-                    JANUS_SDP_OA_VIDEO, TRUE,
-                    //JANUS_SDP_OA_VIDEO_CODEC, janus_pubsub_videocodec_name(videoroom->vcodec),
-                    //JANUS_SDP_OA_VIDEO_PT, janus_pubsub_videocodec_pt(videoroom->vcodec),
-                    JANUS_SDP_OA_VIDEO_DIRECTION, JANUS_SDP_SENDONLY,
-                    JANUS_SDP_OA_DATA, TRUE,
-                    JANUS_SDP_OA_DONE);
-                char *offer_sdp = janus_sdp_write(offer);
-                stream->sdp_type = g_strdup(msg_sdp_type);
-                stream->sdp = g_strdup(offer_sdp);
-                json_t *jsep = json_pack("{ssss}", "type", type, "sdp", answer_sdp);
-                //gint64 start = janus_get_monotonic_time();
-                int res = gateway->push_event(msg->handle, &janus_pubsub_plugin, msg->transaction, event, jsep);
-                //JANUS_LOG(LOG_VERB,
-                //          "  >> Pushing event to peer: %d (%s)\n",
-                //          ret, janus_get_api_error(ret));
-                json_decref(event);
-                json_decref(jsep);
-                g_free(offer_sdp);
-                g_free(answer_sdp);
-            }
-        }
-
-
         janus_pubsub_message_free(msg);
 
         JANUS_LOG(LOG_WARN, "Handler end\n");
@@ -1153,6 +2621,9 @@ error:
             json_decref(event);
         }
     }
+    if(reading) {
+        janus_pubsub_epoch_exit();
+    }
     g_free(error_cause);
     JANUS_LOG(LOG_VERB, "Leaving PubSub handler thread\n");
     return NULL;
@@ -1172,86 +2643,3 @@ print_bytes(const void *object, size_t size)
   }
   printf("\n");
 }
-
-static void *janus_pubsub_pull_thread(void *data) {
-   janus_pubsub_stream *stream = (janus_pubsub_stream *)data;
-   struct pollfd fds[3];
-   /* Prepare poll */
-   int num = 0;
-   char buffer[1500];
-   memset(buffer, 0, 1500);
-   int i, resfd, bytes, video_fd, video = 0;
-   struct sockaddr_in remote;
-   socklen_t addrlen;
-   if(stream->audio_port > 0) {
-        video_fd = stream->audio_puller->pull_sock;
-   	fds[num].fd = stream->audio_puller->pull_sock;
-   	fds[num].events = POLLIN;
-   	fds[num].revents = 0;
-   	num++;
-   }
-   if(stream->video_port > 0) {
-   	fds[num].fd = stream->video_puller->pull_sock;
-   	fds[num].events = POLLIN;
-   	fds[num].revents = 0;
-   	num++;
-   }
-   if(stream->data_port > 0) {
-   	fds[num].fd = stream->data_puller->pull_sock;
-   	fds[num].events = POLLIN;
-   	fds[num].revents = 0;
-   	num++;
-   }
-
-   JANUS_LOG(LOG_WARN, "Start pulling\n");
-   for (;;)
-   {
-       resfd = poll(fds, num, 1000);
-       if(resfd < 0) {
-           JANUS_LOG(LOG_ERR, "[%s] Error polling... %d (%s)\n", stream->name, errno, strerror(errno));
-           //mountpoint->enabled = FALSE;
-           break;
-       } else if(resfd == 0) {
-           /* No data, keep going */
-           continue;
-       }
-       for(i=0; i<num; i++) {
-           if(fds[i].revents & (POLLERR | POLLHUP)) {
-               /* Socket error? */
-               JANUS_LOG(LOG_ERR, "[%s] Error polling: %s... %d (%s)\n", stream->name,
-                       fds[i].revents & POLLERR ? "POLLERR" : "POLLHUP", errno, strerror(errno));
-               //mountpoint->enabled = FALSE;
-               break;
-           } else if(fds[i].revents & POLLIN) {
-              /* Got an RTP or data packet */
-              addrlen = sizeof(remote);
-              bytes = recvfrom(fds[i].fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-              if(bytes < 0) {
-                  /* Failed to read? */
-                  continue;
-              }
-              JANUS_LOG(LOG_VERB, "Puller received bytes %d\n", bytes);
-	      rtp_header *rtp = (rtp_header *)buffer;
-              if (video_fd > 0 && fds[i].fd == video_fd) {
-                video = 1;
-              } else {
-                video = 0;
-              }
-
-            //  packet.data = rtp;
-            //  packet.length = bytes;
-            //  packet.is_rtp = TRUE;
-            //  packet.is_video = FALSE;
-            //  packet.is_keyframe = FALSE;
-            //  packet.timestamp = ntohl(packet.data->timestamp);
-            //  packet.seq_number = ntohs(packet.data->seq_number);
-              stream->relay_rtp((void *)stream, video, buffer, bytes);
-
-             // janus_mutex_lock(&mountpoint->mutex);
-             // g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-             // janus_mutex_unlock(&mountpoint->mutex);
-          }
-       }
-   }
-   return NULL;
-}
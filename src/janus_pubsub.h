@@ -13,6 +13,7 @@
 #define PUBSUB_DEFAULT_SUB_URL "http://localhost:5000/play"
 #define PUBSUB_DEFAULT_FWD_HOST "127.0.0.1"
 #define PUBSUB_DEFAULT_PULL_HOST "127.0.0.1"
+#define PUBSUB_DEFAULT_HANDLER_THREADS 0      /* One message handler per core */
 
 
 /* Error codes */
@@ -27,10 +28,12 @@
 /* Stream Kinds */
 #define JANUS_PUBTYP_SESSION     1
 #define JANUS_PUBTYP_PULL        2
+#define JANUS_PUBTYP_CASCADE     3
 
 /* Subscriber Kinds */
 #define JANUS_SUBTYP_SESSION     1
 #define JANUS_SUBTYP_FORWARD     2
+#define JANUS_SUBTYP_MULTICAST   3
 
 
 /* Session Kinds */
@@ -38,12 +41,8 @@
 #define JANUS_SESSION_SUBSCRIBE 1
 #define JANUS_SESSION_PUBLISH 2
 extern janus_mutex pubsub_streams_mutex;
-extern janus_mutex pubsub_sessions_mutex;
 
 extern GHashTable *pubsub_streams;
-extern GList *pubsub_old_sessions;
-extern GList *pubsub_old_streams;
-extern GList *pubsub_old_subscribers;
 
 
 int janus_pubsub_is_initialized(void);
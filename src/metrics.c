@@ -0,0 +1,145 @@
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "metrics.h"
+
+/*
+ * Each thread is given a slot index the first time it counts something.
+ * Slots are updated with atomic adds, which stay cheap as long as no
+ * other thread writes to the same cache line.
+ */
+static volatile gint next_slot;
+static GPrivate thread_slot;
+
+
+static guint janus_pubsub_metrics_slot_index(void) {
+    guint slot = GPOINTER_TO_UINT(g_private_get(&thread_slot));
+    if (slot == 0) {
+        /* Stored plus one, NULL means not assigned yet */
+        slot = (guint)g_atomic_int_add(&next_slot, 1) % JANUS_PUBSUB_METRICS_SLOTS + 1;
+        g_private_set(&thread_slot, GUINT_TO_POINTER(slot));
+    }
+    return slot - 1;
+}
+
+
+static void *janus_pubsub_metrics_alloc(gsize size) {
+    void *memory = NULL;
+    if (posix_memalign(&memory, JANUS_PUBSUB_METRICS_CACHE_LINE, size) != 0) {
+        g_error("Could not allocate %"G_GSIZE_FORMAT" bytes of metrics", size);
+    }
+    memset(memory, 0, size);
+    return memory;
+}
+
+
+janus_pubsub_metrics *janus_pubsub_metrics_new(gboolean histogram) {
+    janus_pubsub_metrics *metrics = janus_pubsub_metrics_alloc(sizeof(janus_pubsub_metrics));
+    if (histogram) {
+        metrics->histogram = janus_pubsub_metrics_alloc(
+            JANUS_PUBSUB_METRICS_SLOTS * sizeof(janus_pubsub_histogram_slot));
+    }
+    return metrics;
+}
+
+
+void janus_pubsub_metrics_free(janus_pubsub_metrics *metrics) {
+    if (metrics == NULL) {
+        return;
+    }
+    free(metrics->histogram);
+    free(metrics);
+}
+
+
+void janus_pubsub_metrics_in(janus_pubsub_metrics *metrics, int bytes) {
+    if (metrics == NULL) {
+        return;
+    }
+    janus_pubsub_metrics_slot *slot = &metrics->slots[janus_pubsub_metrics_slot_index()];
+    g_atomic_pointer_add(&slot->packets_in, 1);
+    g_atomic_pointer_add(&slot->bytes_in, bytes);
+}
+
+
+void janus_pubsub_metrics_out(janus_pubsub_metrics *metrics, int bytes) {
+    if (metrics == NULL) {
+        return;
+    }
+    janus_pubsub_metrics_slot *slot = &metrics->slots[janus_pubsub_metrics_slot_index()];
+    g_atomic_pointer_add(&slot->packets_out, 1);
+    g_atomic_pointer_add(&slot->bytes_out, bytes);
+}
+
+
+void janus_pubsub_metrics_drop(janus_pubsub_metrics *metrics, guint packets) {
+    if (metrics == NULL || packets == 0) {
+        return;
+    }
+    g_atomic_pointer_add(&metrics->slots[janus_pubsub_metrics_slot_index()].dropped, packets);
+}
+
+
+void janus_pubsub_metrics_error(janus_pubsub_metrics *metrics) {
+    if (metrics == NULL) {
+        return;
+    }
+    g_atomic_pointer_add(&metrics->slots[janus_pubsub_metrics_slot_index()].errors, 1);
+}
+
+
+/* Count how long relaying one packet took */
+void janus_pubsub_metrics_fanout(janus_pubsub_metrics *metrics, gint64 usec) {
+    if (metrics == NULL || metrics->histogram == NULL) {
+        return;
+    }
+    guint bucket = 0;
+    while (usec > 0 && bucket < JANUS_PUBSUB_METRICS_BUCKETS - 1) {
+        usec >>= 1;
+        bucket++;
+    }
+    g_atomic_pointer_add(&metrics->histogram[janus_pubsub_metrics_slot_index()].buckets[bucket], 1);
+}
+
+
+/* Add up the slots, the counts keep moving while they are read */
+void janus_pubsub_metrics_read(janus_pubsub_metrics *metrics, janus_pubsub_metrics_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (metrics == NULL) {
+        return;
+    }
+    guint i, j;
+    for (i = 0; i < JANUS_PUBSUB_METRICS_SLOTS; i++) {
+        janus_pubsub_metrics_slot *slot = &metrics->slots[i];
+        stats->packets_in += (gsize)g_atomic_pointer_get(&slot->packets_in);
+        stats->bytes_in += (gsize)g_atomic_pointer_get(&slot->bytes_in);
+        stats->packets_out += (gsize)g_atomic_pointer_get(&slot->packets_out);
+        stats->bytes_out += (gsize)g_atomic_pointer_get(&slot->bytes_out);
+        stats->dropped += (gsize)g_atomic_pointer_get(&slot->dropped);
+        stats->errors += (gsize)g_atomic_pointer_get(&slot->errors);
+        if (metrics->histogram != NULL) {
+            for (j = 0; j < JANUS_PUBSUB_METRICS_BUCKETS; j++) {
+                stats->fanout[j] += (gsize)g_atomic_pointer_get(&metrics->histogram[i].buckets[j]);
+            }
+        }
+    }
+}
+
+
+void janus_pubsub_metrics_add(janus_pubsub_metrics_stats *total, janus_pubsub_metrics_stats *stats) {
+    guint j;
+    total->packets_in += stats->packets_in;
+    total->bytes_in += stats->bytes_in;
+    total->packets_out += stats->packets_out;
+    total->bytes_out += stats->bytes_out;
+    total->dropped += stats->dropped;
+    total->errors += stats->errors;
+    for (j = 0; j < JANUS_PUBSUB_METRICS_BUCKETS; j++) {
+        total->fanout[j] += stats->fanout[j];
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib.h>
+
+/* Counter slots per object, threads beyond that share them */
+#define JANUS_PUBSUB_METRICS_SLOTS 8
+#define JANUS_PUBSUB_METRICS_CACHE_LINE 64
+/* Fan-out time buckets, bucket i counts packets relayed in under 2^i microseconds */
+#define JANUS_PUBSUB_METRICS_BUCKETS 16
+
+/* One thread's counters, alone on its cache line */
+typedef struct janus_pubsub_metrics_slot {
+    volatile gsize packets_in;
+    volatile gsize bytes_in;
+    volatile gsize packets_out;
+    volatile gsize bytes_out;
+    volatile gsize dropped;
+    volatile gsize errors;
+} __attribute__((aligned(JANUS_PUBSUB_METRICS_CACHE_LINE))) janus_pubsub_metrics_slot;
+
+typedef struct janus_pubsub_histogram_slot {
+    volatile gsize buckets[JANUS_PUBSUB_METRICS_BUCKETS];
+} __attribute__((aligned(JANUS_PUBSUB_METRICS_CACHE_LINE))) janus_pubsub_histogram_slot;
+
+/*
+ * Packet counters of a stream, subscriber or forwarder. Every thread
+ * updates the slot it was given, so the relay threads never write to the
+ * same cache line, and the slots are only added up when read.
+ */
+typedef struct janus_pubsub_metrics {
+    janus_pubsub_metrics_slot slots[JANUS_PUBSUB_METRICS_SLOTS];
+    janus_pubsub_histogram_slot *histogram;    /* Fan-out times, streams only */
+} janus_pubsub_metrics;
+
+typedef struct janus_pubsub_metrics_stats {
+    guint64 packets_in;
+    guint64 bytes_in;
+    guint64 packets_out;
+    guint64 bytes_out;
+    guint64 dropped;
+    guint64 errors;
+    guint64 fanout[JANUS_PUBSUB_METRICS_BUCKETS];
+} janus_pubsub_metrics_stats;
+
+janus_pubsub_metrics *janus_pubsub_metrics_new(gboolean histogram);
+void janus_pubsub_metrics_free(janus_pubsub_metrics *metrics);
+void janus_pubsub_metrics_in(janus_pubsub_metrics *metrics, int bytes);
+void janus_pubsub_metrics_out(janus_pubsub_metrics *metrics, int bytes);
+void janus_pubsub_metrics_drop(janus_pubsub_metrics *metrics, guint packets);
+void janus_pubsub_metrics_error(janus_pubsub_metrics *metrics);
+void janus_pubsub_metrics_fanout(janus_pubsub_metrics *metrics, gint64 usec);
+void janus_pubsub_metrics_read(janus_pubsub_metrics *metrics, janus_pubsub_metrics_stats *stats);
+void janus_pubsub_metrics_add(janus_pubsub_metrics_stats *total, janus_pubsub_metrics_stats *stats);
+
+#endif /* METRICS_H */
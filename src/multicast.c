@@ -0,0 +1,112 @@
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include <debug.h>
+
+#include "multicast.h"
+
+/* Options of multicast subscribers that don't give their own */
+static janus_pubsub_multicast_options defaults;
+
+
+/* An interface is given by address, or by name and then its first IPv4 address is used */
+static int janus_pubsub_multicast_iface(const char *iface, struct in_addr *address) {
+    if (inet_pton(AF_INET, iface, address) == 1) {
+        return 0;
+    }
+    struct ifaddrs *ifaddrs = NULL, *ifa;
+    if (getifaddrs(&ifaddrs) < 0) {
+        return -1;
+    }
+    int found = -1;
+    for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr != NULL && ifa->ifa_addr->sa_family == AF_INET && !strcmp(ifa->ifa_name, iface)) {
+            *address = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+            found = 0;
+            break;
+        }
+    }
+    freeifaddrs(ifaddrs);
+    return found;
+}
+
+
+void janus_pubsub_multicast_init(guint ttl, const char *iface, gboolean loopback) {
+    defaults.ttl = ttl > 255 ? 255 : ttl;
+    defaults.loopback = loopback;
+    defaults.iface.s_addr = htonl(INADDR_ANY);
+    if (iface != NULL && janus_pubsub_multicast_iface(iface, &defaults.iface) < 0) {
+        JANUS_LOG(LOG_WARN, "Unknown multicast interface %s, routing picks one\n", iface);
+        defaults.iface.s_addr = htonl(INADDR_ANY);
+    }
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &defaults.iface, address, sizeof(address));
+    JANUS_LOG(LOG_INFO, "PubSub multicast: ttl %u, interface %s, loopback %s\n",
+        defaults.ttl, address, defaults.loopback ? "on" : "off");
+}
+
+
+/* Whether host is an IPv4 multicast address */
+gboolean janus_pubsub_multicast_group(const char *host) {
+    struct in_addr address;
+    if (host == NULL || inet_pton(AF_INET, host, &address) != 1) {
+        return FALSE;
+    }
+    return IN_MULTICAST(ntohl(address.s_addr));
+}
+
+
+/*
+ * Options asked for by a subscriber, the configured ones where ttl or
+ * loopback are negative or iface is NULL. -1 if the interface is unknown.
+ */
+int janus_pubsub_multicast_options_get(janus_pubsub_multicast_options *options,
+        int ttl, const char *iface, int loopback) {
+    *options = defaults;
+    if (ttl >= 0) {
+        options->ttl = ttl > 255 ? 255 : ttl;
+    }
+    if (loopback >= 0) {
+        options->loopback = loopback ? TRUE : FALSE;
+    }
+    if (iface != NULL && janus_pubsub_multicast_iface(iface, &options->iface) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+gboolean janus_pubsub_multicast_options_equal(const janus_pubsub_multicast_options *a,
+        const janus_pubsub_multicast_options *b) {
+    return a->ttl == b->ttl && a->loopback == b->loopback && a->iface.s_addr == b->iface.s_addr;
+}
+
+
+/* A UDP socket sending to multicast groups with the given options, -1 on failure */
+int janus_pubsub_multicast_socket(const janus_pubsub_multicast_options *options) {
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        JANUS_LOG(LOG_ERR, "Could not open multicast socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unsigned char ttl = (unsigned char)options->ttl;
+    unsigned char loop = options->loopback ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+            (options->iface.s_addr != htonl(INADDR_ANY) &&
+             setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &options->iface, sizeof(options->iface)) < 0)) {
+        JANUS_LOG(LOG_ERR, "Could not set up multicast socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,30 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_MULTICAST_TTL 1           /* Hops, 1 keeps the group on the local network */
+#define PUBSUB_DEFAULT_MULTICAST_LOOPBACK FALSE  /* Members on this host don't get the packets */
+
+/*
+ * How a stream's multicast socket sends. A stream has one multicast
+ * socket, set up by its first multicast subscriber, and every group the
+ * stream is sent to goes out on it, so all of them share these options.
+ */
+typedef struct janus_pubsub_multicast_options {
+    guint ttl;
+    gboolean loopback;
+    struct in_addr iface;               /* Address of the outgoing interface, INADDR_ANY lets routing pick */
+} janus_pubsub_multicast_options;
+
+void janus_pubsub_multicast_init(guint ttl, const char *iface, gboolean loopback);
+gboolean janus_pubsub_multicast_group(const char *host);
+int janus_pubsub_multicast_options_get(janus_pubsub_multicast_options *options,
+        int ttl, const char *iface, int loopback);
+gboolean janus_pubsub_multicast_options_equal(const janus_pubsub_multicast_options *a,
+        const janus_pubsub_multicast_options *b);
+int janus_pubsub_multicast_socket(const janus_pubsub_multicast_options *options);
+
+#endif /* MULTICAST_H */
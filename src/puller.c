@@ -0,0 +1,125 @@
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include <debug.h>
+
+#include "puller.h"
+
+
+/* Allocate the puller's packet ring, a burst never wraps around it */
+void janus_pubsub_puller_buffers_init(janus_pubsub_puller *puller, guint batch_size, guint buffer_count) {
+    if (batch_size == 0) {
+        batch_size = PUBSUB_DEFAULT_PULL_BATCH_SIZE;
+    }
+    batch_size = MIN(batch_size, JANUS_PUBSUB_PULL_MAX_BATCH_SIZE);
+    buffer_count = MIN(buffer_count, JANUS_PUBSUB_PULL_MAX_BUFFER_COUNT);
+    if (buffer_count < batch_size) {
+        buffer_count = batch_size;
+    }
+    puller->batch_size = batch_size;
+    puller->buffer_count = buffer_count;
+    puller->next = 0;
+    puller->received = 0;
+    puller->buffers = g_malloc_n(buffer_count, JANUS_PUBSUB_PULL_MTU);
+    puller->lengths = g_malloc0_n(buffer_count, sizeof(int));
+#ifdef LINUX
+    puller->msgs = g_malloc0_n(batch_size, sizeof(struct mmsghdr));
+#endif
+    puller->iovs = g_malloc0_n(batch_size, sizeof(struct iovec));
+    puller->remotes = g_malloc0_n(batch_size, sizeof(struct sockaddr_in));
+}
+
+
+void janus_pubsub_puller_free(janus_pubsub_puller *puller) {
+    if (puller == NULL) {
+        return;
+    }
+    if (puller->pull_sock > 0) {
+        close(puller->pull_sock);
+    }
+    g_free(puller->buffers);
+    g_free(puller->lengths);
+#ifdef LINUX
+    g_free(puller->msgs);
+#endif
+    g_free(puller->iovs);
+    g_free(puller->remotes);
+    g_free(puller);
+}
+
+
+/*
+ * Read a burst of datagrams into the next slots of the ring without
+ * blocking, returns how many were read or -1 on error
+ */
+int janus_pubsub_puller_receive(janus_pubsub_puller *puller) {
+    /* The previous burst has been relayed, move past it */
+    puller->next += puller->received;
+    puller->received = 0;
+    if (puller->next + puller->batch_size > puller->buffer_count) {
+        puller->next = 0;
+    }
+    guint i;
+    for (i = 0; i < puller->batch_size; i++) {
+        puller->iovs[i].iov_base = puller->buffers + (puller->next + i) * JANUS_PUBSUB_PULL_MTU;
+        puller->iovs[i].iov_len = JANUS_PUBSUB_PULL_MTU;
+    }
+    int received = 0;
+#ifdef LINUX
+    for (i = 0; i < puller->batch_size; i++) {
+        struct msghdr *hdr = &puller->msgs[i].msg_hdr;
+        hdr->msg_name = &puller->remotes[i];
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+        hdr->msg_iov = &puller->iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+        hdr->msg_flags = 0;
+    }
+    do {
+        received = recvmmsg(puller->pull_sock, puller->msgs, puller->batch_size, MSG_DONTWAIT, NULL);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+        received = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    for (i = 0; i < (guint)MAX(received, 0); i++) {
+        puller->lengths[puller->next + i] = puller->msgs[i].msg_len;
+    }
+#else
+    while ((guint)received < puller->batch_size) {
+        socklen_t addrlen = sizeof(struct sockaddr_in);
+        int bytes = recvfrom(puller->pull_sock, puller->iovs[received].iov_base, JANUS_PUBSUB_PULL_MTU,
+            MSG_DONTWAIT, (struct sockaddr *)&puller->remotes[received], &addrlen);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (received == 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                received = -1;
+            }
+            break;
+        }
+        puller->lengths[puller->next + received] = bytes;
+        received++;
+    }
+#endif
+    puller->received = MAX(received, 0);
+    return received;
+}
+
+
+/* Packet i of the last burst, valid until the ring wraps around to it */
+char *janus_pubsub_puller_packet(janus_pubsub_puller *puller, guint i, int *len) {
+    guint slot = puller->next + i;
+    *len = puller->lengths[slot];
+    return puller->buffers + slot * JANUS_PUBSUB_PULL_MTU;
+}
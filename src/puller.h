@@ -4,14 +4,41 @@
 #include <glib.h>
 #include <netinet/in.h>
 
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_PULL_BATCH_SIZE 16     /* Datagrams per recvmmsg call */
+#define PUBSUB_DEFAULT_PULL_BUFFER_COUNT 64   /* Packet buffers in a puller's ring */
+
+#define JANUS_PUBSUB_PULL_MTU 1500
+/* Publishes asking for more are clamped, the ring is allocated per socket */
+#define JANUS_PUBSUB_PULL_MAX_BATCH_SIZE 1024
+#define JANUS_PUBSUB_PULL_MAX_BUFFER_COUNT 8192
+
+struct jansus_pubsub_stream;
+
 typedef struct janus_pubsub_puller {
+    struct jansus_pubsub_stream *stream;  /* Stream the packets are relayed to */
     gboolean is_video;
     gboolean is_data;
     int pull_sock;                      /* The udp socket to stream rtp packets from */
     uint32_t ssrc;
     int payload_type;
     struct sockaddr_in serv_addr;
+    guint batch_size;                   /* Datagrams read per call */
+    guint buffer_count;                 /* Packet buffers in the ring */
+    guint next;                         /* Ring slot the next burst is read into */
+    guint received;                     /* Datagrams in the last burst */
+    char *buffers;                      /* Pre-allocated ring of packet buffers */
+    int *lengths;
+#ifdef LINUX
+    struct mmsghdr *msgs;
+#endif
+    struct iovec *iovs;
+    struct sockaddr_in *remotes;
 } janus_pubsub_puller;
 
+void janus_pubsub_puller_buffers_init(janus_pubsub_puller *puller, guint batch_size, guint buffer_count);
+void janus_pubsub_puller_free(janus_pubsub_puller *puller);
+int janus_pubsub_puller_receive(janus_pubsub_puller *puller);
+char *janus_pubsub_puller_packet(janus_pubsub_puller *puller, guint i, int *len);
 
 #endif /* PULLER_H */
@@ -0,0 +1,404 @@
+#ifdef LINUX
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#else
+#include <sys/poll.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <mutex.h>
+
+#include "reactor.h"
+#include "puller.h"
+#include "batch.h"
+
+/*
+ * Pull reactors. A small fixed pool of threads waits on the pull sockets
+ * of every pulled stream, with epoll on Linux and poll elsewhere. Streams
+ * are spread over the reactors and (un)registered through a command queue
+ * the reactor itself processes between wakeups, so a stream is never
+ * released while its packets are being relayed. On Linux the pull sockets
+ * join the epoll set when the stream is added, so a failure reaches the
+ * publish request.
+ */
+
+/* Bursts read from one socket per wakeup, so a busy socket can't starve the others */
+#define JANUS_PUBSUB_PULL_MAX_BURSTS 4
+#define JANUS_PUBSUB_REACTOR_EVENTS 64
+
+typedef enum janus_pubsub_reactor_op {
+    JANUS_PUBSUB_REACTOR_ADD,
+    JANUS_PUBSUB_REACTOR_REMOVE,
+} janus_pubsub_reactor_op;
+
+typedef struct janus_pubsub_reactor_command {
+    janus_pubsub_reactor_op op;
+    janus_pubsub_stream *stream;
+} janus_pubsub_reactor_command;
+
+typedef struct janus_pubsub_reactor {
+    guint index;
+    GThread *thread;
+    GAsyncQueue *commands;
+    int wakeup[2];                      /* Pipe used to interrupt the wait */
+    volatile gint streams;              /* Registered streams, to spread the load */
+    GList *registered;                  /* Streams this reactor owns a reference on */
+#ifdef LINUX
+    int epfd;
+#endif
+} janus_pubsub_reactor;
+
+static janus_pubsub_reactor *reactors;
+static guint reactors_count;
+static volatile gint reactors_stopping;
+
+
+static int janus_pubsub_stream_pullers(janus_pubsub_stream *stream, janus_pubsub_puller **pullers) {
+    int num = 0;
+    if (stream->audio_puller != NULL) {
+        pullers[num++] = stream->audio_puller;
+    }
+    if (stream->video_puller != NULL) {
+        pullers[num++] = stream->video_puller;
+    }
+    if (stream->data_puller != NULL) {
+        pullers[num++] = stream->data_puller;
+    }
+    return num;
+}
+
+
+/* Read what is waiting on a pull socket and relay it */
+static void janus_pubsub_reactor_pull(janus_pubsub_puller *puller) {
+    janus_pubsub_stream *stream = puller->stream;
+    int k, j, bytes, received;
+    if (stream->destroyed) {
+        return;
+    }
+    for (k = 0; k < JANUS_PUBSUB_PULL_MAX_BURSTS; k++) {
+        received = janus_pubsub_puller_receive(puller);
+        if (received < 0) {
+            JANUS_LOG(LOG_ERR, "[%s] Error reading pull socket... %d (%s)\n", stream->name, errno, strerror(errno));
+            break;
+        }
+        if (received == 0) {
+            break;
+        }
+        JANUS_LOG(LOG_VERB, "Puller received %d packets\n", received);
+        for (j = 0; j < received; j++) {
+            char *buffer = janus_pubsub_puller_packet(puller, j, &bytes);
+            if (puller->is_data) {
+                stream->relay_data((void *)stream, buffer, bytes);
+            } else {
+                stream->relay_rtp((void *)stream, puller->is_video, buffer, bytes);
+            }
+        }
+        if ((guint)received < puller->batch_size) {
+            break;
+        }
+    }
+}
+
+
+#ifdef LINUX
+/* Add the stream's pull sockets to the epoll set, all of them or none */
+static int janus_pubsub_reactor_watch(janus_pubsub_reactor *reactor, janus_pubsub_stream *stream) {
+    janus_pubsub_puller *pullers[3];
+    int i, j, num = janus_pubsub_stream_pullers(stream, pullers);
+    for (i = 0; i < num; i++) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = pullers[i];
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, pullers[i]->pull_sock, &event) < 0) {
+            JANUS_LOG(LOG_ERR, "[%s] Error registering pull socket... %d (%s)\n", stream->name, errno, strerror(errno));
+            for (j = 0; j < i; j++) {
+                epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, pullers[j]->pull_sock, NULL);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+
+/* The reactor takes over the reference of the stream, its sockets are already watched */
+static void janus_pubsub_reactor_register(janus_pubsub_reactor *reactor, janus_pubsub_stream *stream) {
+    reactor->registered = g_list_prepend(reactor->registered, stream);
+    JANUS_LOG(LOG_INFO, "[%s] Pulling on reactor %u\n", stream->name, reactor->index);
+}
+
+
+static void janus_pubsub_reactor_unregister(janus_pubsub_reactor *reactor, janus_pubsub_stream *stream) {
+    GList *link = g_list_find(reactor->registered, stream);
+    if (link == NULL) {
+        return;
+    }
+#ifdef LINUX
+    janus_pubsub_puller *pullers[3];
+    int i, num = janus_pubsub_stream_pullers(stream, pullers);
+    for (i = 0; i < num; i++) {
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, pullers[i]->pull_sock, NULL);
+    }
+#endif
+    reactor->registered = g_list_delete_link(reactor->registered, link);
+    g_atomic_int_add(&reactor->streams, -1);
+    JANUS_LOG(LOG_INFO, "[%s] Stopped pulling on reactor %u\n", stream->name, reactor->index);
+    janus_pubsub_stream_unref(stream);
+}
+
+
+static void janus_pubsub_reactor_commands(janus_pubsub_reactor *reactor) {
+    janus_pubsub_reactor_command *command = NULL;
+    while ((command = g_async_queue_try_pop(reactor->commands)) != NULL) {
+        if (command->op == JANUS_PUBSUB_REACTOR_ADD) {
+            janus_pubsub_reactor_register(reactor, command->stream);
+        } else {
+            janus_pubsub_reactor_unregister(reactor, command->stream);
+            /* Drop the reference that came with the command */
+            janus_pubsub_stream_unref(command->stream);
+        }
+        g_free(command);
+    }
+}
+
+
+static void janus_pubsub_reactor_drain_wakeup(janus_pubsub_reactor *reactor) {
+    char buf[64];
+    while (read(reactor->wakeup[0], buf, sizeof(buf)) > 0);
+}
+
+
+static void *janus_pubsub_reactor_thread(void *data) {
+    janus_pubsub_reactor *reactor = (janus_pubsub_reactor *)data;
+    JANUS_LOG(LOG_VERB, "Joining PubSub pull reactor %u\n", reactor->index);
+#ifdef LINUX
+    struct epoll_event events[JANUS_PUBSUB_REACTOR_EVENTS];
+    while (!g_atomic_int_get(&reactors_stopping)) {
+        int i, num = epoll_wait(reactor->epfd, events, JANUS_PUBSUB_REACTOR_EVENTS, 1000);
+        if (num < 0 && errno != EINTR) {
+            JANUS_LOG(LOG_ERR, "Error waiting on pull reactor %u... %d (%s)\n", reactor->index, errno, strerror(errno));
+            break;
+        }
+        for (i = 0; i < num; i++) {
+            if (events[i].data.ptr == NULL) {
+                janus_pubsub_reactor_drain_wakeup(reactor);
+                continue;
+            }
+            janus_pubsub_puller *puller = events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                JANUS_LOG(LOG_ERR, "[%s] Error polling: %s...\n", puller->stream->name,
+                    events[i].events & EPOLLERR ? "EPOLLERR" : "EPOLLHUP");
+                continue;
+            }
+            janus_pubsub_reactor_pull(puller);
+        }
+        /* Send the forwarder datagrams collected during this wakeup */
+        janus_pubsub_batch_flush_current();
+        /* Only now can registrations change, no event refers to them anymore */
+        janus_pubsub_reactor_commands(reactor);
+    }
+#else
+    GArray *fds = g_array_new(FALSE, TRUE, sizeof(struct pollfd));
+    GPtrArray *pullers = g_ptr_array_new();
+    while (!g_atomic_int_get(&reactors_stopping)) {
+        /* Rebuild the poll set from the registered streams */
+        g_array_set_size(fds, 1);
+        g_ptr_array_set_size(pullers, 1);
+        struct pollfd *wake = &g_array_index(fds, struct pollfd, 0);
+        wake->fd = reactor->wakeup[0];
+        wake->events = POLLIN;
+        wake->revents = 0;
+        GList *l;
+        for (l = reactor->registered; l; l = l->next) {
+            janus_pubsub_puller *stream_pullers[3];
+            int i, num = janus_pubsub_stream_pullers((janus_pubsub_stream *)l->data, stream_pullers);
+            for (i = 0; i < num; i++) {
+                struct pollfd pfd = { stream_pullers[i]->pull_sock, POLLIN, 0 };
+                g_array_append_val(fds, pfd);
+                g_ptr_array_add(pullers, stream_pullers[i]);
+            }
+        }
+        int i, num = poll((struct pollfd *)fds->data, fds->len, 1000);
+        if (num < 0 && errno != EINTR) {
+            JANUS_LOG(LOG_ERR, "Error polling on pull reactor %u... %d (%s)\n", reactor->index, errno, strerror(errno));
+            break;
+        }
+        for (i = 0; num > 0 && i < (int)fds->len; i++) {
+            struct pollfd *pfd = &g_array_index(fds, struct pollfd, i);
+            if (i == 0) {
+                if (pfd->revents & POLLIN) {
+                    janus_pubsub_reactor_drain_wakeup(reactor);
+                }
+                continue;
+            }
+            if (pfd->revents & (POLLERR | POLLHUP)) {
+                continue;
+            }
+            if (pfd->revents & POLLIN) {
+                janus_pubsub_reactor_pull(g_ptr_array_index(pullers, i));
+            }
+        }
+        janus_pubsub_batch_flush_current();
+        janus_pubsub_reactor_commands(reactor);
+    }
+    g_array_free(fds, TRUE);
+    g_ptr_array_free(pullers, TRUE);
+#endif
+    JANUS_LOG(LOG_VERB, "Leaving PubSub pull reactor %u\n", reactor->index);
+    return NULL;
+}
+
+
+/* Release what a reactor was set up with, once its thread is gone or never started */
+static void janus_pubsub_reactor_close(janus_pubsub_reactor *reactor) {
+    if (reactor->commands != NULL) {
+        g_async_queue_unref(reactor->commands);
+        reactor->commands = NULL;
+    }
+#ifdef LINUX
+    close(reactor->epfd);
+#endif
+    close(reactor->wakeup[0]);
+    close(reactor->wakeup[1]);
+}
+
+
+int janus_pubsub_reactors_init(guint count) {
+    if (count == 0) {
+        count = PUBSUB_DEFAULT_PULL_REACTORS;
+    }
+    g_atomic_int_set(&reactors_stopping, 0);
+    reactors = g_malloc0(count * sizeof(janus_pubsub_reactor));
+    reactors_count = 0;
+    guint i;
+    for (i = 0; i < count; i++) {
+        janus_pubsub_reactor *reactor = &reactors[i];
+        reactor->index = i;
+        if (pipe(reactor->wakeup) < 0) {
+            JANUS_LOG(LOG_ERR, "Error creating pull reactor pipe... %d (%s)\n", errno, strerror(errno));
+            break;
+        }
+        fcntl(reactor->wakeup[0], F_SETFL, fcntl(reactor->wakeup[0], F_GETFL, 0) | O_NONBLOCK);
+#ifdef LINUX
+        reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epfd < 0) {
+            JANUS_LOG(LOG_ERR, "Error creating pull reactor epoll... %d (%s)\n", errno, strerror(errno));
+            close(reactor->wakeup[0]);
+            close(reactor->wakeup[1]);
+            break;
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakeup[0], &event) < 0) {
+            JANUS_LOG(LOG_ERR, "Error watching pull reactor pipe... %d (%s)\n", errno, strerror(errno));
+            janus_pubsub_reactor_close(reactor);
+            break;
+        }
+#endif
+        reactor->commands = g_async_queue_new();
+        GError *error = NULL;
+        char tname[16];
+        g_snprintf(tname, sizeof(tname), "pubsub pull %u", i);
+        reactor->thread = g_thread_try_new(tname, &janus_pubsub_reactor_thread, reactor, &error);
+        if (error != NULL) {
+            JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch a PubSub pull reactor...\n",
+                error->code, error->message ? error->message : "??");
+            g_error_free(error);
+            janus_pubsub_reactor_close(reactor);
+            break;
+        }
+        reactors_count++;
+    }
+    if (reactors_count == 0) {
+        g_free(reactors);
+        reactors = NULL;
+        return -1;
+    }
+    JANUS_LOG(LOG_INFO, "PubSub pull reactors: %u\n", reactors_count);
+    return 0;
+}
+
+
+void janus_pubsub_reactors_destroy(void) {
+    g_atomic_int_set(&reactors_stopping, 1);
+    guint i;
+    for (i = 0; i < reactors_count; i++) {
+        janus_pubsub_reactor *reactor = &reactors[i];
+        if (write(reactor->wakeup[1], "x", 1) < 0) {
+            JANUS_LOG(LOG_WARN, "Error waking up pull reactor %u\n", i);
+        }
+        g_thread_join(reactor->thread);
+        janus_pubsub_reactor_commands(reactor);
+        while (reactor->registered != NULL) {
+            janus_pubsub_reactor_unregister(reactor, reactor->registered->data);
+        }
+        janus_pubsub_reactor_close(reactor);
+    }
+    g_free(reactors);
+    reactors = NULL;
+    reactors_count = 0;
+}
+
+
+static void janus_pubsub_reactor_push(janus_pubsub_reactor *reactor, janus_pubsub_reactor_op op,
+        janus_pubsub_stream *stream) {
+    janus_pubsub_reactor_command *command = g_malloc0(sizeof(janus_pubsub_reactor_command));
+    command->op = op;
+    command->stream = stream;
+    g_async_queue_push(reactor->commands, command);
+    if (write(reactor->wakeup[1], "x", 1) < 0) {
+        JANUS_LOG(LOG_WARN, "Error waking up pull reactor %u\n", reactor->index);
+    }
+}
+
+
+/* Start pulling a stream on the least loaded reactor, the reactor keeps a reference */
+int janus_pubsub_reactor_add_stream(janus_pubsub_stream *stream) {
+    if (reactors_count == 0 || g_atomic_int_get(&reactors_stopping)) {
+        return -1;
+    }
+    guint i, best = 0;
+    for (i = 1; i < reactors_count; i++) {
+        if (g_atomic_int_get(&reactors[i].streams) < g_atomic_int_get(&reactors[best].streams)) {
+            best = i;
+        }
+    }
+    janus_pubsub_puller *pullers[3];
+    int num = janus_pubsub_stream_pullers(stream, pullers);
+    for (i = 0; i < (guint)num; i++) {
+        pullers[i]->stream = stream;
+    }
+#ifdef LINUX
+    if (janus_pubsub_reactor_watch(&reactors[best], stream) < 0) {
+        /* A wakeup may still hold events of the sockets we took back, let the reactor release it */
+        janus_pubsub_stream_ref(stream);
+        janus_pubsub_reactor_push(&reactors[best], JANUS_PUBSUB_REACTOR_REMOVE, stream);
+        return -1;
+    }
+#endif
+    stream->reactor = best;
+    g_atomic_int_inc(&reactors[best].streams);
+    janus_pubsub_stream_ref(stream);
+    janus_pubsub_reactor_push(&reactors[best], JANUS_PUBSUB_REACTOR_ADD, stream);
+    return 0;
+}
+
+
+/* Stop pulling a stream, its reactor drops its reference once no packet of it is in flight */
+void janus_pubsub_reactor_remove_stream(janus_pubsub_stream *stream) {
+    if (reactors_count == 0 || stream->reactor < 0 || (guint)stream->reactor >= reactors_count) {
+        return;
+    }
+    janus_pubsub_stream_ref(stream);
+    janus_pubsub_reactor_push(&reactors[stream->reactor], JANUS_PUBSUB_REACTOR_REMOVE, stream);
+}
@@ -0,0 +1,16 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <glib.h>
+
+#include "stream.h"
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_PULL_REACTORS 2
+
+int janus_pubsub_reactors_init(guint count);
+void janus_pubsub_reactors_destroy(void);
+int janus_pubsub_reactor_add_stream(janus_pubsub_stream *stream);
+void janus_pubsub_reactor_remove_stream(janus_pubsub_stream *stream);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <mutex.h>
+#include <record.h>
+#include <utils.h>
+
+#include "recording.h"
+
+/*
+ * Recording writer. One thread wakes up every flush interval, drains the
+ * ring of every stream being recorded into its recorders and flushes the
+ * files. A recording is stopped once the relay threads can't reach it
+ * anymore, and closed by the writer on its next pass.
+ */
+
+static GThread *writer;
+static GAsyncQueue *writer_wakeup;
+static janus_mutex recordings_mutex;
+static GList *recordings;
+static guint record_buffer_size;
+static gint64 record_flush_interval;
+static gint writer_exit;
+
+
+/* Write out what is in the ring, on the writer thread */
+static void janus_pubsub_recording_drain(janus_pubsub_recording *recording) {
+    guint mask = recording->size - 1;
+    for (;;) {
+        janus_pubsub_record_slot *slot = &recording->slots[(guint)recording->dequeue_pos & mask];
+        gint seq = g_atomic_int_get(&slot->seq);
+        if ((gint)((guint)seq - ((guint)recording->dequeue_pos + 1)) < 0) {
+            /* Empty, or the producer of the next slot is still copying */
+            break;
+        }
+        janus_recorder *recorder = recording->recorders[slot->kind];
+        if (recorder != NULL) {
+            janus_recorder_save_frame(recorder, slot->buf, slot->len);
+            recording->written++;
+            recording->bytes += slot->len;
+        }
+        g_atomic_int_set(&slot->seq, (gint)((guint)recording->dequeue_pos + recording->size));
+        recording->dequeue_pos = (gint)((guint)recording->dequeue_pos + 1);
+    }
+}
+
+
+static void janus_pubsub_recording_flush(janus_pubsub_recording *recording) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        janus_recorder *recorder = recording->recorders[i];
+        if (recorder != NULL && recorder->file != NULL) {
+            fflush(recorder->file);
+        }
+    }
+}
+
+
+static void janus_pubsub_recording_free(janus_pubsub_recording *recording) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (recording->recorders[i] != NULL) {
+            janus_recorder_close(recording->recorders[i]);
+            janus_recorder_free(recording->recorders[i]);
+        }
+    }
+    JANUS_LOG(LOG_INFO, "Recording closed, %"G_GUINT64_FORMAT" packets written, %d dropped\n",
+        recording->written, g_atomic_int_get(&recording->dropped));
+    g_free(recording->slots);
+    g_free(recording);
+}
+
+
+static void *janus_pubsub_recording_writer(void *data) {
+    JANUS_LOG(LOG_VERB, "Joining PubSub recording writer\n");
+    while (!g_atomic_int_get(&writer_exit)) {
+        g_async_queue_timeout_pop(writer_wakeup, record_flush_interval);
+        janus_mutex_lock(&recordings_mutex);
+        GList *current = g_list_copy(recordings);
+        janus_mutex_unlock(&recordings_mutex);
+        GList *l;
+        for (l = current; l != NULL; l = l->next) {
+            janus_pubsub_recording *recording = l->data;
+            janus_pubsub_recording_drain(recording);
+            janus_pubsub_recording_flush(recording);
+            janus_mutex_lock(&recordings_mutex);
+            gboolean expired = recording->stopped > 0;
+            if (expired) {
+                recordings = g_list_remove(recordings, recording);
+            }
+            janus_mutex_unlock(&recordings_mutex);
+            if (expired) {
+                janus_pubsub_recording_drain(recording);
+                janus_pubsub_recording_free(recording);
+            }
+        }
+        g_list_free(current);
+    }
+    JANUS_LOG(LOG_VERB, "Leaving PubSub recording writer\n");
+    return NULL;
+}
+
+
+int janus_pubsub_recordings_init(guint buffer_size, guint flush_interval) {
+    /* The ring indexes with a mask */
+    record_buffer_size = 1;
+    while (record_buffer_size < MAX(buffer_size, 2)) {
+        record_buffer_size <<= 1;
+    }
+    record_flush_interval = (gint64)(flush_interval > 0 ? flush_interval : PUBSUB_DEFAULT_RECORD_FLUSH_INTERVAL) * 1000;
+    janus_mutex_init(&recordings_mutex);
+    recordings = NULL;
+    g_atomic_int_set(&writer_exit, 0);
+    writer_wakeup = g_async_queue_new();
+    GError *error = NULL;
+    writer = g_thread_try_new("pubsub recorder", &janus_pubsub_recording_writer, NULL, &error);
+    if (error != NULL) {
+        JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the PubSub recording writer...\n",
+            error->code, error->message ? error->message : "??");
+        g_error_free(error);
+        writer = NULL;
+        return -1;
+    }
+    JANUS_LOG(LOG_INFO, "PubSub recording: %u packets buffered, written every %u ms\n",
+        record_buffer_size, (guint)(record_flush_interval / 1000));
+    return 0;
+}
+
+
+void janus_pubsub_recordings_destroy(void) {
+    if (writer != NULL) {
+        g_atomic_int_set(&writer_exit, 1);
+        g_async_queue_push(writer_wakeup, GINT_TO_POINTER(1));
+        g_thread_join(writer);
+        writer = NULL;
+    }
+    /* Nothing relays anymore, write what is left */
+    janus_mutex_lock(&recordings_mutex);
+    GList *l;
+    for (l = recordings; l != NULL; l = l->next) {
+        janus_pubsub_recording_drain(l->data);
+        janus_pubsub_recording_free(l->data);
+    }
+    g_list_free(recordings);
+    recordings = NULL;
+    janus_mutex_unlock(&recordings_mutex);
+    g_async_queue_unref(writer_wakeup);
+    writer_wakeup = NULL;
+}
+
+
+/* Start writing packets into the given recorders, which the recording now owns */
+janus_pubsub_recording *janus_pubsub_recording_start(janus_recorder *audio, janus_recorder *video,
+        janus_recorder *data) {
+    if (writer == NULL) {
+        return NULL;
+    }
+    janus_pubsub_recording *recording = g_malloc0(sizeof(janus_pubsub_recording));
+    recording->recorders[JANUS_PUBSUB_RECORD_AUDIO] = audio;
+    recording->recorders[JANUS_PUBSUB_RECORD_VIDEO] = video;
+    recording->recorders[JANUS_PUBSUB_RECORD_DATA] = data;
+    recording->size = record_buffer_size;
+    recording->slots = g_malloc(recording->size * sizeof(janus_pubsub_record_slot));
+    guint i;
+    for (i = 0; i < recording->size; i++) {
+        g_atomic_int_set(&recording->slots[i].seq, (gint)i);
+    }
+    janus_mutex_lock(&recordings_mutex);
+    recordings = g_list_prepend(recordings, recording);
+    janus_mutex_unlock(&recordings_mutex);
+    return recording;
+}
+
+
+/* Nothing pushes anymore, retired through the epoch, the writer closes it next */
+void janus_pubsub_recording_stop(janus_pubsub_recording *recording) {
+    if (recording == NULL) {
+        return;
+    }
+    janus_mutex_lock(&recordings_mutex);
+    if (recording->stopped == 0) {
+        recording->stopped = janus_get_monotonic_time();
+    }
+    janus_mutex_unlock(&recordings_mutex);
+}
+
+
+/* Copy a packet into the ring, from any relay thread, without locking */
+void janus_pubsub_recording_push(janus_pubsub_recording *recording, janus_pubsub_record_kind kind,
+        char *buf, int len) {
+    if (recording->recorders[kind] == NULL) {
+        return;
+    }
+    if (len <= 0 || len > JANUS_PUBSUB_RECORD_MTU) {
+        g_atomic_int_inc(&recording->dropped);
+        return;
+    }
+    guint mask = recording->size - 1;
+    janus_pubsub_record_slot *slot = NULL;
+    gint pos = g_atomic_int_get(&recording->enqueue_pos);
+    for (;;) {
+        slot = &recording->slots[(guint)pos & mask];
+        gint seq = g_atomic_int_get(&slot->seq);
+        gint dif = (gint)((guint)seq - (guint)pos);
+        if (dif == 0) {
+            /* Our turn for this slot, claim it */
+            if (g_atomic_int_compare_and_exchange(&recording->enqueue_pos, pos, (gint)((guint)pos + 1))) {
+                break;
+            }
+            pos = g_atomic_int_get(&recording->enqueue_pos);
+        } else if (dif < 0) {
+            /* Full, the disk is behind */
+            g_atomic_int_inc(&recording->dropped);
+            return;
+        } else {
+            pos = g_atomic_int_get(&recording->enqueue_pos);
+        }
+    }
+    slot->kind = kind;
+    slot->len = len;
+    memcpy(slot->buf, buf, len);
+    g_atomic_int_set(&slot->seq, (gint)((guint)pos + 1));
+}
+
+
+void janus_pubsub_recording_get_stats(janus_pubsub_recording *recording, janus_pubsub_recording_stats *stats) {
+    stats->written = recording->written;
+    stats->bytes = recording->bytes;
+    stats->dropped = g_atomic_int_get(&recording->dropped);
+}
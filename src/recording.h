@@ -0,0 +1,65 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <glib.h>
+
+/* janus includes */
+#include <record.h>
+
+/* Plugin config defaults */
+#define PUBSUB_DEFAULT_RECORD_BUFFER_SIZE 1024   /* Packets buffered per recorded stream */
+#define PUBSUB_DEFAULT_RECORD_FLUSH_INTERVAL 200 /* Milliseconds between writer runs */
+
+#define JANUS_PUBSUB_RECORD_MTU 1500
+/* Characters a recording name may have, so it never leaves record_dir */
+#define JANUS_PUBSUB_RECORD_NAME_CHARS \
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-"
+
+typedef enum janus_pubsub_record_kind {
+    JANUS_PUBSUB_RECORD_AUDIO = 0,
+    JANUS_PUBSUB_RECORD_VIDEO,
+    JANUS_PUBSUB_RECORD_DATA,
+} janus_pubsub_record_kind;
+
+/* Slot of the packet ring, seq tells producers and the writer whose turn it is */
+typedef struct janus_pubsub_record_slot {
+    volatile gint seq;
+    int kind;
+    int len;
+    char buf[JANUS_PUBSUB_RECORD_MTU];
+} janus_pubsub_record_slot;
+
+/*
+ * A stream being recorded. The relay threads copy packets into a bounded
+ * lock-free ring, the writer thread drains it every flush interval into
+ * the owner session's recorders, so no file I/O happens on ingress. A
+ * packet that finds the ring full is dropped and counted.
+ */
+typedef struct janus_pubsub_recording {
+    janus_recorder *recorders[3];       /* By janus_pubsub_record_kind, NULL if not recorded */
+    guint size;                         /* Slots, a power of two */
+    janus_pubsub_record_slot *slots;
+    volatile gint enqueue_pos;
+    gint dequeue_pos;                   /* Writer only */
+    gint64 stopped;                     /* When it was stopped, 0 while recording */
+    volatile gint dropped;
+    guint64 written;                    /* Writer only */
+    guint64 bytes;                      /* Writer only */
+} janus_pubsub_recording;
+
+typedef struct janus_pubsub_recording_stats {
+    guint64 written;
+    guint64 bytes;
+    guint dropped;
+} janus_pubsub_recording_stats;
+
+int janus_pubsub_recordings_init(guint buffer_size, guint flush_interval);
+void janus_pubsub_recordings_destroy(void);
+janus_pubsub_recording *janus_pubsub_recording_start(janus_recorder *audio, janus_recorder *video,
+        janus_recorder *data);
+void janus_pubsub_recording_stop(janus_pubsub_recording *recording);
+void janus_pubsub_recording_push(janus_pubsub_recording *recording, janus_pubsub_record_kind kind,
+        char *buf, int len);
+void janus_pubsub_recording_get_stats(janus_pubsub_recording *recording, janus_pubsub_recording_stats *stats);
+
+#endif /* RECORDING_H */
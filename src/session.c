@@ -6,25 +6,69 @@
 
 #include "janus_pubsub.h"
 #include "session.h"
+#include "subscriber.h"
 #include "stream.h"
+#include "reactor.h"
+#include "epoch.h"
+#include "cascade.h"
+
+/*
+ * Sessions registry, split in stripes by handle so the transport threads
+ * creating, destroying and looking up sessions rarely wait on each other.
+ * Each stripe has its own lock and table, on its own cache line.
+ */
+typedef struct janus_pubsub_session_stripe {
+    janus_mutex mutex;
+    GHashTable *sessions;
+} __attribute__((aligned(JANUS_PUBSUB_SESSION_CACHE_LINE))) janus_pubsub_session_stripe;
+
+static janus_pubsub_session_stripe stripes[JANUS_PUBSUB_SESSION_STRIPES];
+
+
+/* Spread handles over stripes and shards, they are aligned allocations */
+guint janus_pubsub_session_hash(janus_plugin_session *handle) {
+    guint64 h = (guint64)GPOINTER_TO_SIZE(handle);
+    h ^= h >> 33;
+    h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    return (guint)h;
+}
+
+
+static janus_pubsub_session_stripe *janus_pubsub_session_stripe_get(janus_plugin_session *handle) {
+    return &stripes[janus_pubsub_session_hash(handle) % JANUS_PUBSUB_SESSION_STRIPES];
+}
 
-static GHashTable *sessions;
 
 void janus_pubsub_sessions_init(void) {
-    sessions = g_hash_table_new(NULL, NULL);
+    guint i;
+    for (i = 0; i < JANUS_PUBSUB_SESSION_STRIPES; i++) {
+        janus_mutex_init(&stripes[i].mutex);
+        stripes[i].sessions = g_hash_table_new(NULL, NULL);
+    }
 }
 
 void janus_pubsub_sessions_destroy(void) {
-    g_hash_table_destroy(sessions);
-    sessions = NULL;
+    guint i;
+    for (i = 0; i < JANUS_PUBSUB_SESSION_STRIPES; i++) {
+        janus_mutex_lock(&stripes[i].mutex);
+        g_hash_table_destroy(stripes[i].sessions);
+        stripes[i].sessions = NULL;
+        janus_mutex_unlock(&stripes[i].mutex);
+    }
 }
 
+/* Session of a handle, valid until the caller leaves its epoch critical section */
 janus_pubsub_session *janus_pubsub_session_get(janus_plugin_session *handle) {
-    return g_hash_table_lookup(sessions, handle);
+    janus_pubsub_session_stripe *stripe = janus_pubsub_session_stripe_get(handle);
+    janus_mutex_lock(&stripe->mutex);
+    janus_pubsub_session *session = stripe->sessions ? g_hash_table_lookup(stripe->sessions, handle) : NULL;
+    janus_mutex_unlock(&stripe->mutex);
+    return session;
 }
 
 gboolean janus_pubsub_has_session(janus_plugin_session *handle) {
-    return g_hash_table_contains(sessions, handle);
+    return janus_pubsub_session_get(handle) != NULL;
 }
 
 void janus_pubsub_create_session(janus_plugin_session *handle, int *error) {
@@ -43,16 +87,18 @@ void janus_pubsub_create_session(janus_plugin_session *handle, int *error) {
     session->has_data = FALSE;
     session->audio_active = FALSE;
     session->video_active = FALSE;
-    session->stream_name = NULL;
+    session->stream = NULL;
     session->sub_id = 0;
     janus_mutex_init(&session->rec_mutex);
     session->bitrate = 0;    /* No limit */
     session->destroyed = 0;
     g_atomic_int_set(&session->hangingup, 0);
+    g_atomic_int_set(&session->ref, 1);
     handle->plugin_handle = session;
-    janus_mutex_lock(&pubsub_sessions_mutex);
-    g_hash_table_insert(sessions, handle, session);
-    janus_mutex_unlock(&pubsub_sessions_mutex);
+    janus_pubsub_session_stripe *stripe = janus_pubsub_session_stripe_get(handle);
+    janus_mutex_lock(&stripe->mutex);
+    g_hash_table_insert(stripe->sessions, handle, session);
+    janus_mutex_unlock(&stripe->mutex);
     JANUS_LOG(LOG_INFO, "PubSub Session created.\n");
 }
 
@@ -68,52 +114,81 @@ void janus_pubsub_destroy_session(janus_plugin_session *handle, int *error) {
         return;
     }
     JANUS_LOG(LOG_INFO, "Removing PubSub session...\n");
-    janus_mutex_lock(&pubsub_sessions_mutex);
-    JANUS_LOG(LOG_INFO, "Sessions locked\n");
-    if(!session->destroyed) {
-        janus_mutex_lock(&pubsub_streams_mutex);
-        if (session->stream_name != NULL) {
-            //janus_pubsub_stream *stream = g_hash_table_lookup(pubsub_streams, session->stream_name);
-            janus_pubsub_stream *stream = janus_pubsub_stream_get(session->stream_name);
-            if (!stream || stream->destroyed) {
-                 JANUS_LOG(LOG_ERR, "Streams hashtable lookup failed...\n");
-                 *error = -2;
-                 janus_mutex_unlock(&pubsub_streams_mutex);
-                 janus_mutex_unlock(&pubsub_sessions_mutex);
-                 return;
+    /* Only the call that takes the session out of its stripe tears it down */
+    janus_pubsub_session_stripe *stripe = janus_pubsub_session_stripe_get(handle);
+    janus_mutex_lock(&stripe->mutex);
+    gboolean removed = g_hash_table_remove(stripe->sessions, handle);
+    if (removed) {
+        session->destroyed = janus_get_monotonic_time();
+    }
+    janus_mutex_unlock(&stripe->mutex);
+    if(removed) {
+        janus_pubsub_stream *stream = session->stream;
+        if (stream != NULL && stream->owner == session) {
+            if (stream->publisher == session) {
+                /* Relay threads reach the publisher through the stream, unlink it before it is retired */
+                g_atomic_pointer_set(&stream->publisher, NULL);
             }
-            if (stream->publisher && session->handle == stream->publisher->handle) {
+            /* Only the owners go through the streams registry */
+            janus_mutex_lock(&pubsub_streams_mutex);
+            if (stream->destroyed) {
+                JANUS_LOG(LOG_VERB, "Stream already destroyed...\n");
+            } else {
                 stream->destroyed = janus_get_monotonic_time();
-                g_hash_table_remove(pubsub_streams, session->stream_name);
-                pubsub_old_streams = g_list_append(pubsub_old_streams, stream);
+                janus_pubsub_stream_stop_recording(stream);
+                /* Pulled streams stop once their reactor is done with them */
+                janus_pubsub_reactor_remove_stream(stream);
+                if (stream->cascade != NULL) {
+                    /* The upstream node stops forwarding once its session is gone */
+                    janus_pubsub_cascade_stop(stream->cascade);
+                }
+                /* Sessions and relay jobs still holding a reference keep the stream around */
+                if (janus_pubsub_remove_stream(stream)) {
+                    janus_pubsub_stream_unref(stream);
+                }
             }
-            else {
-                JANUS_LOG(LOG_VERB, "Removing PubSub subscriber...\n");
-                if (session->sub_id > 0) {
-                    janus_mutex_lock(&stream->subscribers_mutex);
-                    janus_pubsub_stream *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
-                    if (!subscriber || subscriber->destroyed) {
-                         JANUS_LOG(LOG_ERR, "Subscribers hashtable lookup failed...\n");
-                         *error = -2;
-                         janus_mutex_unlock(&stream->subscribers_mutex);
-                         janus_mutex_unlock(&pubsub_streams_mutex);
-                         janus_mutex_unlock(&pubsub_sessions_mutex);
-                         return;
-                    }
-                    g_hash_table_remove(stream->subscribers, &session->sub_id);
-                    subscriber->destroyed = janus_get_monotonic_time();
-	            pubsub_old_subscribers = g_list_append(pubsub_old_subscribers, subscriber);
-                    janus_mutex_unlock(&stream->subscribers_mutex);
+            janus_mutex_unlock(&pubsub_streams_mutex);
+        } else if (stream != NULL && session->sub_id > 0) {
+            /* Subscribers leave destroyed streams too, dropping their references */
+            JANUS_LOG(LOG_VERB, "Removing PubSub subscriber...\n");
+            janus_mutex_lock(&stream->subscribers_mutex);
+            janus_pubsub_subscriber *subscriber = g_hash_table_lookup(stream->subscribers, &session->sub_id);
+            if (!subscriber || subscriber->destroyed) {
+                JANUS_LOG(LOG_ERR, "Subscribers hashtable lookup failed...\n");
+            } else {
+                g_hash_table_remove(stream->subscribers, &session->sub_id);
+                janus_pubsub_feedback_remove_subscriber(stream->feedback, session->sub_id);
+                janus_pubsub_egress_close(subscriber->egress);
+                if (g_atomic_int_compare_and_exchange(&subscriber->gop_pending, 1, 0)) {
+                    g_atomic_int_add(&stream->gop_waiters, -1);
                 }
+                subscriber->destroyed = janus_get_monotonic_time();
+                janus_pubsub_stream_update_snapshot(stream);
+                /* The snapshots listing it keep it until the relay threads moved on */
+                janus_pubsub_subscriber_unref(subscriber);
             }
+            janus_mutex_unlock(&stream->subscribers_mutex);
         }
-        JANUS_LOG(LOG_INFO, "Set session destroyed...\n");
-        session->destroyed = janus_get_monotonic_time();
-        g_hash_table_remove(sessions, handle);
-        /* Cleaning up and removing the session is done in a lazy way */
-        pubsub_old_sessions = g_list_append(pubsub_old_sessions, session);
-        janus_mutex_unlock(&pubsub_streams_mutex);
+        /* Callbacks for this handle may still be running, they hold the epoch */
+        janus_pubsub_epoch_retire(session, (GDestroyNotify)janus_pubsub_session_unref);
     }
-    janus_mutex_unlock(&pubsub_sessions_mutex);
     JANUS_LOG(LOG_INFO, "PubSub Session destroyed.\n");
 }
+
+
+void janus_pubsub_session_ref(janus_pubsub_session *session) {
+    g_atomic_int_inc(&session->ref);
+}
+
+
+void janus_pubsub_session_unref(janus_pubsub_session *session) {
+    if (!g_atomic_int_dec_and_test(&session->ref)) {
+        return;
+    }
+    JANUS_LOG(LOG_VERB, "Freeing old PubSub session\n");
+    if (session->stream != NULL) {
+        janus_pubsub_stream_unref(session->stream);
+    }
+    janus_mutex_destroy(&session->rec_mutex);
+    g_free(session);
+}
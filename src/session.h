@@ -7,9 +7,15 @@
 #include <mutex.h>
 #include <record.h>
 
+/* Independent locks the sessions registry is split into, a power of two */
+#define JANUS_PUBSUB_SESSION_STRIPES 64
+#define JANUS_PUBSUB_SESSION_CACHE_LINE 64
+
+struct jansus_pubsub_stream;
+
 typedef struct janus_pubsub_session {
     janus_plugin_session *handle;
-    gchar *stream_name;                /* session publishes to this stream */
+    struct jansus_pubsub_stream *stream;  /* Referenced stream this session publishes or subscribes to */
     guint64 sub_id;                    /* subscriber id */
     gboolean has_audio;
     gboolean has_video;
@@ -21,17 +27,21 @@ typedef struct janus_pubsub_session {
     janus_recorder *vrc;    /* The Janus recorder instance for this user's video, if enabled */
     janus_recorder *drc;    /* The Janus recorder instance for this user's data, if enabled */
     janus_mutex rec_mutex;    /* Mutex to protect the recorders from race conditions */
-    guint16 slowlink_count;
+    volatile gint slowlink_count;
     volatile gint hangingup;
     int kind;
     gint64 destroyed;    /* Time at which this session was marked as destroyed */
+    volatile gint ref;    /* The sessions table, retired through the epoch, and its subscriber */
 } janus_pubsub_session;
 
 void janus_pubsub_sessions_init(void);
 void janus_pubsub_sessions_destroy(void);
+guint janus_pubsub_session_hash(janus_plugin_session *handle);
 janus_pubsub_session *janus_pubsub_session_get(janus_plugin_session *handle);
 gboolean janus_pubsub_has_session(janus_plugin_session *handle);
 void janus_pubsub_create_session(janus_plugin_session *handle, int *error);
 void janus_pubsub_destroy_session(janus_plugin_session *handle, int *error);
+void janus_pubsub_session_ref(janus_pubsub_session *session);
+void janus_pubsub_session_unref(janus_pubsub_session *session);
 
 #endif /* SESSION_H */
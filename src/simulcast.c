@@ -0,0 +1,274 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <rtp.h>
+#include <utils.h>
+
+#include "simulcast.h"
+
+#define JANUS_PUBSUB_RID_URI "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id"
+
+/* Estimates at which substreams 1 and 2 are picked for a subscriber */
+static guint32 layer_bitrates[JANUS_PUBSUB_SIMULCAST_LAYERS - 1];
+
+
+void janus_pubsub_simulcast_init(const char *bitrates) {
+    memset(layer_bitrates, 0, sizeof(layer_bitrates));
+    gchar **values = g_strsplit(bitrates ? bitrates : PUBSUB_DEFAULT_SIMULCAST_BITRATES, ",", -1);
+    guint i;
+    for (i = 0; values[i] != NULL && i < JANUS_PUBSUB_SIMULCAST_LAYERS - 1; i++) {
+        layer_bitrates[i] = (guint32)g_ascii_strtoull(g_strstrip(values[i]), NULL, 10);
+    }
+    g_strfreev(values);
+    JANUS_LOG(LOG_INFO, "PubSub simulcast: substream 1 from %u bps, 2 from %u bps\n",
+        layer_bitrates[0], layer_bitrates[1]);
+}
+
+
+/* Find the simulcast layers in the video section of an offer, NULL if none */
+janus_pubsub_simulcast *janus_pubsub_simulcast_from_sdp(const char *sdp) {
+    const char *video = sdp ? strstr(sdp, "m=video") : NULL;
+    if (video == NULL) {
+        return NULL;
+    }
+    const char *end = strstr(video + 1, "\nm=");
+    gchar *section = end ? g_strndup(video, end - video) : g_strdup(video);
+    gchar **lines = g_strsplit(section, "\n", -1);
+    g_free(section);
+    janus_pubsub_simulcast *simulcast = g_malloc0(sizeof(janus_pubsub_simulcast));
+    simulcast->rid_ext_id = -1;
+    guint32 ssrcs[JANUS_PUBSUB_SIMULCAST_LAYERS] = { 0 };
+    GPtrArray *rids = g_ptr_array_new();
+    int groups = 0;
+    guint i;
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        int id = -1;
+        char rid[64];
+        if (groups == 0 && sscanf(line, "a=ssrc-group:SIM %u %u %u", &ssrcs[0], &ssrcs[1], &ssrcs[2]) >= 2) {
+            groups++;
+        } else if (sscanf(line, "a=rid:%63s send", rid) == 1 && strstr(line, " send") != NULL) {
+            g_ptr_array_add(rids, g_strdup(rid));
+        } else if (sscanf(line, "a=extmap:%d", &id) == 1 && strstr(line, JANUS_PUBSUB_RID_URI) != NULL) {
+            simulcast->rid_ext_id = id;
+        }
+    }
+    g_strfreev(lines);
+    if (groups > 0) {
+        /* SSRC groups list the lowest quality first */
+        for (i = 0; i < JANUS_PUBSUB_SIMULCAST_LAYERS; i++) {
+            g_atomic_int_set(&simulcast->ssrcs[i], (gint)ssrcs[i]);
+        }
+    } else if (rids->len > 1 && simulcast->rid_ext_id > 0) {
+        /* Like the Janus core, rids are taken to list the highest quality first */
+        guint count = MIN(rids->len, JANUS_PUBSUB_SIMULCAST_LAYERS);
+        for (i = 0; i < count; i++) {
+            simulcast->rids[count - 1 - i] = g_strdup(g_ptr_array_index(rids, i));
+        }
+    } else {
+        g_free(simulcast);
+        simulcast = NULL;
+    }
+    g_ptr_array_foreach(rids, (GFunc)g_free, NULL);
+    g_ptr_array_free(rids, TRUE);
+    if (simulcast != NULL) {
+        simulcast->codec = janus_pubsub_gop_codec_from_sdp(sdp, &simulcast->pt);
+        JANUS_LOG(LOG_INFO, "Simulcast publisher (%s)\n", groups > 0 ? "ssrc" : "rid");
+    }
+    return simulcast;
+}
+
+
+void janus_pubsub_simulcast_free(janus_pubsub_simulcast *simulcast) {
+    if (simulcast == NULL) {
+        return;
+    }
+    guint i;
+    for (i = 0; i < JANUS_PUBSUB_SIMULCAST_LAYERS; i++) {
+        g_free(simulcast->rids[i]);
+    }
+    g_free(simulcast);
+}
+
+
+/* Value of the rtp-stream-id extension of a packet, copied into rid */
+static gboolean janus_pubsub_simulcast_parse_rid(char *buf, int len, int id, char *rid, int size) {
+    rtp_header *rtp = (rtp_header *)buf;
+    if (!rtp->extension) {
+        return FALSE;
+    }
+    int offset = 12 + rtp->csrccount * 4;
+    if (offset + 4 > len) {
+        return FALSE;
+    }
+    guint16 profile = ((guint8)buf[offset] << 8) | (guint8)buf[offset + 1];
+    int words = ((guint8)buf[offset + 2] << 8) | (guint8)buf[offset + 3];
+    if (profile != 0xBEDE || offset + 4 + words * 4 > len) {
+        return FALSE;
+    }
+    /* One-byte header elements */
+    int i = offset + 4, last = offset + 4 + words * 4;
+    while (i < last) {
+        guint8 b = (guint8)buf[i];
+        if (b == 0) {
+            i++;
+            continue;
+        }
+        int eid = b >> 4, elen = (b & 0x0f) + 1;
+        if (eid == 15 || i + 1 + elen > last) {
+            return FALSE;
+        }
+        if (eid == id) {
+            int n = MIN(elen, size - 1);
+            memcpy(rid, buf + i + 1, n);
+            rid[n] = '\0';
+            return TRUE;
+        }
+        i += 1 + elen;
+    }
+    return FALSE;
+}
+
+
+/* Substream a video packet belongs to, -1 if it can't be told */
+int janus_pubsub_simulcast_substream(janus_pubsub_simulcast *simulcast, char *buf, int len) {
+    if (len < 12) {
+        return -1;
+    }
+    rtp_header *rtp = (rtp_header *)buf;
+    guint32 ssrc = ntohl(rtp->ssrc);
+    int i;
+    for (i = 0; i < JANUS_PUBSUB_SIMULCAST_LAYERS; i++) {
+        if ((guint32)g_atomic_int_get(&simulcast->ssrcs[i]) == ssrc) {
+            return i;
+        }
+    }
+    char rid[16];
+    if (simulcast->rid_ext_id <= 0 ||
+            !janus_pubsub_simulcast_parse_rid(buf, len, simulcast->rid_ext_id, rid, sizeof(rid))) {
+        return -1;
+    }
+    for (i = 0; i < JANUS_PUBSUB_SIMULCAST_LAYERS; i++) {
+        if (simulcast->rids[i] != NULL && !strcmp(simulcast->rids[i], rid)) {
+            /* Later packets may not carry the rid, go by SSRC from now on */
+            g_atomic_int_set(&simulcast->ssrcs[i], (gint)ssrc);
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Highest substream a bandwidth estimate can carry */
+int janus_pubsub_simulcast_for_bitrate(guint32 bitrate) {
+    int i;
+    for (i = JANUS_PUBSUB_SIMULCAST_LAYERS - 1; i > 0; i--) {
+        if (bitrate >= layer_bitrates[i - 1]) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+
+void janus_pubsub_layer_init(janus_pubsub_layer *layer, int target) {
+    memset(layer, 0, sizeof(janus_pubsub_layer));
+    g_atomic_int_set(&layer->target, CLAMP(target, 0, JANUS_PUBSUB_SIMULCAST_LAYERS - 1));
+    layer->current = -1;
+    layer->requested = -1;
+}
+
+
+/* A negative manual target hands the choice back to the estimates */
+void janus_pubsub_layer_set_target(janus_pubsub_layer *layer, int target, gboolean manual) {
+    if (manual) {
+        g_atomic_int_set(&layer->manual, target >= 0);
+    } else if (g_atomic_int_get(&layer->manual)) {
+        return;
+    }
+    if (target >= 0) {
+        g_atomic_int_set(&layer->target, MIN(target, JANUS_PUBSUB_SIMULCAST_LAYERS - 1));
+    }
+}
+
+
+static gboolean janus_pubsub_layer_is_keyframe(janus_pubsub_simulcast *simulcast, char *buf, int len) {
+    rtp_header *rtp = (rtp_header *)buf;
+    if (simulcast->pt >= 0 && rtp->type != simulcast->pt) {
+        return FALSE;
+    }
+    int plen = 0;
+    char *payload = janus_rtp_payload(buf, len, &plen);
+    return payload != NULL && plen > 0 && janus_pubsub_gop_is_keyframe(simulcast->codec, payload, plen);
+}
+
+
+/*
+ * Copy a video packet of a simulcast stream into out, rewritten for the
+ * subscriber. Returns its length, or 0 if the subscriber doesn't get it.
+ * keyframe_needed is set when a keyframe is needed to reach the target
+ */
+int janus_pubsub_layer_rewrite(janus_pubsub_layer *layer, janus_pubsub_simulcast *simulcast,
+        char *buf, int len, char *out, gboolean *keyframe_needed) {
+    *keyframe_needed = FALSE;
+    if (len < 12 || len > JANUS_PUBSUB_SIMULCAST_MTU) {
+        return 0;
+    }
+    int substream = janus_pubsub_simulcast_substream(simulcast, buf, len);
+    if (substream < 0) {
+        return 0;
+    }
+    int target = g_atomic_int_get(&layer->target);
+    if (layer->current != target && layer->requested != target) {
+        layer->requested = target;
+        *keyframe_needed = TRUE;
+    }
+    rtp_header *rtp = (rtp_header *)buf;
+    guint16 seq = ntohs(rtp->seq_number);
+    guint32 ts = ntohl(rtp->timestamp);
+    if (substream != layer->current) {
+        /* Switch to the target at its keyframe, or start with any lower one */
+        if (substream != target && (layer->current >= 0 || substream > target)) {
+            return 0;
+        }
+        if (!janus_pubsub_layer_is_keyframe(simulcast, buf, len)) {
+            return 0;
+        }
+        if (!layer->started) {
+            layer->ssrc = ntohl(rtp->ssrc);
+            layer->seq_offset = 0;
+            layer->ts_offset = 0;
+        } else {
+            /* Continue where the previous substream left, 90kHz video clock */
+            gint64 elapsed = janus_get_monotonic_time() - layer->last_time;
+            guint32 step = (guint32)MAX(1, elapsed * 90 / 1000);
+            layer->seq_offset = (guint16)(layer->last_seq + 1 - seq);
+            layer->ts_offset = layer->last_ts + step - ts;
+        }
+        JANUS_LOG(LOG_VERB, "Subscriber switched from substream %d to %d\n", layer->current, substream);
+        layer->current = substream;
+        layer->requested = -1;
+        layer->switches++;
+    }
+    memcpy(out, buf, len);
+    rtp_header *header = (rtp_header *)out;
+    guint16 out_seq = seq + layer->seq_offset;
+    guint32 out_ts = ts + layer->ts_offset;
+    header->ssrc = htonl(layer->ssrc);
+    header->seq_number = htons(out_seq);
+    header->timestamp = htonl(out_ts);
+    if (!layer->started || (gint16)(out_seq - layer->last_seq) > 0) {
+        layer->last_seq = out_seq;
+    }
+    if (!layer->started || (gint32)(out_ts - layer->last_ts) > 0) {
+        layer->last_ts = out_ts;
+        layer->last_time = janus_get_monotonic_time();
+    }
+    layer->started = TRUE;
+    return len;
+}
@@ -0,0 +1,61 @@
+#ifndef SIMULCAST_H
+#define SIMULCAST_H
+
+#include <glib.h>
+
+#include "gop.h"
+
+#define PUBSUB_DEFAULT_SIMULCAST_BITRATES "300000,1000000"  /* Estimates needed for substreams 1 and 2 */
+#define PUBSUB_DEFAULT_SIMULCAST_SUBSTREAM 2                /* Substream new subscribers start with */
+
+#define JANUS_PUBSUB_SIMULCAST_LAYERS 3
+#define JANUS_PUBSUB_SIMULCAST_MTU 1500
+
+/*
+ * Simulcast layers of a publisher, found in its offer either as an SSRC
+ * group or as rids. Substream 0 is the lowest quality. With rids the
+ * SSRCs are learned from the first packets carrying the rid extension.
+ */
+typedef struct janus_pubsub_simulcast {
+    volatile gint ssrcs[JANUS_PUBSUB_SIMULCAST_LAYERS];  /* guint32 SSRC of each substream, 0 if unknown */
+    gchar *rids[JANUS_PUBSUB_SIMULCAST_LAYERS];          /* rid of each substream, NULL with SSRC groups */
+    int rid_ext_id;                     /* rtp-stream-id extension id, -1 if none */
+    janus_pubsub_video_codec codec;
+    int pt;                             /* Video payload type, -1 for any */
+} janus_pubsub_simulcast;
+
+/*
+ * Substream a subscriber gets. Packets of the other substreams are
+ * dropped, and SSRC, sequence number and timestamp are rewritten so a
+ * switch at a keyframe looks like one continuous stream. Apart from the
+ * target, set from any thread, the layer is not locked: every video packet
+ * for the subscriber, cached ones included, is relayed by its egress
+ * worker, by the fan-out worker of its shard, or by the ingress thread
+ * once the workers drained the stream, so one thread at a time touches it.
+ */
+typedef struct janus_pubsub_layer {
+    volatile gint target;               /* Wanted substream */
+    volatile gint manual;               /* Target set with configure, estimates leave it alone */
+    int current;                        /* Substream being relayed, -1 until its first keyframe */
+    int requested;                      /* Target a keyframe was last asked for */
+    gboolean started;                   /* A packet was sent, the rewrite below is valid */
+    guint32 ssrc;                       /* SSRC the subscriber sees */
+    guint16 seq_offset;
+    guint32 ts_offset;
+    guint16 last_seq;                   /* Last sequence number and timestamp sent */
+    guint32 last_ts;
+    gint64 last_time;                   /* When the last packet was sent */
+    guint64 switches;
+} janus_pubsub_layer;
+
+void janus_pubsub_simulcast_init(const char *bitrates);
+janus_pubsub_simulcast *janus_pubsub_simulcast_from_sdp(const char *sdp);
+void janus_pubsub_simulcast_free(janus_pubsub_simulcast *simulcast);
+int janus_pubsub_simulcast_substream(janus_pubsub_simulcast *simulcast, char *buf, int len);
+int janus_pubsub_simulcast_for_bitrate(guint32 bitrate);
+void janus_pubsub_layer_init(janus_pubsub_layer *layer, int target);
+void janus_pubsub_layer_set_target(janus_pubsub_layer *layer, int target, gboolean manual);
+int janus_pubsub_layer_rewrite(janus_pubsub_layer *layer, janus_pubsub_simulcast *simulcast,
+        char *buf, int len, char *out, gboolean *keyframe_needed);
+
+#endif /* SIMULCAST_H */
@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "snapshot.h"
+#include "epoch.h"
+
+
+/* Build a snapshot with its entries grouped into shards by subscriber id */
+janus_pubsub_snapshot *janus_pubsub_snapshot_build(GHashTable *subscribers, guint shards) {
+    guint count = subscribers ? g_hash_table_size(subscribers) : 0;
+    if (shards == 0) {
+        shards = 1;
+    }
+    janus_pubsub_snapshot *snapshot = g_malloc0(
+        sizeof(janus_pubsub_snapshot) + count * sizeof(janus_pubsub_snapshot_entry) +
+        (shards + 1) * sizeof(guint));
+    g_atomic_int_set(&snapshot->ref, 1);
+    snapshot->shards = shards;
+    snapshot->shard_offsets = (guint *)(snapshot->entries + count);
+    if (count == 0) {
+        return snapshot;
+    }
+    /* Count the subscribers of each shard, then place them */
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, subscribers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_subscriber *sp = value;
+        if (!sp || sp->destroyed) {
+            continue;
+        }
+        snapshot->shard_offsets[sp->subscriber_id % shards + 1]++;
+        snapshot->count++;
+    }
+    guint i;
+    for (i = 1; i <= shards; i++) {
+        snapshot->shard_offsets[i] += snapshot->shard_offsets[i - 1];
+    }
+    guint *next = g_alloca(shards * sizeof(guint));
+    memcpy(next, snapshot->shard_offsets, shards * sizeof(guint));
+    g_hash_table_iter_init(&iter, subscribers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_subscriber *sp = value;
+        if (!sp || sp->destroyed) {
+            continue;
+        }
+        janus_pubsub_snapshot_entry *entry = &snapshot->entries[next[sp->subscriber_id % shards]++];
+        entry->kind = sp->kind;
+        entry->handle = sp->subscriber_session ? sp->subscriber_session->handle : NULL;
+        entry->subscriber = sp;
+        /* Fan-out jobs keep snapshots past the epoch, so they keep the subscribers too */
+        janus_pubsub_subscriber_ref(sp);
+    }
+    return snapshot;
+}
+
+
+void janus_pubsub_snapshot_ref(janus_pubsub_snapshot *snapshot) {
+    g_atomic_int_inc(&snapshot->ref);
+}
+
+
+void janus_pubsub_snapshot_unref(janus_pubsub_snapshot *snapshot) {
+    if (g_atomic_int_dec_and_test(&snapshot->ref)) {
+        guint i;
+        for (i = 0; i < snapshot->count; i++) {
+            janus_pubsub_subscriber_unref(snapshot->entries[i].subscriber);
+        }
+        g_free(snapshot);
+    }
+}
+
+
+/* Release a snapshot that was swapped out. Readers in the relay loop do
+ * not take a reference, so the release waits for them to be done
+ */
+void janus_pubsub_snapshot_retire(janus_pubsub_snapshot *snapshot) {
+    janus_pubsub_epoch_retire(snapshot, (GDestroyNotify)janus_pubsub_snapshot_unref);
+}
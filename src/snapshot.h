@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <glib.h>
+
+/* janus includes */
+#include <plugins/plugin.h>
+
+#include "subscriber.h"
+
+typedef struct janus_pubsub_snapshot_entry {
+    int kind;                           /* Subscriber kind, copied for the relay loop */
+    janus_plugin_session *handle;       /* Session subscribers only */
+    janus_pubsub_subscriber *subscriber;
+} janus_pubsub_snapshot_entry;
+
+/* Immutable array of a stream's subscribers, each referenced. The relay
+ * loop reads the current snapshot without locking, subscribe and
+ * unsubscribe build a new one under the stream's subscribers_mutex and
+ * swap it in.
+ */
+typedef struct janus_pubsub_snapshot {
+    volatile gint ref;
+    guint count;
+    guint shards;                       /* Entries are grouped by fan-out shard */
+    guint *shard_offsets;               /* Shard i spans [shard_offsets[i], shard_offsets[i+1]) */
+    janus_pubsub_snapshot_entry entries[];
+} janus_pubsub_snapshot;
+
+janus_pubsub_snapshot *janus_pubsub_snapshot_build(GHashTable *subscribers, guint shards);
+void janus_pubsub_snapshot_ref(janus_pubsub_snapshot *snapshot);
+void janus_pubsub_snapshot_unref(janus_pubsub_snapshot *snapshot);
+void janus_pubsub_snapshot_retire(janus_pubsub_snapshot *snapshot);
+
+#endif /* SNAPSHOT_H */
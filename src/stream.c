@@ -1,24 +1,79 @@
 #include <glib.h>
+#include <unistd.h>
+
+#include <utils.h>
+
 #include "stream.h"
+#include "fanout.h"
+#include "epoch.h"
 
+/* Both keyed by the stream's own name and id, which live as long as the
+ * registry's reference
+ */
 static GHashTable *streams;
+static GHashTable *streams_by_id;
 
 void janus_pubsub_streams_init(void) {
     streams = g_hash_table_new(g_str_hash, g_str_equal);
+    streams_by_id = g_hash_table_new(g_int64_hash, g_int64_equal);
 }
 
-janus_pubsub_stream * janus_pubsub_stream_get(gchar *name){
+janus_pubsub_stream * janus_pubsub_stream_get(const gchar *name){
     janus_pubsub_stream * s = g_hash_table_lookup(streams, name);
     return s;
 }
 
+/* Lookup a stream and take a reference on it, the caller must hold
+ * pubsub_streams_mutex and release the reference with
+ * janus_pubsub_stream_unref
+ */
+janus_pubsub_stream * janus_pubsub_stream_get_ref(const gchar *name){
+    janus_pubsub_stream * s = g_hash_table_lookup(streams, name);
+    if (s != NULL) {
+        janus_pubsub_stream_ref(s);
+    }
+    return s;
+}
+
+/* Lookup a stream by id and take a reference on it, the caller must hold
+ * pubsub_streams_mutex
+ */
+janus_pubsub_stream * janus_pubsub_stream_get_ref_by_id(guint64 id){
+    janus_pubsub_stream * s = g_hash_table_lookup(streams_by_id, &id);
+    if (s != NULL) {
+        janus_pubsub_stream_ref(s);
+    }
+    return s;
+}
+
+/* Register a stream under its name and a new id, the caller must hold
+ * pubsub_streams_mutex
+ */
 int janus_pubsub_add_stream(janus_pubsub_stream *stream) {
-    g_hash_table_insert(streams, g_strdup(stream->name), stream);
+    do {
+        /* Kept below 2^53 so JavaScript clients get it exactly */
+        stream->pub_id = janus_random_uint64() & JANUS_PUBSUB_STREAM_ID_MASK;
+    } while (stream->pub_id == 0 || g_hash_table_contains(streams_by_id, &stream->pub_id));
+    g_hash_table_insert(streams, stream->name, stream);
+    g_hash_table_insert(streams_by_id, &stream->pub_id, stream);
+    return 0;
 }
-gboolean janus_pubsub_has_stream(gchar *name) {
+
+gboolean janus_pubsub_has_stream(const gchar *name) {
     return g_hash_table_contains(streams, name);
 }
 
+/* Drop a stream from the registry, the registry's reference is handed
+ * over to the caller
+ */
+gboolean janus_pubsub_remove_stream(janus_pubsub_stream *stream) {
+    if (g_hash_table_lookup(streams, stream->name) != stream) {
+        return FALSE;
+    }
+    g_hash_table_remove(streams_by_id, &stream->pub_id);
+    return g_hash_table_remove(streams, stream->name);
+}
+
 int janus_pubsub_create_stream(janus_pubsub_stream **stream_p)
 {
     janus_pubsub_stream *stream = g_malloc0(sizeof(janus_pubsub_stream));
@@ -32,15 +87,25 @@ int janus_pubsub_create_stream(janus_pubsub_stream **stream_p)
     stream->data_port = 0;
     stream->host = NULL;
     stream->fwd_sock = 0;
-    stream->relay_thread = NULL;
+    stream->mcast_sock = 0;
+    stream->reactor = -1;
+    stream->owner = NULL;
     stream->publisher = NULL;
-    stream->subscribers = g_hash_table_new(NULL, NULL);
+    stream->subscribers = g_hash_table_new(g_int64_hash, g_int64_equal);
     janus_mutex_init(&stream->subscribers_mutex);
+    stream->snapshot = janus_pubsub_snapshot_build(NULL, janus_pubsub_fanout_shards());
+    g_atomic_int_set(&stream->fanout_pending, 0);
     stream->video_puller = NULL;
     stream->audio_puller = NULL;
     stream->data_puller = NULL;
+    stream->video_codec = JANUS_PUBSUB_CODEC_UNKNOWN;
+    stream->video_pt = -1;
+    stream->recording = NULL;
+    stream->metrics = janus_pubsub_metrics_new(TRUE);
     stream->destroyed = 0;
+    g_atomic_int_set(&stream->ref, 1);
     stream->relay_rtp = NULL;
+    stream->relay_data = NULL;
     *stream_p = stream;
     return 0;
 }
@@ -50,7 +115,72 @@ int janus_pubsub_destroy_stream(janus_pubsub_stream *stream)
 {
     g_hash_table_destroy(stream->subscribers);
     janus_mutex_destroy(&stream->subscribers_mutex);
+    janus_pubsub_snapshot_unref(stream->snapshot);
+    if (stream->fwd_sock > 0) {
+        close(stream->fwd_sock);
+    }
+    if (stream->mcast_sock > 0) {
+        close(stream->mcast_sock);
+    }
+    janus_pubsub_puller_free(stream->video_puller);
+    janus_pubsub_puller_free(stream->audio_puller);
+    janus_pubsub_puller_free(stream->data_puller);
+    janus_pubsub_gop_free(stream->gop);
+    janus_pubsub_feedback_free(stream->feedback);
+    janus_pubsub_simulcast_free(stream->simulcast);
+    janus_pubsub_metrics_free(stream->metrics);
+    janus_pubsub_cascade_unref(stream->cascade);
+    g_free(stream->name);
+    g_free(stream->sdp);
+    g_free(stream->sdp_type);
+    g_free(stream->host);
     g_free(stream);
     stream = NULL;
     return 0;
 }
+
+
+/* Publish a new subscribers snapshot for the relay loop, the caller must
+ * hold the stream's subscribers_mutex
+ */
+void janus_pubsub_stream_update_snapshot(janus_pubsub_stream *stream) {
+    janus_pubsub_snapshot *snapshot = janus_pubsub_snapshot_build(
+        stream->subscribers, janus_pubsub_fanout_shards());
+    janus_pubsub_snapshot *old = g_atomic_pointer_get(&stream->snapshot);
+    g_atomic_pointer_set(&stream->snapshot, snapshot);
+    janus_pubsub_snapshot_retire(old);
+}
+
+
+void janus_pubsub_stream_ref(janus_pubsub_stream *stream) {
+    g_atomic_int_inc(&stream->ref);
+}
+
+
+void janus_pubsub_stream_unref(janus_pubsub_stream *stream) {
+    if (g_atomic_int_dec_and_test(&stream->ref)) {
+        janus_pubsub_destroy_stream(stream);
+    }
+}
+
+
+/* Stop recording the stream, the owner's recorders are closed by the
+ * recording writer once the relay threads are done with them
+ */
+gboolean janus_pubsub_stream_stop_recording(janus_pubsub_stream *stream) {
+    janus_pubsub_recording *recording = g_atomic_pointer_get(&stream->recording);
+    if (recording == NULL ||
+            !g_atomic_pointer_compare_and_exchange(&stream->recording, recording, NULL)) {
+        return FALSE;
+    }
+    janus_pubsub_session *owner = stream->owner;
+    if (owner != NULL) {
+        janus_mutex_lock(&owner->rec_mutex);
+        owner->arc = NULL;
+        owner->vrc = NULL;
+        owner->drc = NULL;
+        janus_mutex_unlock(&owner->rec_mutex);
+    }
+    janus_pubsub_epoch_retire(recording, (GDestroyNotify)janus_pubsub_recording_stop);
+    return TRUE;
+}
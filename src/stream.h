@@ -9,9 +9,20 @@
 
 #include "puller.h"
 #include "session.h"
+#include "snapshot.h"
+#include "gop.h"
+#include "feedback.h"
+#include "simulcast.h"
+#include "recording.h"
+#include "metrics.h"
+#include "cascade.h"
+#include "multicast.h"
+
+/* Stream ids are random below 2^53 */
+#define JANUS_PUBSUB_STREAM_ID_MASK G_GUINT64_CONSTANT(0x1fffffffffffff)
 
 typedef struct jansus_pubsub_stream {
-    guint64 pub_id;                    /* Unique Publisher ID */
+    guint64 pub_id;                    /* Unique stream ID returned by publish, 0 until registered */
     gchar *name;                       /* Unique name given to this pubslisher */
     int kind;                          /* Type of publisher */
     gchar *sdp;                        /* The SDP this publisher negotiated, if any */
@@ -19,22 +30,49 @@ typedef struct jansus_pubsub_stream {
     int video_port;
     int audio_port;
     int data_port;
+    guint pull_batch_size;             /* Datagrams read per recvmmsg call by the pull sockets */
+    guint pull_buffer_count;           /* Packet buffers in each pull socket's ring */
     char *host;
     int fwd_sock;                      /* The udp socket on which to forward rtp packets */
-    GThread *relay_thread;
-    janus_pubsub_session *publisher;
+    int mcast_sock;                    /* Sends to the multicast groups, set up by the first multicast subscriber */
+    janus_pubsub_multicast_options mcast_options;  /* What mcast_sock was set up with */
+    int reactor;                       /* Pull reactor the pull sockets are registered on, -1 if none */
+    janus_pubsub_session *owner;       /* Session that published the stream, of any kind */
+    janus_pubsub_session *publisher;   /* Read within the epoch, NULL once the publishing session is destroyed */
     janus_mutex subscribers_mutex;
-    GHashTable *subscribers;
+    GHashTable *subscribers;           /* Subscribers keyed by subscriber id, protected by subscribers_mutex */
+    janus_pubsub_snapshot *snapshot;   /* Current subscribers for the relay loop, read without locking */
+    volatile gint fanout_pending;      /* Packets handed to the fan-out workers and not yet relayed */
+    janus_pubsub_gop *gop;             /* Video since the last keyframe, NULL if not cached */
+    volatile gint gop_waiters;         /* Subscribers waiting for the cached video */
+    janus_pubsub_feedback *feedback;   /* Subscriber RTCP merged for the publisher */
+    janus_pubsub_simulcast *simulcast; /* Publisher's simulcast layers, NULL if it doesn't simulcast */
+    volatile gint video_codec;         /* janus_pubsub_video_codec, to tell keyframes apart */
+    volatile gint video_pt;            /* Video payload type, -1 for any */
+    janus_pubsub_recording *recording; /* Packets being recorded, NULL if not recording */
+    janus_pubsub_metrics *metrics;     /* Packets received and relayed, fan-out times */
+    janus_pubsub_cascade *cascade;     /* Upstream node the stream is pulled from, NULL if none */
     janus_pubsub_puller* video_puller;
     janus_pubsub_puller* audio_puller;
     janus_pubsub_puller* data_puller;
     gint64 destroyed;                  /* Time at which this stream was marked as destroyed */
+    volatile gint ref;                 /* Registry, sessions and relay threads each hold a reference */
     void (*relay_rtp)(void *stream, int video, char *buf, int len);
+    void (*relay_data)(void *stream, char *buf, int len);
 } janus_pubsub_stream;
 
 void janus_pubsub_streams_init(void);
-janus_pubsub_stream * janus_pubsub_stream_get(gchar *name);
+janus_pubsub_stream * janus_pubsub_stream_get(const gchar *name);
+janus_pubsub_stream * janus_pubsub_stream_get_ref(const gchar *name);
+janus_pubsub_stream * janus_pubsub_stream_get_ref_by_id(guint64 id);
+int janus_pubsub_add_stream(janus_pubsub_stream *stream);
+gboolean janus_pubsub_has_stream(const gchar *name);
+gboolean janus_pubsub_remove_stream(janus_pubsub_stream *stream);
 int janus_pubsub_create_stream(janus_pubsub_stream **stream_p);
 int janus_pubsub_destroy_stream(janus_pubsub_stream *stream);
+void janus_pubsub_stream_update_snapshot(janus_pubsub_stream *stream);
+void janus_pubsub_stream_ref(janus_pubsub_stream *stream);
+void janus_pubsub_stream_unref(janus_pubsub_stream *stream);
+gboolean janus_pubsub_stream_stop_recording(janus_pubsub_stream *stream);
 
 #endif /* STREAM_H */
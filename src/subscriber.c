@@ -0,0 +1,50 @@
+#include <glib.h>
+
+#include <mutex.h>
+
+#include "subscriber.h"
+#include "forward.h"
+
+
+janus_pubsub_subscriber *janus_pubsub_subscriber_new(guint64 subscriber_id, int kind) {
+    janus_pubsub_subscriber *subscriber = g_malloc0(sizeof(janus_pubsub_subscriber));
+    subscriber->subscriber_id = subscriber_id;
+    subscriber->kind = kind;
+    subscriber->rtp_forwarders = g_hash_table_new(NULL, NULL);
+    janus_mutex_init(&subscriber->rtp_forwarders_mutex);
+    subscriber->metrics = janus_pubsub_metrics_new(FALSE);
+    subscriber->destroyed = 0;
+    g_atomic_int_set(&subscriber->ref, 1);
+    return subscriber;
+}
+
+
+void janus_pubsub_subscriber_ref(janus_pubsub_subscriber *subscriber) {
+    g_atomic_int_inc(&subscriber->ref);
+}
+
+
+/* The last reference goes once the subscriber left the stream and no batch,
+ * snapshot or egress queue lists it anymore
+ */
+void janus_pubsub_subscriber_unref(janus_pubsub_subscriber *subscriber) {
+    if (!g_atomic_int_dec_and_test(&subscriber->ref)) {
+        return;
+    }
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, subscriber->rtp_forwarders);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        janus_pubsub_forwarder *forward = (janus_pubsub_forwarder *)value;
+        janus_pubsub_metrics_free(forward->metrics);
+        g_free(forward);
+    }
+    g_hash_table_destroy(subscriber->rtp_forwarders);
+    janus_mutex_destroy(&subscriber->rtp_forwarders_mutex);
+    janus_pubsub_metrics_free(subscriber->metrics);
+    if (subscriber->subscriber_session != NULL) {
+        janus_pubsub_session_unref(subscriber->subscriber_session);
+    }
+    g_free(subscriber->host);
+    g_free(subscriber);
+}
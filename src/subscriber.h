@@ -4,6 +4,12 @@
 #include <glib.h>
 
 #include <plugins/plugin.h>
+#include <mutex.h>
+
+#include "session.h"
+#include "simulcast.h"
+#include "egress.h"
+#include "metrics.h"
 
 typedef struct janus_pubsub_subscriber {
     guint64 subscriber_id;             /* Unique Subscriber ID */
@@ -14,9 +20,17 @@ typedef struct janus_pubsub_subscriber {
     int data_port;
     GHashTable *rtp_forwarders;
     janus_mutex rtp_forwarders_mutex;
-    janus_pubsub_session *subscriber_session;
+    janus_pubsub_session *subscriber_session;    /* Referenced, session subscribers only */
+    volatile gint gop_pending;         /* Cached video is sent before the next live packet */
+    janus_pubsub_layer layer;          /* Substream relayed from a simulcast publisher */
+    janus_pubsub_egress *egress;       /* Packets waiting to be sent, NULL when relayed inline */
+    janus_pubsub_metrics *metrics;     /* Packets sent to the subscriber and dropped on the way */
     gint64 destroyed;                 /* Time at which this stream was marked as destroyed */
+    volatile gint ref;                 /* Subscribers table, snapshots listing it, its egress and batched datagrams */
 } janus_pubsub_subscriber;
 
+janus_pubsub_subscriber *janus_pubsub_subscriber_new(guint64 subscriber_id, int kind);
+void janus_pubsub_subscriber_ref(janus_pubsub_subscriber *subscriber);
+void janus_pubsub_subscriber_unref(janus_pubsub_subscriber *subscriber);
 
 #endif /* SUBSCRIBER_H */
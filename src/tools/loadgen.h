@@ -0,0 +1,29 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <glib.h>
+#include <time.h>
+
+/*
+ * Payload written by pubsub_rtpgen after the RTP header and checked by
+ * pubsub_rtpsink. The counter tells losses and reordering apart from the
+ * RTP sequence number, which wraps, and the send time is taken from the
+ * monotonic clock, shared by every process on the host.
+ */
+#define LOADGEN_MAGIC 0x50534c47    /* "PSLG" */
+#define LOADGEN_RTP_HEADER 12
+
+typedef struct loadgen_payload {
+    guint32 magic;
+    guint32 media;                      /* 0 audio, 1 video */
+    guint64 counter;                    /* Big endian, from 0 for each media */
+    guint64 sent_ns;                    /* Big endian, CLOCK_MONOTONIC */
+} __attribute__((packed)) loadgen_payload;
+
+static inline guint64 loadgen_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* LOADGEN_H */
@@ -0,0 +1,128 @@
+/*
+ * Stand-in for the publish_url and subscribe_url endpoints in load tests.
+ * Answers every request with the same status and an empty JSON object,
+ * keeping connections alive like a real endpoint would, so the plugin's
+ * connection pool is used the same way.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define MOCKHTTP_BUFFER 16384
+
+static struct {
+    int port;
+    int status;
+    gboolean verbose;
+} options = {5000, 200, FALSE};
+
+
+/* Serve one connection until the plugin closes it */
+static void *mockhttp_connection(void *data) {
+    int fd = GPOINTER_TO_INT(data);
+    char *buf = g_malloc(MOCKHTTP_BUFFER);
+    gsize used = 0;
+    char response[256];
+    int response_len = g_snprintf(response, sizeof(response),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: 2\r\n\r\n{}",
+        options.status, options.status < 300 ? "OK" : "Error");
+    for (;;) {
+        char *end = g_strstr_len(buf, used, "\r\n\r\n");
+        if (end == NULL) {
+            if (used == MOCKHTTP_BUFFER) {
+                break;
+            }
+            ssize_t got = recv(fd, buf + used, MOCKHTTP_BUFFER - used, 0);
+            if (got <= 0) {
+                break;
+            }
+            used += got;
+            continue;
+        }
+        /* Wait for the whole body, then drop the request from the buffer */
+        gsize header_len = end + 4 - buf;
+        gsize body_len = 0;
+        char *cl = g_strstr_len(buf, header_len, "\r\nContent-Length:");
+        if (cl == NULL) {
+            cl = g_strstr_len(buf, header_len, "\r\ncontent-length:");
+        }
+        if (cl != NULL) {
+            body_len = strtoul(cl + strlen("\r\nContent-Length:"), NULL, 10);
+        }
+        if (header_len + body_len > MOCKHTTP_BUFFER) {
+            break;
+        }
+        if (used < header_len + body_len) {
+            ssize_t got = recv(fd, buf + used, MOCKHTTP_BUFFER - used, 0);
+            if (got <= 0) {
+                break;
+            }
+            used += got;
+            continue;
+        }
+        if (options.verbose) {
+            fprintf(stderr, "%.*s %.*s\n", (int)strcspn(buf, "\r\n"), buf,
+                (int)body_len, buf + header_len);
+        }
+        if (send(fd, response, response_len, MSG_NOSIGNAL) < 0) {
+            break;
+        }
+        used -= header_len + body_len;
+        memmove(buf, buf + header_len + body_len, used);
+    }
+    close(fd);
+    g_free(buf);
+    return NULL;
+}
+
+
+static void mockhttp_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-p port] [-s status] [-v]\n", name);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:vh")) != -1) {
+        switch (opt) {
+            case 'p': options.port = atoi(optarg); break;
+            case 's': options.status = atoi(optarg); break;
+            case 'v': options.verbose = TRUE; break;
+            default:
+                mockhttp_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", options.port, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "Answering %d on 127.0.0.1:%d\n", options.status, options.port);
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        g_thread_unref(g_thread_new("mockhttp", mockhttp_connection, GINT_TO_POINTER(fd)));
+    }
+    close(sock);
+    return 0;
+}
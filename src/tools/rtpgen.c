@@ -0,0 +1,184 @@
+/*
+ * Load generator for pulled streams. Paces synthetic audio and video RTP
+ * onto the ports of a stream published with kind "session", each packet
+ * carrying a counter and its send time for pubsub_rtpsink to check. Packets
+ * are sent on a 1 ms tick, the ones due since the last tick at once.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "loadgen.h"
+
+#define RTPGEN_AUDIO_PT 111
+#define RTPGEN_VIDEO_PT 96
+
+typedef struct rtpgen_media {
+    const char *name;
+    guint32 media;
+    int port;
+    guint rate;                         /* Packets per second */
+    guint size;                         /* Whole RTP packet */
+    guint32 clock;                      /* RTP clock rate */
+    guint8 pt;
+    guint32 ssrc;
+    struct sockaddr_in addr;
+    guint64 sent;
+    guint64 bytes;
+    guint64 errors;
+} rtpgen_media;
+
+static struct {
+    const char *host;
+    guint duration;
+} options = {"127.0.0.1", 10};
+
+static rtpgen_media audio = {"audio", 0, 5002, 50, 160, 48000, RTPGEN_AUDIO_PT};
+static rtpgen_media video = {"video", 1, 5004, 500, 1200, 90000, RTPGEN_VIDEO_PT};
+static volatile sig_atomic_t stopping;
+
+
+static void rtpgen_stop(int signum) {
+    stopping = 1;
+}
+
+
+static void rtpgen_send(int sock, rtpgen_media *m, char *buf, guint64 start_ns) {
+    guint64 now = loadgen_now_ns();
+    memset(buf, 0, m->size);
+    buf[0] = (char)0x80;
+    /* Mark the last packet of each 10 ms "frame" of video */
+    buf[1] = (char)(m->pt | (m->media == 1 && m->sent % MAX(m->rate / 100, 1) == 0 ? 0x80 : 0));
+    guint16 seq = htons((guint16)m->sent);
+    guint32 ts = htonl((guint32)((now - start_ns) / 1000 * m->clock / 1000000));
+    guint32 ssrc = htonl(m->ssrc);
+    memcpy(buf + 2, &seq, 2);
+    memcpy(buf + 4, &ts, 4);
+    memcpy(buf + 8, &ssrc, 4);
+    loadgen_payload payload;
+    payload.magic = htonl(LOADGEN_MAGIC);
+    payload.media = htonl(m->media);
+    payload.counter = GUINT64_TO_BE(m->sent);
+    payload.sent_ns = GUINT64_TO_BE(now);
+    memcpy(buf + LOADGEN_RTP_HEADER, &payload, sizeof(payload));
+    if (sendto(sock, buf, m->size, 0, (struct sockaddr *)&m->addr, sizeof(m->addr)) < 0) {
+        m->errors++;
+    } else {
+        m->bytes += m->size;
+    }
+    m->sent++;
+}
+
+
+static json_t *rtpgen_media_json(rtpgen_media *m, double seconds) {
+    json_t *result = json_object();
+    json_object_set_new(result, "port", json_integer(m->port));
+    json_object_set_new(result, "sent", json_integer(m->sent));
+    json_object_set_new(result, "errors", json_integer(m->errors));
+    json_object_set_new(result, "packets_per_sec", json_real(seconds > 0 ? m->sent / seconds : 0));
+    json_object_set_new(result, "kbps", json_real(seconds > 0 ? m->bytes * 8 / seconds / 1000 : 0));
+    return result;
+}
+
+
+static void rtpgen_usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-a audio port] [-v video port] [-A audio packets/s]\n"
+        "          [-V video packets/s] [-s video packet size] [-d seconds]\n"
+        "A port or rate of 0 leaves that media out\n", name);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:a:v:A:V:s:d:h")) != -1) {
+        switch (opt) {
+            case 'H': options.host = optarg; break;
+            case 'a': audio.port = atoi(optarg); break;
+            case 'v': video.port = atoi(optarg); break;
+            case 'A': audio.rate = atoi(optarg); break;
+            case 'V': video.rate = atoi(optarg); break;
+            case 's': video.size = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            default:
+                rtpgen_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    video.size = CLAMP(video.size, LOADGEN_RTP_HEADER + sizeof(loadgen_payload), 1500);
+    rtpgen_media *medias[2] = {&audio, &video};
+    int i;
+    for (i = 0; i < 2; i++) {
+        rtpgen_media *m = medias[i];
+        m->ssrc = g_random_int();
+        m->addr.sin_family = AF_INET;
+        m->addr.sin_port = htons(m->port);
+        if (inet_pton(AF_INET, options.host, &m->addr.sin_addr) != 1) {
+            fprintf(stderr, "Invalid host %s\n", options.host);
+            return 1;
+        }
+    }
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        fprintf(stderr, "Could not create the socket: %s\n", strerror(errno));
+        return 1;
+    }
+    int sndbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    signal(SIGINT, rtpgen_stop);
+    signal(SIGTERM, rtpgen_stop);
+
+    char buf[1500];
+    guint64 start = loadgen_now_ns();
+    guint64 end = start + (guint64)options.duration * 1000000000;
+    struct timespec tick;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    while (!stopping) {
+        guint64 now = loadgen_now_ns();
+        if (now >= end) {
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            rtpgen_media *m = medias[i];
+            if (m->port <= 0 || m->rate == 0) {
+                continue;
+            }
+            /* Catch up with the schedule, bursts after a late tick */
+            guint64 due = (now - start) / 1000 * m->rate / 1000000 + 1;
+            while (m->sent < due) {
+                rtpgen_send(sock, m, buf, start);
+            }
+        }
+        tick.tv_nsec += 1000000;
+        if (tick.tv_nsec >= 1000000000) {
+            tick.tv_nsec -= 1000000000;
+            tick.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+    }
+    double seconds = (loadgen_now_ns() - start) / 1e9;
+    close(sock);
+
+    json_t *result = json_object();
+    json_object_set_new(result, "seconds", json_real(seconds));
+    for (i = 0; i < 2; i++) {
+        if (medias[i]->port > 0 && medias[i]->rate > 0) {
+            json_object_set_new(result, medias[i]->name, rtpgen_media_json(medias[i], seconds));
+        }
+    }
+    char *text = json_dumps(result, JSON_COMPACT);
+    printf("%s\n", text);
+    free(text);
+    json_decref(result);
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Receiving end of the load test. Listens on the ports given to an RTP
+ * forwarder of the stream pubsub_rtpgen feeds, and reports throughput,
+ * losses, reordering and one-way latency from the counter and send time
+ * of each packet. Latencies are exact only with both tools on the same
+ * host, which is what they are meant for.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "loadgen.h"
+
+/* Counters still told apart from duplicates once older than the newest */
+#define RTPSINK_WINDOW 65536
+
+typedef struct rtpsink_media {
+    const char *name;
+    int port;
+    int sock;
+    guint64 received;
+    guint64 bytes;
+    guint64 reordered;
+    guint64 duplicates;
+    guint64 invalid;
+    gint64 highest;                     /* Highest counter seen, -1 before the first */
+    guint64 first;
+    guint8 *seen;                       /* Bitmap of the last RTPSINK_WINDOW counters */
+    GArray *latencies;                  /* Nanoseconds, one per unique packet */
+    guint64 last_received;              /* For the periodic report */
+} rtpsink_media;
+
+static struct {
+    guint duration;
+    guint interval;
+} options = {0, 1};
+
+static rtpsink_media medias[2] = {
+    {"audio", 6002, -1},
+    {"video", 6004, -1},
+};
+static volatile sig_atomic_t stopping;
+
+
+static void rtpsink_stop(int signum) {
+    stopping = 1;
+}
+
+
+static gboolean rtpsink_seen(rtpsink_media *m, guint64 counter, gboolean set) {
+    guint64 bit = counter % RTPSINK_WINDOW;
+    gboolean seen = (m->seen[bit / 8] >> (bit % 8)) & 1;
+    if (set) {
+        m->seen[bit / 8] |= (guint8)(1 << (bit % 8));
+    } else {
+        m->seen[bit / 8] &= (guint8)~(1 << (bit % 8));
+    }
+    return seen;
+}
+
+
+static void rtpsink_packet(rtpsink_media *m, char *buf, int len, guint64 now) {
+    int hlen = LOADGEN_RTP_HEADER;
+    if (len >= hlen) {
+        hlen += (buf[0] & 0x0f) * 4;
+        if ((buf[0] & 0x10) && len >= hlen + 4) {
+            hlen += 4 + 4 * ntohs(*(guint16 *)(buf + hlen + 2));
+        }
+    }
+    loadgen_payload payload;
+    if (len < hlen + (int)sizeof(payload)) {
+        m->invalid++;
+        return;
+    }
+    memcpy(&payload, buf + hlen, sizeof(payload));
+    if (ntohl(payload.magic) != LOADGEN_MAGIC) {
+        m->invalid++;
+        return;
+    }
+    guint64 counter = GUINT64_FROM_BE(payload.counter);
+    guint64 sent = GUINT64_FROM_BE(payload.sent_ns);
+    m->received++;
+    m->bytes += len;
+    if (m->highest < 0) {
+        m->first = counter;
+        m->highest = counter;
+        rtpsink_seen(m, counter, TRUE);
+    } else if ((gint64)counter > m->highest) {
+        /* Forget the counters the window slides over */
+        guint64 c;
+        for (c = m->highest + 1; c < counter && c - m->highest <= RTPSINK_WINDOW; c++) {
+            rtpsink_seen(m, c, FALSE);
+        }
+        rtpsink_seen(m, counter, TRUE);
+        m->highest = counter;
+    } else if (m->highest - (gint64)counter < RTPSINK_WINDOW && counter >= m->first) {
+        if (rtpsink_seen(m, counter, TRUE)) {
+            m->duplicates++;
+            return;
+        }
+        m->reordered++;
+    } else {
+        m->reordered++;
+    }
+    guint64 latency = now > sent ? now - sent : 0;
+    g_array_append_val(m->latencies, latency);
+}
+
+
+static int rtpsink_compare(gconstpointer a, gconstpointer b) {
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static json_t *rtpsink_media_json(rtpsink_media *m, double seconds) {
+    json_t *result = json_object();
+    guint64 unique = m->received - m->duplicates;
+    guint64 expected = m->highest < 0 ? 0 : (guint64)m->highest - m->first + 1;
+    json_object_set_new(result, "port", json_integer(m->port));
+    json_object_set_new(result, "received", json_integer(m->received));
+    json_object_set_new(result, "packets_per_sec", json_real(seconds > 0 ? m->received / seconds : 0));
+    json_object_set_new(result, "kbps", json_real(seconds > 0 ? m->bytes * 8 / seconds / 1000 : 0));
+    json_object_set_new(result, "lost", json_integer(expected > unique ? expected - unique : 0));
+    json_object_set_new(result, "loss", json_real(expected > unique ? (double)(expected - unique) / expected : 0));
+    json_object_set_new(result, "reordered", json_integer(m->reordered));
+    json_object_set_new(result, "duplicates", json_integer(m->duplicates));
+    json_object_set_new(result, "invalid", json_integer(m->invalid));
+    json_t *latency = json_object();
+    if (m->latencies->len > 0) {
+        g_array_sort(m->latencies, rtpsink_compare);
+        static const double percentiles[] = {50, 90, 99, 99.9};
+        static const char *names[] = {"p50", "p90", "p99", "p999"};
+        guint i;
+        for (i = 0; i < G_N_ELEMENTS(percentiles); i++) {
+            guint index = MIN((guint)(m->latencies->len * percentiles[i] / 100), m->latencies->len - 1);
+            json_object_set_new(latency, names[i],
+                json_real(g_array_index(m->latencies, guint64, index) / 1000.0));
+        }
+        json_object_set_new(latency, "max",
+            json_real(g_array_index(m->latencies, guint64, m->latencies->len - 1) / 1000.0));
+    }
+    json_object_set_new(result, "latency_us", latency);
+    return result;
+}
+
+
+static void rtpsink_usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-a audio port] [-v video port] [-d seconds] [-i report interval]\n"
+        "A port of 0 leaves that media out, without -d the sink runs until interrupted\n", name);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:v:d:i:h")) != -1) {
+        switch (opt) {
+            case 'a': medias[0].port = atoi(optarg); break;
+            case 'v': medias[1].port = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'i': options.interval = atoi(optarg); break;
+            default:
+                rtpsink_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    struct pollfd fds[2];
+    int nfds = 0, i;
+    for (i = 0; i < 2; i++) {
+        rtpsink_media *m = &medias[i];
+        m->highest = -1;
+        m->seen = g_malloc0(RTPSINK_WINDOW / 8);
+        m->latencies = g_array_sized_new(FALSE, FALSE, sizeof(guint64), 65536);
+        if (m->port <= 0) {
+            continue;
+        }
+        m->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        int rcvbuf = 4 * 1024 * 1024;
+        setsockopt(m->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m->port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (m->sock < 0 || bind(m->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Could not bind the %s port %d: %s\n", m->name, m->port, strerror(errno));
+            return 1;
+        }
+        fds[nfds].fd = m->sock;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    if (nfds == 0) {
+        rtpsink_usage(argv[0]);
+        return 1;
+    }
+    signal(SIGINT, rtpsink_stop);
+    signal(SIGTERM, rtpsink_stop);
+
+    char buf[1500];
+    guint64 start = 0, last = 0, last_report = loadgen_now_ns();
+    while (!stopping) {
+        guint64 now = loadgen_now_ns();
+        if (options.duration > 0 && start > 0 && now - start >= (guint64)options.duration * 1000000000) {
+            break;
+        }
+        if (options.interval > 0 && now - last_report >= (guint64)options.interval * 1000000000) {
+            for (i = 0; i < 2; i++) {
+                rtpsink_media *m = &medias[i];
+                if (m->sock >= 0) {
+                    fprintf(stderr, "%s: %.0f packets/s\n", m->name,
+                        (m->received - m->last_received) * 1e9 / (now - last_report));
+                    m->last_received = m->received;
+                }
+            }
+            last_report = now;
+        }
+        if (poll(fds, nfds, 100) <= 0) {
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            rtpsink_media *m = &medias[i];
+            if (m->sock < 0) {
+                continue;
+            }
+            int len;
+            while ((len = recv(m->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                now = loadgen_now_ns();
+                if (start == 0) {
+                    /* The clock starts with the first packet */
+                    start = now;
+                }
+                rtpsink_packet(m, buf, len, now);
+                last = now;
+            }
+        }
+    }
+    /* Rates are over the time packets were coming in */
+    double seconds = (last - start) / 1e9;
+
+    json_t *result = json_object();
+    json_object_set_new(result, "seconds", json_real(seconds));
+    for (i = 0; i < 2; i++) {
+        rtpsink_media *m = &medias[i];
+        if (m->sock >= 0) {
+            json_object_set_new(result, m->name, rtpsink_media_json(m, seconds));
+            close(m->sock);
+        }
+        g_free(m->seen);
+        g_array_free(m->latencies, TRUE);
+    }
+    char *text = json_dumps(result, JSON_COMPACT);
+    printf("%s\n", text);
+    free(text);
+    json_decref(result);
+    return 0;
+}